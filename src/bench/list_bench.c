@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include "list.h"
+#include "trie.h"
+
+/** @file
+   @brief Clients list contention benchmark
+
+   Measures how many lookups per second can be performed on a words list holding `BENCH_NICKS` nicknames when 1, 4 and
+      16 threads look nicknames up concurrently with `list_find_and_execute()`, like private messages and WHOIS do on
+      the clients list. One operation out of `BENCH_WRITE_EVERY` is a write instead: a new nickname is added and then
+      deleted, like a client registering and quitting.
+   Each configuration runs twice. The `rwlock` run uses the list as it is. The `mutex` run serializes every operation
+      with an additional mutex around the list calls, which is how the list behaved when it was protected by a plain
+      mutex: lookups had to wait for each other.
+   Build and run it with `make bench`.
+   @author Filipe Goncalves
+   @date November 2013
+ */
+
+/** How many nicknames are in the list */
+#define BENCH_NICKS 10000
+
+/** How many operations each thread performs in each run */
+#define BENCH_OPS 1000000
+
+/** One out of this many operations adds and deletes a nickname; the others are lookups */
+#define BENCH_WRITE_EVERY 64
+
+/** Maps a lower case letter to its position. See `TRIE_ALPHABET()`. */
+#define BENCH_POS(c) ((c) >= 'a' && (c) <= 'z' ? (c) - 'a' : TRIE_INVALID_POS)
+
+/** Maps a position to its lower case letter. See `TRIE_ALPHABET()`. */
+#define BENCH_CHR(p) ((p) < 26 ? 'a' + (p) : '\0')
+
+/** Nicknames are made of lower case letters */
+static TRIE_ALPHABET(bench_alphabet, BENCH_POS, BENCH_CHR, 26);
+
+/** The list being benchmarked */
+static Word_list_ptr list;
+
+/** Serializes every operation in the `mutex` runs */
+static pthread_mutex_t list_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Whether the current run serializes operations with `list_mutex` */
+static int use_mutex;
+
+/** The nicknames stored in the list */
+static char nicks[BENCH_NICKS][8];
+
+/** Data stored for each nickname. `visit()` increments it, so that lookups touch the matching node. */
+static long hits[BENCH_NICKS];
+
+/** Set by the main thread once every thread is created, so that they all start at the same time */
+static int go;
+
+/** Writes the nickname for a number: the letter `a` followed by the number in base 26, using letters as digits.
+   @param n The number.
+   @param nick Where to write the nickname. Must have room for 8 characters.
+ */
+static void make_nick(unsigned long n, char *nick)
+{
+	int i;
+	nick[0] = 'a';
+	for (i = 1; i < 7; i++, n /= 26) {
+		nick[i] = 'a' + n % 26;
+	}
+	nick[7] = '\0';
+}
+
+/** The lookup callback. Runs holding the matching node's lock, like `cmd_privmsg_aux()` does.
+   @param data The matching nickname's counter.
+   @param args Not used.
+   @return `NULL`
+ */
+static void *visit(void *data, void *args)
+{
+	(*(long*)data)++;
+	return NULL;
+}
+
+/** A benchmark thread. Waits for the start signal, and performs `BENCH_OPS` operations.
+   @param arg The thread's number, cast to a pointer. Nicknames added by writes are unique per thread.
+   @return `NULL`
+ */
+static void *worker(void *arg)
+{
+	unsigned long id = (unsigned long)arg;
+	unsigned int seed = (unsigned int)id + 1;
+	char nick[8];
+	int success;
+	long i;
+
+	while (!__atomic_load_n(&go, __ATOMIC_ACQUIRE))
+		;
+	for (i = 0; i < BENCH_OPS; i++) {
+		if (use_mutex) {
+			pthread_mutex_lock(&list_mutex);
+		}
+		if (i % BENCH_WRITE_EVERY == BENCH_WRITE_EVERY - 1) {
+			make_nick(BENCH_NICKS + id * BENCH_OPS + i, nick);
+			if (list_add(list, (void*)&hits[0], nick) != 0 || list_delete(list, nick) == NULL) {
+				fprintf(stderr, "::list_bench.c:worker(): Could not add and delete %s.\n", nick);
+				exit(EXIT_FAILURE);
+			}
+		} else {
+			(void)list_find_and_execute(list, nicks[rand_r(&seed) % BENCH_NICKS], visit, NULL, NULL, NULL,
+						    &success);
+			if (!success) {
+				fprintf(stderr, "::list_bench.c:worker(): Lookup failed.\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (use_mutex) {
+			pthread_mutex_unlock(&list_mutex);
+		}
+	}
+	return NULL;
+}
+
+/** Runs the benchmark once.
+   @param threads How many threads operate on the list concurrently.
+   @return Elapsed time, in seconds, from the start signal until every thread is done.
+ */
+static double run(int threads)
+{
+	pthread_t *ids;
+	struct timespec start;
+	struct timespec end;
+	long i;
+
+	if ((ids = malloc(threads * sizeof(*ids))) == NULL) {
+		fprintf(stderr, "::list_bench.c:run(): Could not allocate memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	go = 0;
+	for (i = 0; i < threads; i++) {
+		pthread_create(&ids[i], NULL, worker, (void*)i);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < threads; i++) {
+		pthread_join(ids[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	free(ids);
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(void)
+{
+	static const int threads[] = { 1, 4, 16 };
+	static const char *modes[] = { "mutex", "rwlock" };
+	double elapsed;
+	int i;
+	int j;
+
+	if ((list = init_word_list(NULL, &bench_alphabet)) == NULL) {
+		fprintf(stderr, "::list_bench.c:main(): Could not create list.\n");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < BENCH_NICKS; i++) {
+		make_nick(i, nicks[i]);
+		if (list_add(list, (void*)&hits[i], nicks[i]) != 0) {
+			fprintf(stderr, "::list_bench.c:main(): Could not add %s.\n", nicks[i]);
+			return EXIT_FAILURE;
+		}
+	}
+	printf("%7s %7s %10s %10s %12s\n", "threads", "lock", "ops", "seconds", "ops/sec");
+	for (i = 0; i < (int)(sizeof(threads) / sizeof(threads[0])); i++) {
+		for (j = 0; j < 2; j++) {
+			use_mutex = (j == 0);
+			elapsed = run(threads[i]);
+			printf("%7d %7s %10ld %10.3f %12.0f\n", threads[i], modes[j], (long)threads[i] * BENCH_OPS, elapsed,
+			       threads[i] * (double)BENCH_OPS / elapsed);
+		}
+	}
+	destroy_word_list(list, LIST_NO_FREE_NODE_DATA);
+	return EXIT_SUCCESS;
+}
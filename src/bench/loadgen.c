@@ -0,0 +1,542 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/** @file
+   @brief Load generator for a running yaIRCd
+
+   Opens many local connections to a running server, registers them with NICK and USER, joins them into channels of a
+      given size, and then sends channel PRIVMSGs at a fixed rate. Each message carries the time it was sent, so every
+      receiver can tell how long the server took to deliver it. At the end, the load generator reports how many
+      deliveries were seen, the delivery throughput, the p50/p99/p999 delivery latency, and, if the server's PID is
+      given, the server's RSS and CPU usage during the run.
+   Everything runs in a single thread with `epoll`, so the load generator's own overhead stays low and predictable.
+   Typical usage, after `make bench`:
+   <pre>
+   ./yaircd.out &
+   ./loadgen.out -c 2000 -s 50 -r 2000 -d 10 -P $!
+   </pre>
+   Options:
+   <ul>
+   <li>`-H host` and `-p port`: where the server is listening. Defaults to `127.0.0.1:6667`.</li>
+   <li>`-c clients`: how many connections to open. Defaults to 1000.</li>
+   <li>`-s size`: how many clients in each channel. Defaults to 50.</li>
+   <li>`-r rate`: how many PRIVMSGs per second are sent, in total. Defaults to 1000.</li>
+   <li>`-d seconds`: how long to send messages for. Defaults to 10.</li>
+   <li>`-P pid`: the server's PID, to report its RSS and CPU usage.</li>
+   </ul>
+   Keep the server's SendQ and the open files limits in mind when asking for thousands of clients: clients evicted by
+      the server are reported as disconnections.
+   @author Filipe Goncalves
+   @date November 2013
+ */
+
+/** Size of each connection's input buffer. Must hold at least one full IRC message. */
+#define LG_BUF_SIZE 4096
+
+/** How many `epoll` events are processed at a time */
+#define LG_MAX_EVENTS 256
+
+/** How many connections may be waiting for the server's first line at a time. The listen backlog is usually small (see
+   `max_hangup_clients` in the configuration file); once it is full, new connection attempts are dropped and only
+   retried by the kernel a second later.
+ */
+#define LG_CONNECT_BATCH 4
+
+/** How long to wait for late deliveries once the load generator stops sending, in milliseconds */
+#define LG_DRAIN_MS 2000
+
+/** How long to wait for every client to register, or to join, in milliseconds */
+#define LG_SETUP_TIMEOUT_MS 60000
+
+/** Marker that identifies the load generator's messages */
+#define LG_MARKER " :LG "
+
+/** Connection states */
+enum lg_state {
+	LG_REGISTERING, /**<NICK and USER were sent; waiting for RPL_WELCOME */
+	LG_REGISTERED, /**<Registered; JOIN not sent yet */
+	LG_JOINING, /**<JOIN was sent; waiting for the end of NAMES */
+	LG_READY, /**<In the channel */
+	LG_DEAD /**<Disconnected */
+};
+
+/** A connection to the server */
+struct lg_conn {
+	int fd; /**<The socket */
+	enum lg_state state; /**<Where this connection is in its life cycle */
+	int channel; /**<Which channel this connection joins */
+	int greeted; /**<Set once the server sent something; it accepted the connection by then */
+	size_t in_len; /**<How many characters are in `in` */
+	char in[LG_BUF_SIZE]; /**<Characters read, not yet processed */
+};
+
+/** Load generator settings and counters */
+static struct {
+	const char *host;
+	int port;
+	int clients;
+	int channel_size;
+	int rate;
+	int duration;
+	pid_t server_pid;
+	int epoll_fd;
+	struct lg_conn *conns;
+	int greeted;
+	int registered;
+	int joined;
+	int dead;
+	int registering; /* connections waiting for RPL_WELCOME */
+	int joining; /* connections waiting for the end of NAMES */
+	int ready; /* connections in their channel */
+	int *channel_ready; /* per channel, how many of its members are ready */
+	long sent;
+	long send_failures;
+	long expected;
+	uint32_t *latencies; /* microseconds */
+	long latencies_count;
+	long latencies_capacity;
+} lg;
+
+/** Reads the monotonic clock.
+   @return Current time, in microseconds.
+ */
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/** Writes a letters only representation of a number. Nicknames cannot hold digits.
+   @param buf Where to write. Must hold at least 7 characters.
+   @param n The number.
+ */
+static void letters(char *buf, int n)
+{
+	int i;
+	for (i = 0; i < 6; i++) {
+		buf[i] = (char)('a' + n % 26);
+		n /= 26;
+	}
+	buf[6] = '\0';
+}
+
+/** Sends a line to the server. Sockets are non-blocking; a line that does not fit in the socket buffer is dropped and
+   counted in `send_failures`.
+   @param conn The connection.
+   @param fmt `printf()` format.
+   @return `1` if the whole line was written; `0` if it was dropped.
+ */
+static int send_line(struct lg_conn *conn, const char *fmt, ...)
+{
+	char buf[512];
+	va_list ap;
+	int len;
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (send(conn->fd, buf, (size_t)len, MSG_NOSIGNAL) != len) {
+		lg.send_failures++;
+		return 0;
+	}
+	return 1;
+}
+
+/** Records a delivery latency.
+   @param us The latency, in microseconds.
+ */
+static void record_latency(uint64_t us)
+{
+	uint32_t *grown;
+	if (lg.latencies_count == lg.latencies_capacity) {
+		lg.latencies_capacity = (lg.latencies_capacity == 0 ? 65536 : 2 * lg.latencies_capacity);
+		if ((grown = realloc(lg.latencies, lg.latencies_capacity * sizeof(*grown))) == NULL) {
+			fprintf(stderr, "::loadgen.c:record_latency(): Could not allocate memory.\n");
+			exit(EXIT_FAILURE);
+		}
+		lg.latencies = grown;
+	}
+	lg.latencies[lg.latencies_count++] = (uint32_t)(us > UINT32_MAX ? UINT32_MAX : us);
+}
+
+/** Processes a line received from the server.
+   @param conn The connection that received it.
+   @param line The line, null terminated, without the line terminator.
+ */
+static void handle_line(struct lg_conn *conn, char *line)
+{
+	char *p;
+	if (!conn->greeted) {
+		conn->greeted = 1;
+		lg.greeted++;
+	}
+	if (strncmp(line, "PING ", 5) == 0) {
+		send_line(conn, "PONG %s\r\n", line + 5);
+	} else if ((p = strstr(line, LG_MARKER)) != NULL) {
+		record_latency(now_us() - strtoull(p + strlen(LG_MARKER), NULL, 10));
+	} else if (conn->state == LG_REGISTERING && strstr(line, " 001 ") != NULL) {
+		conn->state = LG_REGISTERED;
+		lg.registering--;
+		lg.registered++;
+	} else if (conn->state == LG_JOINING && strstr(line, " 366 ") != NULL) {
+		conn->state = LG_READY;
+		lg.joining--;
+		lg.joined++;
+		lg.ready++;
+		lg.channel_ready[conn->channel]++;
+	}
+}
+
+/** Closes a connection that the server dropped.
+   @param conn The connection.
+ */
+static void conn_dead(struct lg_conn *conn)
+{
+	if (conn->state != LG_DEAD) {
+		if (conn->state == LG_REGISTERING) {
+			lg.registering--;
+		} else if (conn->state == LG_JOINING) {
+			lg.joining--;
+		} else if (conn->state == LG_READY) {
+			lg.ready--;
+			lg.channel_ready[conn->channel]--;
+		}
+		conn->state = LG_DEAD;
+		lg.dead++;
+		close(conn->fd);
+	}
+}
+
+/** Reads everything available on a connection, and processes every complete line.
+   @param conn The connection.
+ */
+static void conn_read(struct lg_conn *conn)
+{
+	ssize_t n;
+	char *start;
+	char *end;
+	for (;;) {
+		n = recv(conn->fd, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len - 1, 0);
+		if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+			conn_dead(conn);
+			return;
+		}
+		if (n == -1) {
+			return;
+		}
+		conn->in_len += (size_t)n;
+		conn->in[conn->in_len] = '\0';
+		for (start = conn->in; (end = strchr(start, '\n')) != NULL; start = end + 1) {
+			*end = '\0';
+			if (end > start && *(end - 1) == '\r') {
+				*(end - 1) = '\0';
+			}
+			handle_line(conn, start);
+		}
+		conn->in_len -= (size_t)(start - conn->in);
+		memmove(conn->in, start, conn->in_len);
+		if (conn->in_len == sizeof(conn->in) - 1) {
+			/* A line longer than the buffer; not one of ours, drop it */
+			conn->in_len = 0;
+		}
+	}
+}
+
+/** Waits for events on every connection, and processes them.
+   @param timeout_ms How long to wait for the first event, in milliseconds.
+ */
+static void pump(int timeout_ms)
+{
+	struct epoll_event events[LG_MAX_EVENTS];
+	int n;
+	int i;
+	n = epoll_wait(lg.epoll_fd, events, LG_MAX_EVENTS, timeout_ms);
+	for (i = 0; i < n; i++) {
+		conn_read((struct lg_conn*)events[i].data.ptr);
+	}
+}
+
+/** Opens a connection and sends NICK and USER.
+   @param conn The connection.
+   @param id The connection's number, used to build its nickname.
+   @param addr The server's address.
+   @return `0` on success; `-1` if the connection could not be opened.
+ */
+static int conn_open(struct lg_conn *conn, int id, struct sockaddr_in *addr)
+{
+	struct epoll_event ev;
+	char nick[7];
+	if ((conn->fd = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+	    connect(conn->fd, (struct sockaddr*)addr, sizeof(*addr)) == -1) {
+		perror("::loadgen.c:conn_open(): Could not connect");
+		return -1;
+	}
+	fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+	conn->state = LG_REGISTERING;
+	lg.registering++;
+	conn->channel = id / lg.channel_size;
+	conn->in_len = 0;
+	ev.events = EPOLLIN;
+	ev.data.ptr = conn;
+	epoll_ctl(lg.epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev);
+	letters(nick, id);
+	send_line(conn, "NICK l%s\r\nUSER lg 0 * :yaIRCd load generator\r\n", nick);
+	return 0;
+}
+
+/** Keeps processing events until no connection is pending anymore, that is, until each of them either got the reply
+   it was waiting for or died, or until `LG_SETUP_TIMEOUT_MS` elapse.
+   @param pending How many connections are waiting: `lg.registering` or `lg.joining`.
+   @return `0` if no connection is pending; `-1` on timeout.
+ */
+static int wait_for(int *pending)
+{
+	uint64_t deadline;
+	deadline = now_us() + (uint64_t)LG_SETUP_TIMEOUT_MS * 1000;
+	while (*pending > 0) {
+		if (now_us() > deadline) {
+			return -1;
+		}
+		pump(100);
+	}
+	return 0;
+}
+
+/** Reads a server's resource usage from `/proc`.
+   @param pid The server's PID.
+   @param rss_kb Where to store the resident set size, in kB.
+   @param cpu_ticks Where to store the user plus system CPU time, in clock ticks.
+   @return `0` on success; `-1` if `/proc` could not be read.
+ */
+static int server_usage(pid_t pid, long *rss_kb, unsigned long *cpu_ticks)
+{
+	char path[64];
+	char line[256];
+	char *p;
+	unsigned long utime;
+	unsigned long stime;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+	if ((f = fopen(path, "r")) == NULL) {
+		return -1;
+	}
+	*rss_kb = -1;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, "VmRSS:", 6) == 0) {
+			*rss_kb = strtol(line + 6, NULL, 10);
+		}
+	}
+	fclose(f);
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if ((f = fopen(path, "r")) == NULL) {
+		return -1;
+	}
+	if (fgets(line, sizeof(line), f) == NULL || (p = strrchr(line, ')')) == NULL ||
+	    sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	*cpu_ticks = utime + stime;
+	return 0;
+}
+
+/** `qsort()` comparison function for latencies.
+   @param a First latency.
+   @param b Second latency.
+   @return Negative, zero or positive, as `qsort()` expects.
+ */
+static int cmp_latency(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+/** Reads a latency percentile. The latencies must be sorted.
+   @param p The percentile, between `0` and `1`.
+   @return The latency, in microseconds.
+ */
+static uint32_t percentile(double p)
+{
+	long i;
+	if (lg.latencies_count == 0) {
+		return 0;
+	}
+	i = (long)(p * (double)lg.latencies_count);
+	return lg.latencies[i >= lg.latencies_count ? lg.latencies_count - 1 : i];
+}
+
+/** Sends channel messages at the target rate for the configured duration. Senders are picked round robin among the
+   connections that are in their channel. Each message costs the server one delivery per other member of the channel
+   that is still connected. If every connection died, nothing is sent anymore.
+ */
+static void drive(void)
+{
+	uint64_t start;
+	uint64_t now;
+	uint64_t end;
+	long due;
+	long next;
+	struct lg_conn *conn;
+
+	start = now_us();
+	end = start + (uint64_t)lg.duration * 1000000;
+	next = 0;
+	while ((now = now_us()) < end) {
+		due = (long)((now - start) * (uint64_t)lg.rate / 1000000);
+		/* A ready connection exists whenever lg.ready > 0, so the search below always ends */
+		while (lg.sent < due && lg.ready > 0) {
+			conn = &lg.conns[next++ % lg.clients];
+			if (conn->state != LG_READY) {
+				continue;
+			}
+			/* A dropped line means the server is behind: let pump() drain replies before trying again */
+			if (!send_line(conn, "PRIVMSG #lg%d%s%llu\r\n", conn->channel, LG_MARKER, (unsigned long long)now_us())) {
+				break;
+			}
+			lg.expected += lg.channel_ready[conn->channel] - 1;
+			lg.sent++;
+		}
+		pump(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_in addr;
+	struct rlimit rl;
+	uint64_t t0;
+	uint64_t t1;
+	long rss_before, rss_after;
+	unsigned long cpu_before, cpu_after;
+	int have_usage;
+	int opt;
+	int i;
+
+	lg.host = "127.0.0.1";
+	lg.port = 6667;
+	lg.clients = 1000;
+	lg.channel_size = 50;
+	lg.rate = 1000;
+	lg.duration = 10;
+	lg.server_pid = 0;
+	while ((opt = getopt(argc, argv, "H:p:c:s:r:d:P:")) != -1) {
+		switch (opt) {
+		case 'H': lg.host = optarg; break;
+		case 'p': lg.port = atoi(optarg); break;
+		case 'c': lg.clients = atoi(optarg); break;
+		case 's': lg.channel_size = atoi(optarg); break;
+		case 'r': lg.rate = atoi(optarg); break;
+		case 'd': lg.duration = atoi(optarg); break;
+		case 'P': lg.server_pid = (pid_t)atoi(optarg); break;
+		default:
+			fprintf(stderr, "Usage: %s [-H host] [-p port] [-c clients] [-s channel size] [-r msgs/sec] "
+				"[-d seconds] [-P server pid]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (lg.clients <= 0 || lg.channel_size <= 1 || lg.rate <= 0 || lg.duration <= 0) {
+		fprintf(stderr, "::loadgen.c:main(): clients, rate and duration must be positive, channel size at least 2.\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Thousands of connections need thousands of descriptors */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((unsigned short)lg.port);
+	if (inet_pton(AF_INET, lg.host, &addr.sin_addr) != 1) {
+		fprintf(stderr, "::loadgen.c:main(): Invalid IPv4 address: %s\n", lg.host);
+		return EXIT_FAILURE;
+	}
+	if ((lg.conns = calloc((size_t)lg.clients, sizeof(*lg.conns))) == NULL ||
+	    (lg.channel_ready = calloc((size_t)((lg.clients + lg.channel_size - 1) / lg.channel_size),
+				       sizeof(*lg.channel_ready))) == NULL ||
+	    (lg.epoll_fd = epoll_create1(0)) == -1) {
+		perror("::loadgen.c:main(): Could not set up");
+		return EXIT_FAILURE;
+	}
+
+	/* Registration */
+	t0 = now_us();
+	for (i = 0; i < lg.clients; i++) {
+		if (conn_open(&lg.conns[i], i, &addr) == -1) {
+			return EXIT_FAILURE;
+		}
+		while (i + 1 - lg.greeted - lg.dead >= LG_CONNECT_BATCH) {
+			pump(100);
+		}
+	}
+	if (wait_for(&lg.registering) == -1) {
+		fprintf(stderr, "::loadgen.c:main(): Timed out waiting for registration (%d of %d).\n", lg.registered,
+			lg.clients);
+		return EXIT_FAILURE;
+	}
+	t1 = now_us();
+	printf("registered %d clients in %.3f s (%.0f/s)\n", lg.registered, (t1 - t0) / 1e6,
+	       lg.registered / ((t1 - t0) / 1e6));
+
+	/* Channels */
+	t0 = now_us();
+	for (i = 0; i < lg.clients; i++) {
+		if (lg.conns[i].state == LG_REGISTERED) {
+			lg.conns[i].state = LG_JOINING;
+			lg.joining++;
+			send_line(&lg.conns[i], "JOIN #lg%d\r\n", lg.conns[i].channel);
+		}
+		if (i % 64 == 63) {
+			pump(0);
+		}
+	}
+	if (wait_for(&lg.joining) == -1) {
+		fprintf(stderr, "::loadgen.c:main(): Timed out waiting for JOINs (%d of %d).\n", lg.joined, lg.registered);
+		return EXIT_FAILURE;
+	}
+	t1 = now_us();
+	printf("joined %d clients into %d channels of up to %d in %.3f s\n", lg.joined,
+	       (lg.clients + lg.channel_size - 1) / lg.channel_size, lg.channel_size, (t1 - t0) / 1e6);
+
+	/* Load */
+	have_usage = lg.server_pid > 0 && server_usage(lg.server_pid, &rss_before, &cpu_before) == 0;
+	t0 = now_us();
+	drive();
+	t1 = now_us();
+	for (i = 0; i < LG_DRAIN_MS / 10 && lg.latencies_count < lg.expected; i++) {
+		pump(10);
+	}
+	have_usage = have_usage && server_usage(lg.server_pid, &rss_after, &cpu_after) == 0;
+
+	qsort(lg.latencies, (size_t)lg.latencies_count, sizeof(*lg.latencies), cmp_latency);
+	printf("sent %ld msgs in %.3f s (%.0f/s), %ld send failures\n", lg.sent, (t1 - t0) / 1e6, lg.sent / ((t1 - t0) / 1e6),
+	       lg.send_failures);
+	printf("deliveries %ld of %ld expected (%.0f/s)\n", lg.latencies_count, lg.expected,
+	       lg.latencies_count / ((t1 - t0) / 1e6));
+	printf("latency us: p50 %u p99 %u p999 %u max %u\n", percentile(0.5), percentile(0.99), percentile(0.999),
+	       percentile(1.0));
+	printf("disconnected clients: %d\n", lg.dead);
+	if (have_usage) {
+		printf("server RSS: %ld kB -> %ld kB\n", rss_before, rss_after);
+		printf("server CPU: %.1f%%\n",
+		       100.0 * (cpu_after - cpu_before) / sysconf(_SC_CLK_TCK) / ((now_us() - t0) / 1e6));
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,374 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "protocol.h"
+#include "parsemsg.h"
+
+/** @file
+   @brief IRC messages parser benchmark
+
+   Checks `parse_msg()` against a candidate tokenizer, `mask_parse_msg()`, and compares their speed.
+   `parse_msg()` walks messages one character at a time with `skipspaces()` and `skipnonspaces()`. The candidate first
+      compares the message against ' ' and ':' 16 characters at a time with SSE2, 64 characters at a time as they are
+      needed, and then finds the tokens with bit scans. Both parsers are first fed `BENCH_RANDOM` random messages, made
+      of the characters that matter to a tokenizer (spaces, colons, letters and digits), and must agree on the return
+      value, on the prefix, command and parameters found, and on the buffer contents afterwards. Then, each parser
+      parses a set of typical messages `BENCH_ROUNDS` times.
+   So far, the candidate loses: the part of a message that is tokenized, before the trailing parameter, is usually a
+      few dozen characters long, and walking it costs less than building and scanning the bitmaps. It is kept here so
+      that it can be measured again when the parser or the messages change.
+   Build and run it with `make bench`.
+   @author Filipe Goncalves
+   @date November 2013
+ */
+
+/** How many random messages both parsers must agree on */
+#define BENCH_RANDOM 2000000
+
+/** How many times each typical message is parsed by each parser */
+#define BENCH_ROUNDS 1000000
+
+/** How many messages are copied, and then parsed, at a time */
+#define BENCH_BATCH 1024
+
+/** Messages like the ones clients send all the time */
+static const char *typical[] = {
+	"PRIVMSG #yaircd :Hello everyone, has anyone tried the new release yet? It builds fine over here.",
+	":nick!user@host PRIVMSG somebody :short one",
+	"JOIN #yaircd,#help,#offtopic",
+	"PONG :starwars.development.yaircd.org",
+	"NICK somebody",
+	"USER guest 0 * :Real Name Goes Here",
+	"MODE #yaircd +ov somebody somebody",
+	"PRIVMSG a,b,c,d,e,f,g,h,i,j,k,l,m,n :This is a fairly long message that spans a good part of the line limit, "
+	"the kind of thing pasted text and bots send, with plenty of words and spaces in it so that the tokenizer has "
+	"some work to do"
+};
+
+/** How many typical messages there are */
+#define TYPICAL ((int)(sizeof(typical) / sizeof(typical[0])))
+
+/** How many messages each parser parses: every typical message `BENCH_ROUNDS` times, rounded up to whole batches */
+#define BENCH_MESSAGES (((long)BENCH_ROUNDS * TYPICAL + BENCH_BATCH - 1) / BENCH_BATCH * BENCH_BATCH)
+
+/** Words needed to hold one bit per character of the longest message */
+#define LINE_MASK_WORDS ((MAX_MSG_SIZE + 63) / 64)
+
+/** Bitmaps of the white spaces and colons in a message, filled 64 characters at a time, as they are needed */
+struct line_masks {
+	uint64_t spaces[LINE_MASK_WORDS]; /**<Bits set for the ' ' characters. Tabs are not considered white space. */
+	uint64_t colons[LINE_MASK_WORDS]; /**<Bits set for the ':' characters. */
+	const char *buf; /**<The message. */
+	int len; /**<The message's length. It never exceeds `MAX_MSG_SIZE`. */
+	int scanned; /**<How many words of `spaces` and `colons` were filled. */
+};
+
+/** Fills the next word of the bitmaps of a message, that is, compares the next 64 characters against ' ' and ':'.
+   @param masks The message's bitmaps. `masks->scanned` must be lower than the number of words the message needs.
+ */
+static void mask_scan_block(struct line_masks *masks)
+{
+	const char *buf = masks->buf;
+	int len = masks->len;
+	int w = masks->scanned++;
+	uint64_t sp = 0;
+	uint64_t co = 0;
+	int i;
+#ifdef __SSE2__
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i colon = _mm_set1_epi8(':');
+	__m128i chunk;
+	int shift;
+
+	if (len >= 16) {
+		for (i = w * 64; i < w * 64 + 64 && i < len; i += 16) {
+			/* The last chunk is loaded so that it ends with the message, and its bits are shifted into place;
+			   nothing past the end of the message is ever read */
+			shift = i + 16 > len ? i + 16 - len : 0;
+			chunk = _mm_loadu_si128((const __m128i*)(buf + i - shift));
+			sp |= (uint64_t)((unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, space)) >> shift) << (i % 64);
+			co |= (uint64_t)((unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, colon)) >> shift) << (i % 64);
+		}
+		masks->spaces[w] = sp;
+		masks->colons[w] = co;
+		return;
+	}
+#endif
+	for (i = w * 64; i < w * 64 + 64 && i < len; i++) {
+		sp |= (uint64_t)(buf[i] == ' ') << (i % 64);
+		co |= (uint64_t)(buf[i] == ':') << (i % 64);
+	}
+	masks->spaces[w] = sp;
+	masks->colons[w] = co;
+}
+
+/** Finds the first position, starting at `pos`, that is (or is not) a white space.
+   @param masks The message's bitmaps.
+   @param pos Where to start. May be past the end of the message.
+   @param flip `0` to look for a white space; `~0` to look for anything else.
+   @return The position found; the message's length if there is none.
+ */
+static int mask_find_space(struct line_masks *masks, int pos, uint64_t flip)
+{
+	uint64_t bits;
+	int w;
+	if (pos >= masks->len) {
+		return masks->len;
+	}
+	w = pos / 64;
+	while (masks->scanned <= w) {
+		mask_scan_block(masks);
+	}
+	for (bits = (masks->spaces[w] ^ flip) & (~(uint64_t)0 << (pos % 64)); bits == 0; bits = masks->spaces[w] ^ flip) {
+		if (++w * 64 >= masks->len) {
+			return masks->len;
+		}
+		mask_scan_block(masks);
+	}
+	pos = w * 64 + __builtin_ctzll(bits);
+	return pos < masks->len ? pos : masks->len;
+}
+
+/** Searches for the next position in a message, starting at `pos`, that is not a white space. Tabs are not considered
+   white space.
+   @return The position found; the message's length if there is none.
+ */
+#define mask_skipspaces(masks, pos) mask_find_space((masks), (pos), ~(uint64_t)0)
+
+/** Searches for the next position in a message, starting at `pos`, that is a white space. Tabs are not considered white
+   space.
+   @return The position found; the message's length if there is none.
+ */
+#define mask_skipnonspaces(masks, pos) mask_find_space((masks), (pos), 0)
+
+/** Tells whether the character at a position of a message is ':'. `pos` must be lower than the message's length, and
+   must have been returned by `mask_skipspaces()` or `mask_skipnonspaces()`, so that its word was filled. */
+#define mask_is_colon(masks, pos) (((masks)->colons[(pos) / 64] >> ((pos) % 64)) & 1)
+
+/** `read_params()` on top of the bitmaps.
+   @param buf The message.
+   @param masks The message's bitmaps.
+   @param pos Where the parameters begin in `buf`.
+   @param params Where to store the parameters.
+   @return The number of parameters read, or `-1` if there are more than `MAX_IRC_PARAMS`.
+ */
+static int mask_read_params(char *buf, struct line_masks *masks, int pos, char *params[MAX_IRC_PARAMS])
+{
+	int count;
+	int next;
+
+	count = 0;
+	for (pos = mask_skipspaces(masks, pos); pos < masks->len && !mask_is_colon(masks, pos); pos = mask_skipspaces(masks, next + 1)) {
+		/* assert: buf[pos] != ' ' && buf[pos] != ':', so this is a non-empty sequence, as required by the RFC */
+		if (count == MAX_IRC_PARAMS) {
+			return -1; /* Sorry buddy, no buffer overflow hacks! */
+		}
+		params[count++] = buf + pos;
+		next = mask_skipnonspaces(masks, pos);
+		buf[next] = '\0';
+	}
+	if (pos < masks->len) {
+		/* A trailing parameter, which may be empty. We allow for spaces after ':' in the parameters list. The RFC
+		   does not; but this is harmless :) */
+		if (count == MAX_IRC_PARAMS) {
+			return -1;
+		}
+		params[count++] = buf + mask_skipspaces(masks, pos + 1);
+	}
+	return count;
+}
+
+/** `parse_msg()` on top of the bitmaps. Messages longer than `MAX_MSG_SIZE` are rejected.
+   @return Same as `parse_msg()`.
+ */
+static int mask_parse_msg(char *buf, char **prefix, char **cmd, char *params[MAX_IRC_PARAMS], int *params_filled)
+{
+	struct line_masks masks;
+	size_t len;
+	char *current;
+	int pos;
+	int next;
+	int ret;
+
+	if ((len = strlen(buf)) > MAX_MSG_SIZE) {
+		return -1;
+	}
+	masks.buf = buf;
+	masks.len = (int)len;
+	masks.scanned = 0;
+	pos = mask_skipspaces(&masks, 0);
+	ret = 0;
+	*prefix = NULL;
+	if (pos < masks.len && mask_is_colon(&masks, pos)) {
+		next = mask_skipnonspaces(&masks, pos + 1);
+		if (next == masks.len || next == pos + 1) {
+			/* Sender said there was a prefix, but there's no prefix */
+			return -1;
+		}
+		buf[next] = '\0';
+		*prefix = buf + pos + 1;
+		ret = 1;
+		pos = next + 1;
+	}
+	pos = mask_skipspaces(&masks, pos);
+	if (pos == masks.len) {
+		return -1;
+	}
+	/* Parse command */
+	current = buf + pos;
+	if (isdigit((unsigned char)*current)) {
+		if (isdigit((unsigned char)*(current + 1)) && isdigit((unsigned char)*(current + 2)) &&
+		    (*(current + 3) == '\0' || *(current + 3) == ' ')) {
+			next = pos + 3;
+		}else {
+			return -1;
+		}
+	}else {
+		next = mask_skipnonspaces(&masks, pos);
+		for (; current != buf + next; current++) {
+			if (!isalpha((unsigned char)*current)) {
+				/* Invalid command */
+				return -1;
+			}
+		}
+		current = buf + pos;
+	}
+	*params_filled = 0;
+	/* assert: buf[next] == ' ' || buf[next] == '\0' */
+	if (next < masks.len && (*params_filled = mask_read_params(buf, &masks, next + 1, params)) == -1) {
+		return -1;
+	}
+	buf[next] = '\0';
+	*cmd = current;
+	return ret;
+}
+
+/** Writes a random message.
+   @param buf Where to write it. Must have room for `MAX_MSG_SIZE` characters.
+   @param seed `rand_r()` state.
+ */
+static void random_message(char *buf, unsigned int *seed)
+{
+	static const char chars[] = "     ::abcAB09";
+	int len;
+	int i;
+	/* Mostly short messages, so that prefixes, commands and the parameters limit are hit often */
+	len = rand_r(seed) % 4 == 0 ? rand_r(seed) % (int)MAX_MSG_SIZE : rand_r(seed) % 48;
+	for (i = 0; i < len; i++) {
+		buf[i] = chars[rand_r(seed) % (sizeof(chars) - 1)];
+	}
+	buf[len] = '\0';
+}
+
+/** Parses a message with both parsers, and checks that they agree.
+   @param msg The message. It is not changed.
+   @return `0` if the parsers agree; `-1` otherwise.
+ */
+static int compare(const char *msg)
+{
+	char a[MAX_MSG_SIZE + 1];
+	char b[MAX_MSG_SIZE + 1];
+	char *prefix_a, *prefix_b, *cmd_a, *cmd_b;
+	char *params_a[MAX_IRC_PARAMS], *params_b[MAX_IRC_PARAMS];
+	int filled_a, filled_b;
+	int ret_a, ret_b;
+	size_t len = strlen(msg);
+	int i;
+
+	memcpy(a, msg, len + 1);
+	memcpy(b, msg, len + 1);
+	ret_a = parse_msg(a, &prefix_a, &cmd_a, params_a, &filled_a);
+	ret_b = mask_parse_msg(b, &prefix_b, &cmd_b, params_b, &filled_b);
+	if (ret_a != ret_b) {
+		return -1;
+	}
+	if (ret_a == -1) {
+		return 0;
+	}
+	if ((prefix_a == NULL) != (prefix_b == NULL) || (prefix_a != NULL && prefix_a - a != prefix_b - b) ||
+	    cmd_a - a != cmd_b - b || filled_a != filled_b || memcmp(a, b, len + 1) != 0) {
+		return -1;
+	}
+	for (i = 0; i < filled_a; i++) {
+		if (params_a[i] - a != params_b[i] - b) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/** Parses `BENCH_MESSAGES` messages with a parser, going through the typical messages over and over.
+   Parsing is destructive, so messages are copied to `batch` before being parsed, `BENCH_BATCH` at a time, and only the
+      parsing is timed. Copying right before parsing would make the parser read what was just written, which the CPU
+      serves much slower to wide loads than to byte loads, and that never happens to messages read from a socket.
+   @param parser The parser.
+   @return Elapsed time, in seconds.
+ */
+static double run(int (*parser)(char *, char **, char **, char **, int *))
+{
+	static char batch[BENCH_BATCH][MAX_MSG_SIZE + 1];
+	char *prefix, *cmd;
+	char *params[MAX_IRC_PARAMS];
+	size_t lens[TYPICAL];
+	struct timespec start;
+	struct timespec end;
+	volatile int sink = 0;
+	double elapsed = 0;
+	int filled;
+	long i;
+	int j;
+
+	for (j = 0; j < TYPICAL; j++) {
+		lens[j] = strlen(typical[j]);
+	}
+	for (i = 0; i < BENCH_MESSAGES; i += BENCH_BATCH) {
+		for (j = 0; j < BENCH_BATCH; j++) {
+			memcpy(batch[j], typical[j % TYPICAL], lens[j % TYPICAL] + 1);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (j = 0; j < BENCH_BATCH; j++) {
+			sink += parser(batch[j], &prefix, &cmd, params, &filled);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		elapsed += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	}
+	return elapsed;
+}
+
+int main(void)
+{
+	char msg[MAX_MSG_SIZE + 1];
+	unsigned int seed = 1;
+	double elapsed;
+	long messages;
+	long i;
+	int j;
+
+	for (i = 0; i < BENCH_RANDOM; i++) {
+		random_message(msg, &seed);
+		if (compare(msg) != 0) {
+			fprintf(stderr, "::parse_bench.c:main(): Parsers disagree on \"%s\".\n", msg);
+			return EXIT_FAILURE;
+		}
+	}
+	for (j = 0; j < TYPICAL; j++) {
+		if (compare(typical[j]) != 0) {
+			fprintf(stderr, "::parse_bench.c:main(): Parsers disagree on \"%s\".\n", typical[j]);
+			return EXIT_FAILURE;
+		}
+	}
+	printf("Parsers agree on %d random messages.\n", BENCH_RANDOM);
+	messages = BENCH_MESSAGES;
+	printf("%10s %10s %10s %10s\n", "parser", "messages", "seconds", "ns/msg");
+	elapsed = run(parse_msg);
+	printf("%10s %10ld %10.3f %10.1f\n", "parse_msg", messages, elapsed, elapsed * 1e9 / messages);
+	elapsed = run(mask_parse_msg);
+	printf("%10s %10ld %10.3f %10.1f\n", "mask", messages, elapsed, elapsed * 1e9 / messages);
+	return EXIT_SUCCESS;
+}
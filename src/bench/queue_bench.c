@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "client.h"
+#include "write_msgs_queue.h"
+
+/** @file
+   @brief Write queue enqueue throughput benchmark
+
+   Measures how many messages per second can be enqueued in a single client's queue when 1, 8 and 64 threads enqueue
+      concurrently, while the client's worker (simulated by a consumer thread) keeps dequeueing them. This is the
+      situation of a popular user sitting in busy channels: every peer's worker delivers to the same queue.
+   Producers enqueue the same shared message over and over, like channel fan-out does. The SendQ is unlimited, so no
+      message is ever refused.
+   Build and run it with `make bench`.
+   @author Filipe Goncalves
+   @date November 2013
+ */
+
+/** How many messages are enqueued in each run, split evenly among the producers */
+#define BENCH_MESSAGES 4000000
+
+/** The queue being benchmarked */
+static struct msg_queue queue;
+
+/** The message every producer enqueues */
+static struct shared_msg *message;
+
+/** Set by the main thread once every producer is created, so that they all start at the same time */
+static int go;
+
+/** `flush_queue()` lives in the same file as the queue, and needs this symbol from `msgio.c`. The benchmark never
+   flushes, so this is never called.
+ */
+int io_would_block(struct irc_client *client, int ret)
+{
+	return 0;
+}
+
+/** A producer thread. Waits for the start signal, and enqueues its share of messages.
+   @param arg How many messages to enqueue, cast to a pointer.
+   @return `NULL`
+ */
+static void *producer(void *arg)
+{
+	long count = (long)arg;
+	long i;
+	while (!__atomic_load_n(&go, __ATOMIC_ACQUIRE))
+		;
+	for (i = 0; i < count; i++) {
+		if (client_enqueue_shared(&queue, message) == -1) {
+			fprintf(stderr, "::queue_bench.c:producer(): Enqueue failed.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	return NULL;
+}
+
+/** The consumer thread. Dequeues messages until every message enqueued by the producers was seen.
+   @param arg How many messages to expect, cast to a pointer.
+   @return `NULL`
+ */
+static void *consumer(void *arg)
+{
+	long count = (long)arg;
+	struct shared_msg *msg;
+	while (count > 0) {
+		if ((msg = client_dequeue(&queue)) != NULL) {
+			shared_msg_release(msg);
+			count--;
+		}
+	}
+	return NULL;
+}
+
+/** Runs the benchmark once.
+   @param producers How many producer threads enqueue concurrently.
+   @return Elapsed time, in seconds, from the start signal until the consumer saw every message.
+ */
+static double run(int producers)
+{
+	pthread_t *threads;
+	pthread_t consumer_thread;
+	struct timespec start;
+	struct timespec end;
+	long per_producer;
+	int i;
+
+	per_producer = BENCH_MESSAGES / producers;
+	if ((threads = malloc(producers * sizeof(*threads))) == NULL || client_queue_init(&queue, SIZE_MAX) == -1) {
+		fprintf(stderr, "::queue_bench.c:run(): Could not allocate memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	go = 0;
+	for (i = 0; i < producers; i++) {
+		pthread_create(&threads[i], NULL, producer, (void*)per_producer);
+	}
+	pthread_create(&consumer_thread, NULL, consumer, (void*)(per_producer * producers));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < producers; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	pthread_join(consumer_thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	client_queue_destroy(&queue);
+	free(threads);
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(void)
+{
+	static const int producers[] = { 1, 8, 64 };
+	double elapsed;
+	int i;
+
+	message = shared_msg_new(":nick!user@host PRIVMSG #channel :hello, world\r\n",
+				 strlen(":nick!user@host PRIVMSG #channel :hello, world\r\n"));
+	if (message == NULL) {
+		fprintf(stderr, "::queue_bench.c:main(): Could not allocate memory.\n");
+		return EXIT_FAILURE;
+	}
+	printf("%9s %10s %10s %14s\n", "producers", "messages", "seconds", "enqueues/sec");
+	for (i = 0; i < (int)(sizeof(producers) / sizeof(producers[0])); i++) {
+		elapsed = run(producers[i]);
+		printf("%9d %10d %10.3f %14.0f\n", producers[i], (BENCH_MESSAGES / producers[i]) * producers[i], elapsed,
+		       (BENCH_MESSAGES / producers[i]) * producers[i] / elapsed);
+	}
+	shared_msg_release(message);
+	return EXIT_SUCCESS;
+}
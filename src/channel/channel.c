@@ -1,5 +1,7 @@
 #include <pthread.h>
 #include <limits.h>
+#include <stdlib.h>
+#include <string.h>
 #include <ev.h>
 #include "trie.h"
 #include "list.h"
@@ -10,6 +12,7 @@
 #include "serverinfo.h"
 #include "msgio.h"
 #include "wrappers.h"
+#include "worker.h"
 
 /** @file
    @brief Channels management module
@@ -19,6 +22,17 @@
       `notify_privmsg()`.
    A thread-safe channel list is kept. With the exception of `chan_init()` and `chan_destroy()`, it is safe to call
       every other public function concurrently.
+   The channels list lock is only held to look a channel up, and to add or delete it. Everything else - membership
+      changes, `RPL_NAMREPLY` lines, and notifying a channel's users - is done while holding that channel's own mutex,
+      so commands targeting different channels never wait for each other, no matter how large the channels are.
+   A thread that found a channel holds a reference to it (see `find_channel()`), so a channel structure outlives its
+      removal from the list until the last thread working on it is done. When the last user leaves, the channel is
+      marked dead and removed from the list, but it is only freed when its last reference is released. A thread that
+      finds a dead channel after acquiring its mutex just looks it up again.
+   Users are notified while holding the channel's mutex, but their workers are only woken up after it is released: see
+      `worker_notify()`.
+   Lock ordering: a channel's mutex may be held while locking the channels list, never the other way around. That's
+      why nothing done while holding the channels list lock (in particular, `list_channel()`) locks a channel.
    Note that `static` functions, that is, internal functions only used in this file, are NOT thread-safe, since it is
       assumed they are invoked from within the other public,thread-safe functions.
    @author Filipe Goncalves
@@ -31,11 +45,15 @@
  */
 #define CHANNEL_ALPHABET_SIZE (UCHAR_MAX + 1)
 
+/** How many members a channel's `members` array initially holds. It doubles whenever it is full. */
+#define CHAN_MEMBERS_MIN 4
+
 /** This structure represents a channel user. We will store instances of this structure associated to each nick in the
-   channel in a trie */
+   channel in a trie, and in the channel's `members` array */
 struct chan_user {
 	unsigned modes; /**<This user's status in the channel */
 	struct irc_client *user; /**<Pointer to this user's client structure */
+	int index; /**<Position of this user in the channel's `members` array */
 };
 
 /** This structure represents an IRC channel
@@ -44,12 +62,40 @@ struct chan_user {
 struct irc_channel {
 	char *name; /**<Null terminated characters sequence holding the channel name */
 	char *topic; /**<Channel topic */
-	struct trie_t *users; /**<List of users on this channel */
-	int users_count; /**<How many users are in the channel */
+	struct trie_t *users; /**<List of users on this channel, by nick. This is only used to find a user; messages are
+	                         delivered by iterating through `members`. Protected by `mutex`. */
+	struct chan_user **members; /**<Every user on this channel, in no particular order, in the first `users_count`
+	                               positions. When a user leaves, the last one takes his place. Protected by
+	                               `mutex`. */
+	int members_size; /**<How many positions `members` has */
+	int users_count; /**<How many users are in the channel. Written while holding `mutex`; since LIST reads it
+	                    without holding it, it is only accessed with atomic builtins. */
 	unsigned modes; /**<Channel modes */
+	pthread_mutex_t mutex; /**<Serializes membership changes and deliveries to this channel */
+	int refs; /**<How many references to this structure exist: one held by the channels list while the channel is in
+	             it, and one for each thread working on the channel. Only accessed with atomic builtins. */
+	int dead; /**<Set, while holding `mutex`, when the last user leaves and the channel is removed from the channels
+	             list. A dead channel cannot be joined. */
+};
+
+/** How many characters `join_ack()` initially allocates for the names burst. It grows as needed. */
+#define NAMES_BURST_SIZE (4 * MAX_MSG_SIZE)
+
+/** The `RPL_NAMREPLY` lines sent to a client joining a channel. Nicks are packed into as few lines as possible, and
+   every line is appended to a single buffer, which is queued with one `write_to()`. Joining a channel with thousands
+   of users thus takes a few dozen lines and one queued message, rather than one of each per user.
+ */
+struct names_reply {
+	char *burst; /**<Complete lines waiting to be queued. `NULL` if it could not be allocated. */
+	size_t burst_len; /**<How many characters are in `burst` */
+	size_t burst_size; /**<How many characters `burst` can hold */
+	char line[MAX_MSG_SIZE + 1]; /**<The line being filled. It always starts with the `RPL_NAMREPLY` prefix. */
+	size_t prefix_len; /**<Length of the prefix at the beginning of `line` */
+	size_t line_len; /**<How many characters are in `line`, excluding CR LF. `line` has no nicks if this is
+	                    `prefix_len`. */
 };
 
-/** An arguments wrapper for `list_find_and_execute()` functions. */
+/** An arguments wrapper for channel operations and the callbacks they pass to `for_each_member()`. */
 struct irc_channel_wrapper {
 	struct irc_client *client; /**<Original client where the request came from */
 	char *channel; /**<Channel name */
@@ -57,38 +103,33 @@ struct irc_channel_wrapper {
 	char irc_reply[MAX_MSG_SIZE+1]; /**<Complete IRC Message to send to other channel users. This is used because we only need to print the message
 										once into the buffer, and then echo it to every other channel user. Thus, this can be a join message, part, quit,
 										privmsg, etc. This buffer must be null terminated. */
+	struct shared_msg *reply; /**<`irc_reply` wrapped in a shared message, so that every recipient's queue references the same copy. If this is `NULL`
+								 (no memory to create it), each recipient gets a private copy of `irc_reply` instead. */
+	struct names_reply *names; /**<Where `join_ack_aux()` packs the nicks of the channel users. Only used by `join_ack()`. */
+	struct worker_wakeups *wakeups; /**<Workers of the notified users, to be woken up once the channel's mutex is released */
 };
 
 /**Global channels list for the whole network */
 Word_list_ptr channels;
 
-/** Defines valid characters for a channel name. As of this writing, the protocol allows any character except NUL, BELL,
-   CR, LF, SPACE, COMMA and SEMI-COLLON.
-   @param c The character to analyze
-   @return `1` if `c` is allowed in a channel name; `0` otherwise.
+/** Defines valid characters for a channel name, and maps each of them into a unique ID. As of this writing, the
+   protocol allows any character except NUL, BELL, CR, LF, SPACE, COMMA and SEMI-COLLON. Since we allow nearly any
+   character, this is a direct mapping.
+   @param c The character to analyze, as an integer in `[0 .. 255]`.
+   @return `c`'s unique ID if `c` is allowed in a channel name; `TRIE_INVALID_POS` otherwise.
  */
-static int is_valid(char c)
-{
-	return c != '\0' && c != '\a' && c != '\r' && c != '\n' && c != ' ' && c != ',' && c != ':';
-}
+#define CHANNEL_POS(c) \
+	((c) != '\0' && (c) != '\a' && (c) != '\r' && (c) != '\n' && (c) != ' ' && (c) != ',' && (c) != ':' ? \
+	 (c) : TRIE_INVALID_POS)
 
 /** Maps a character ID into the corresponding character. Since we allow nearly any character, this is a direct mapping
    @param i The character ID
    @return Corresponding character whose ID is `i`
  */
-static char pos_to_char(int i)
-{
-	return (char)i;
-}
+#define CHANNEL_CHR(i) ((char)(i))
 
-/** Maps a character into a unique ID. Since we allow nearly any character, this is a direct mapping
-   @param c The character
-   @return `c`'s unique ID.
- */
-static int char_to_pos(char c)
-{
-	return (int)(unsigned char)c;
-}
+/** The channel names alphabet */
+static TRIE_ALPHABET(channel_alphabet, CHANNEL_POS, CHANNEL_CHR, CHANNEL_ALPHABET_SIZE);
 
 /** Initializes the channels module.
    @return `0` on success; `-1` on failure. `-1` indicates a resources allocation error.
@@ -97,7 +138,7 @@ static int char_to_pos(char c)
  */
 int chan_init(void)
 {
-	if ((channels = init_word_list(NULL, is_valid, pos_to_char, char_to_pos, CHANNEL_ALPHABET_SIZE)) == NULL) {
+	if ((channels = init_word_list(NULL, &channel_alphabet)) == NULL) {
 		return -1;
 	}
 	return 0;
@@ -112,48 +153,111 @@ void chan_destroy(void)
 	destroy_word_list(channels, LIST_NO_FREE_NODE_DATA);
 }
 
+/** Calls a function for every user in a channel.
+   @param chan The channel. The caller must hold its mutex.
+   @param f The function to call. Its first parameter is a `struct chan_user *`; `f` must not add nor remove users.
+   @param args This is passed to `f` as its second parameter.
+ */
+static void for_each_member(irc_channel_ptr chan, void (*f)(void *, void *), void *args)
+{
+	struct chan_user **member;
+	struct chan_user **end;
+	end = chan->members + chan->users_count;
+	for (member = chan->members; member != end; member++) {
+		(*f)((void*)*member, args);
+	}
+}
+
 /** Notifies a user in a channel with a generic complete IRC message passed through `args`. 
-	To do so, it enqueues a new IRC message into `to_notify`'s messages queue and sends a libev async signal to his thread.
+	To do so, it enqueues a new IRC message into `to_notify`'s messages queue and tells his worker with `worker_notify()`. The worker
+	is added to `args`'s `wakeups` set, to be woken up after the channel's mutex is released.
 	This function is used by `JOIN`, `QUIT`, `PART`, `PRIVMSG`, and other channel commands that must be propagated to every user
 	in a channel.
 	@param to_notify_generic A pointer to a client structure denoting the client to notify. This client is inside the channel.
-	@param args A `struct irc_channel_wrapper *` holding a valid null terminated characters sequence in the field `irc_reply`.
-				This sequence will be enqueued to `to_notify_generic`'s messages write queue, thus, it must be a
-				valid IRC message.
+	@param args A `struct irc_channel_wrapper *` holding a valid null terminated characters sequence in the field `irc_reply`,
+				and its shared version in `reply`. The shared message is enqueued to `to_notify_generic`'s messages write
+				queue, thus, it must be a valid IRC message.
  */
 static void notify_channel_user(void *to_notify_generic, void *args) {
 	struct irc_client *to_notify = ((struct chan_user *) to_notify_generic)->user;
 	struct irc_channel_wrapper *info = (struct irc_channel_wrapper *) args;
-	client_enqueue(&to_notify->write_queue, info->irc_reply);
-	ev_async_send(to_notify->ev_loop, &to_notify->async_watcher);
+	if (info->reply != NULL) {
+		client_enqueue_shared(&to_notify->write_queue, info->reply);
+	} else {
+		client_enqueue(&to_notify->write_queue, info->irc_reply);
+	}
+	worker_notify(to_notify, info->wakeups);
+}
+
+/** Appends the line being filled in a names reply to the burst, and starts a new, empty line. If the burst cannot grow,
+   whatever it holds is queued right away, followed by the line itself.
+   @param client The client joining the channel.
+   @param names The names reply.
+ */
+static void names_end_line(struct irc_client *client, struct names_reply *names)
+{
+	size_t needed;
+	size_t new_size;
+	char *new_burst;
+
+	names->line[names->line_len++] = '\r';
+	names->line[names->line_len++] = '\n';
+	needed = names->burst_len + names->line_len;
+	if (needed > names->burst_size) {
+		for (new_size = names->burst_size == 0 ? NAMES_BURST_SIZE : names->burst_size; new_size < needed; new_size *= 2)
+			; /* Intentionally left blank */
+		if ((new_burst = realloc(names->burst, new_size)) == NULL) {
+			/* No memory; fall back to queueing line by line */
+			if (names->burst_len > 0) {
+				(void)write_to(client, names->burst, names->burst_len);
+				names->burst_len = 0;
+			}
+			(void)write_to(client, names->line, names->line_len);
+			names->line_len = names->prefix_len;
+			return;
+		}
+		names->burst = new_burst;
+		names->burst_size = new_size;
+	}
+	memcpy(names->burst + names->burst_len, names->line, names->line_len);
+	names->burst_len += names->line_len;
+	names->line_len = names->prefix_len;
 }
 
 /** Auxiliary function indirectly used by `join_ack()` that is called for every user inside a channel after a new user
    joins and is added to the channel's userlist.
-   For each user inside a channel, an `RPL_NAMREPLY` message is sent to the new user informing him of who is inside the
-      channel at the moment, as specified by the RFC.
+   Each user's nick is added to the `RPL_NAMREPLY` lines that inform the new user of who is inside the channel at the
+      moment, as specified by the RFC. A line is ended when the next nick would take it beyond `MAX_MSG_SIZE`.
    This list contains the user himself.
    For every other client, a join notification is also sent by calling `notify_channel_user()`.
    @param chanuser A pointer to `struct chan_user` denoting the current user in this iteration. `chanuser` is always
       casted to `struct chan_user `.
    @param args A pointer to `struct irc_channel_wrappers` that shall contain the client where the join request
-      originated from, and the target channel name. This parameter is always casted to `struct irc_channel_wrapper `.
+      originated from, the target channel name, and the names reply being built. This parameter is always casted to
+      `struct irc_channel_wrapper `.
  */
 static void join_ack_aux(void *chanuser, void *args)
 {
-	char msg[MAX_MSG_SIZE + 1];
-	int size;
 	struct chan_user *chanusr;
 	struct irc_channel_wrapper *info;
+	struct names_reply *names;
+	size_t nick_len;
 
 	chanusr = (struct chan_user*)chanuser;
 	info = (struct irc_channel_wrapper*)args;
-	size = cmd_print_reply(msg, sizeof(msg),
-			       ":%s " RPL_NAMREPLY " %s = %s :%s!%s@%s\r\n",
-			       get_server_name(), info->client->nick, info->channel, chanusr->user->nick,
-			       chanusr->user->username,
-			       chanusr->user->public_host);
-	(void)write_to(info->client, msg, size);
+	names = info->names;
+	nick_len = strlen(chanusr->user->nick);
+	/* Nicks are separated by a space; CR LF must still fit */
+	if (names->line_len > names->prefix_len && names->line_len + 1 + nick_len + 2 > MAX_MSG_SIZE) {
+		names_end_line(info->client, names);
+	}
+	if (names->line_len + 1 + nick_len + 2 <= MAX_MSG_SIZE) {
+		if (names->line_len > names->prefix_len) {
+			names->line[names->line_len++] = ' ';
+		}
+		memcpy(names->line + names->line_len, chanusr->user->nick, nick_len);
+		names->line_len += nick_len;
+	}
 	if (chanusr->user != info->client) {
 		notify_channel_user(chanusr, args);
 	}
@@ -161,24 +265,21 @@ static void join_ack_aux(void *chanuser, void *args)
 
 /** Acknowledges a JOIN command issued by `client` to join channel `chan`.
    Sends a JOIN reply to the requester, followed by `RPL_TOPIC`, and then iterates through every client in a channel to
-      generate the appropriate `RPL_NAMREPLY` entries.
+      generate the appropriate `RPL_NAMREPLY` entries, which are queued together with `RPL_ENDOFNAMES` as a single
+      message. See `struct names_reply`.
    While doing so, it also notifies other clients about this new client.
    @param client Pointer to a client's structure denoting the client who issued the JOIN command.
    @param chan A pointer to the channel instance where `client` wants to join.
+   @param wakeups Where to collect the workers of the notified users.
  */
-static void join_ack(struct irc_client *client, irc_channel_ptr chan)
+static void join_ack(struct irc_client *client, irc_channel_ptr chan, struct worker_wakeups *wakeups)
 {
 	char msg[MAX_MSG_SIZE + 1];
 	int size;
 	struct irc_channel_wrapper args;
+	struct names_reply names;
 
-	size = cmd_print_reply(msg,
-			       sizeof(msg),
-			       ":%s!%s@%s JOIN :%s\r\n",
-			       client->nick,
-			       client->username,
-			       client->public_host,
-			       chan->name);
+	size = cmd_print_from(msg, sizeof(msg), client, "JOIN", NULL, chan->name);
 	(void)write_to(client, msg, size);
 	size = cmd_print_reply(msg, sizeof(msg),
 			       ":%s MODE %s +nt\r\n", get_server_name(), chan->name);
@@ -188,107 +289,176 @@ static void join_ack(struct irc_client *client, irc_channel_ptr chan)
 			       get_server_name(), client->nick, chan->name, chan->topic);
 	(void)write_to(client, msg, size);
 
+	names.burst_len = 0;
+	names.burst_size = 0;
+	if ((names.burst = malloc(NAMES_BURST_SIZE)) != NULL) {
+		names.burst_size = NAMES_BURST_SIZE;
+	}
+	/* Leave room for CR LF, which names_end_line() appends */
+	names.prefix_len = (size_t)cmd_print_reply(names.line, sizeof(names.line) - 2, ":%s " RPL_NAMREPLY " %s = %s :",
+						   get_server_name(), client->nick, chan->name);
+	names.line_len = names.prefix_len;
+
 	args.client = client;
 	args.channel = chan->name;
-	cmd_print_reply(args.irc_reply, sizeof(args.irc_reply), ":%s!%s@%s JOIN %s\r\n", client->nick, client->username, client->public_host, chan->name);
-	trie_for_each(chan->users, join_ack_aux, (void*)&args);
-	size = cmd_print_reply(msg, sizeof(msg),
-			       ":%s " RPL_ENDOFNAMES " %s %s :End of NAMES list\r\n",
-			       get_server_name(), client->nick, chan->name);
-	(void)write_to(client, msg, size);
+	args.names = &names;
+	args.wakeups = wakeups;
+	size = cmd_print_from(args.irc_reply, sizeof(args.irc_reply), client, "JOIN", chan->name, NULL);
+	args.reply = shared_msg_new(args.irc_reply, (size_t) size);
+	for_each_member(chan, join_ack_aux, (void*)&args);
+	if (args.reply != NULL) {
+		shared_msg_release(args.reply);
+	}
+	if (names.line_len > names.prefix_len) {
+		names_end_line(client, &names);
+	}
+	names.line_len = (size_t)cmd_print_reply(names.line, sizeof(names.line) - 2,
+						 ":%s " RPL_ENDOFNAMES " %s %s :End of NAMES list",
+						 get_server_name(), client->nick, chan->name);
+	names_end_line(client, &names);
+	if (names.burst_len > 0) {
+		(void)write_to(client, names.burst, names.burst_len);
+	}
+	free(names.burst);
 }
 
-/** Called every time a client joins a nonexisting chan, thus creating it implicitly.
-   This function will allocate and store a new channel structure in the server's channels list, and add the requesting
-      clientto the channel's user list. Then, the join request is acknowledged using `join_ack()`.
-   @param args A pointer to `struct irc_channel_wrapper` holding information about the channel name and the client who
-      issued the command.
-   This parameter is always casted to `struct irc_channel_wrapper `.
-   @return `NULL` if it was not possible to create a new channel name due to lack of memory.
-   Otherwise, this function will return an `irc_channel_ptr` for the newly created channel casted to `void `.
+/** Allocates a new, empty channel. It is not added to the channels list.
+   @param name The channel name. A copy of it is stored.
+   @return The new channel, with two references: one for the channels list, and one for the caller. `NULL` if there
+      isn't enough memory.
  */
-static void *join_newchan(void *args)
+static irc_channel_ptr new_channel(char *name)
 {
-	struct irc_channel_wrapper *info;
-	irc_channel_ptr new_chan;
-	struct chan_user *new_user;
-
-	info = (struct irc_channel_wrapper*)args;
-	if ((new_chan = malloc(sizeof(*new_chan))) == NULL || (new_user = malloc(sizeof(*new_user))) == NULL) {
+	irc_channel_ptr chan;
+	if ((chan = malloc(sizeof(*chan))) == NULL) {
 		return NULL;
 	}
-	if ((new_chan->name = strdup(info->channel)) == NULL) {
-		free(new_chan);
-		free(new_user);
+	if ((chan->name = strdup(name)) == NULL) {
+		free(chan);
 		return NULL;
 	}
-	if ((new_chan->users =
-		     init_trie(NULL, nick_is_valid, nick_pos_to_char, nick_char_to_pos, NICK_EDGES_NO)) == NULL) {
-		free(new_chan->name);
-		free(new_chan);
-		free(new_user);
+	if ((chan->users = init_trie(NULL, &nick_alphabet)) == NULL) {
+		free(chan->name);
+		free(chan);
 		return NULL;
 	}
-	if (list_add_nolock(channels, new_chan, info->channel) == LST_NO_MEM) {
-		destroy_trie(new_chan->users, TRIE_NO_FREE_DATA, NULL);
-		free(new_chan->name);
-		free(new_chan);
-		free(new_user);
+	if (pthread_mutex_init(&chan->mutex, NULL) != 0) {
+		destroy_trie(chan->users, TRIE_NO_FREE_DATA, NULL);
+		free(chan->name);
+		free(chan);
 		return NULL;
 	}
-	new_user->modes = 0;
-	new_user->user = info->client;
-	if (add_word_trie(new_chan->users, info->client->nick, (void*)new_user) == TRIE_NO_MEM) {
-		free(new_chan->name);
-		list_delete_nolock(channels, info->channel);
-		destroy_trie(new_chan->users, TRIE_NO_FREE_DATA, NULL);
-		free(new_chan);
-		free(new_user);
-		return NULL;
+	chan->members = NULL;
+	chan->members_size = 0;
+	chan->users_count = 0;
+	chan->modes = 0;
+	chan->refs = 2;
+	chan->dead = 0;
+	chan->topic = "No topic. yaIRCd doesn't support TOPIC command yet!";
+	return chan;
+}
+
+/** Frees every resource allocated for a channel. Called by `release_channel()` when the last reference is gone, or
+   directly on a channel that never made it to the channels list.
+   @param chan The channel to free. It must have no users.
+ */
+static void free_channel(irc_channel_ptr chan)
+{
+	pthread_mutex_destroy(&chan->mutex);
+	free(chan->name);
+	/*free(chan->topic);*/
+	destroy_trie(chan->users, TRIE_NO_FREE_DATA, NULL);
+	free(chan->members);
+	free(chan);
+}
+
+/** Releases a reference to a channel. The channel is freed if this was the last one.
+   @param chan The channel.
+ */
+static void release_channel(irc_channel_ptr chan)
+{
+	if (__atomic_sub_fetch(&chan->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free_channel(chan);
 	}
-	new_chan->users_count = 1;
-	new_chan->modes = 0;
+}
 
-	new_chan->topic = "No topic. yaIRCd doesn't support TOPIC command yet!";
-	join_ack(info->client, new_chan);
-	return (void*)new_chan;
+/** Callback function used by `find_channel()` with `list_find_and_execute()`. It runs holding the list node's lock, so
+   the channel cannot be deleted from the list, and the list's reference cannot be released, while we take a new
+   reference.
+   @param channel The channel found.
+   @param args Not used.
+   @return `channel`
+ */
+static void *hold_channel(void *channel, void *args)
+{
+	__atomic_add_fetch(&((irc_channel_ptr)channel)->refs, 1, __ATOMIC_RELAXED);
+	return channel;
 }
 
-/** Called every time a client joins an existing chan.
-   This function creates a new `chan_user` instance, adds it to the channel, increments the channel users count, and
-      acknowledges the join request using `join_ack()`.
-   @param channel An `irc_channel_ptr` holding information about the channel. This parameter is always casted to
-      `irc_channel_ptr`.
-   @param args A pointer to `struct irc_channel_wrapper` holding the original client where the request came from. This
-      parameter is always casted to `struct irc_channel_wrapper `.
-   @return `NULL` if it was not possible to join this user due to lack of memory, in which case no `join_ack()` is
-      performed.
-   Otherwise, this function will return a pointer to `struct chan_user` holding the new channel user instance.
+/** Finds a channel and takes a reference to it. The channels list is only locked during the search.
+   @param name The channel name.
+   @return The channel, which must be released with `release_channel()`; `NULL` if there is no such channel. The
+      channel may be dead by the time its mutex is acquired.
  */
-static void *join_existingchan(void *channel, void *args)
+static irc_channel_ptr find_channel(char *name)
 {
-	struct irc_channel_wrapper *info;
-	struct chan_user *new_user;
-	irc_channel_ptr chan;
+	int result;
+	return (irc_channel_ptr)list_find_and_execute(channels, name, hold_channel, NULL, NULL, NULL, &result);
+}
 
-	info = (struct irc_channel_wrapper*)args;
-	chan = (irc_channel_ptr)channel;
+/** Removes an empty channel from the channels list, and releases the list's reference to it. Threads that hold
+   references, including the caller, can keep using it; it is freed when the last one is released.
+   @param chan The channel. The caller must hold its mutex, and a reference to it.
+ */
+static void unlist_channel(irc_channel_ptr chan)
+{
+	chan->dead = 1;
+	(void)list_delete(channels, chan->name);
+	release_channel(chan);
+}
+
+/** Adds a client to a channel, and acknowledges the join request using `join_ack()`.
+   @param client The client joining the channel.
+   @param chan The channel. The caller must hold its mutex, and the channel cannot be dead.
+   @param wakeups Where to collect the workers of the notified users.
+   @return `0` on success; `CHAN_ALREADY_ON_CHANNEL` if the client is already on the channel; `CHAN_NO_MEM` if it was
+      not possible to join this user due to lack of memory. Nothing is changed, and no `join_ack()` is performed, if an
+      error is returned.
+ */
+static int join_channel(struct irc_client *client, irc_channel_ptr chan, struct worker_wakeups *wakeups)
+{
+	struct chan_user *new_user;
+	struct chan_user **members;
+	int size;
+	if (find_word_trie(chan->users, client->nick) != NULL) {
+		return CHAN_ALREADY_ON_CHANNEL;
+	}
+	if (chan->users_count == chan->members_size) {
+		size = (chan->members_size == 0 ? CHAN_MEMBERS_MIN : 2 * chan->members_size);
+		if ((members = realloc(chan->members, size * sizeof(*members))) == NULL) {
+			return CHAN_NO_MEM;
+		}
+		chan->members = members;
+		chan->members_size = size;
+	}
 	if ((new_user = malloc(sizeof(*new_user))) == NULL) {
-		return NULL;
+		return CHAN_NO_MEM;
 	}
 	new_user->modes = 0;
-	new_user->user = info->client;
-	if (add_word_trie(chan->users, info->client->nick, (void*)new_user) == TRIE_NO_MEM) {
+	new_user->user = client;
+	if (add_word_trie(chan->users, client->nick, (void*)new_user) == TRIE_NO_MEM) {
 		free(new_user);
-		return NULL;
+		return CHAN_NO_MEM;
 	}
-	join_ack(info->client, chan);
-	chan->users_count++;
-	return (void*)new_user;
+	new_user->index = chan->users_count;
+	chan->members[new_user->index] = new_user;
+	__atomic_add_fetch(&chan->users_count, 1, __ATOMIC_RELAXED);
+	join_ack(client, chan, wakeups);
+	return 0;
 }
 
-/** Atomically handles a join command. Calls either `join_existingchan()` or `join_newchan()` while holding a global
-   lock to the channels list.
+/** Handles a join command. The channel is looked up, or created if it doesn't exist, and the client joins it while
+   holding the channel's mutex only.
    On success, acknowledges the join request and notifies every other client in the channel about the new comer.
    @param client Pointer to the client who issued the JOIN command.
    @param channel Pointer to a null terminated characters sequence holding the channel name in the JOIN command.
@@ -296,120 +466,154 @@ static void *join_existingchan(void *channel, void *args)
 	<ul>
 		<li>`0` on success</li>
 		<li>`CHAN_NO_MEM` if the request could not be fulfilled due to lack of memory resources</li>
+		<li>`CHAN_ALREADY_ON_CHANNEL` if the client is already on the channel, in which case nothing happens</li>
+		<li>`CHAN_INVALID_NAME` if the channel does not exist, and `channel` is not a valid channel name</li>
 		<li>`CHAN_LIMIT_EXCEEDED` if the client cannot join channels due to the maximum channel limit imposed in yaircd.conf</li>
 	</ul>
  */
 int do_join(struct irc_client *client, char *channel)
 {
 	/* TODO - Check if channel name is valid */
-	struct irc_channel_wrapper args;
-	void *ret;
-	int result;
+	struct worker_wakeups wakeups;
+	irc_channel_ptr chan;
+	int ret;
 	int i;
-	/* We don't need a mutex in client->channels_count, since only the client's thread will be accessing this field */
+	/* We don't need a mutex in client->channels_count, since only the worker serving the client will be accessing
+	   this field */
 	if (client->channels_count == get_chanlimit()) {
 		return CHAN_LIMIT_EXCEEDED;
 	}
-	
-	args.client = client;
-	args.channel = channel;
-	ret = list_find_and_execute_globalock(channels,
-					      channel,
-					      join_existingchan,
-					      join_newchan,
-					      (void*)&args,
-					      (void*)&args,
-					      &result);
-	if (ret == NULL) {
-		return CHAN_NO_MEM;
-	}
-	else {
-		/* assert: client->channels_count < get_chanlimit() => exists i in [0, ..., get_chanlimit()-1] s.t. client->channels[i] == NULL */
-		for (i = 0; client->channels[i] != NULL; i++)
-			; /* Intentionally left blank */
-		/* assert: client->channels[i] == NULL */
-		if ((client->channels[i] = strdup(channel)) == NULL) {
-			do_part(client, channel, client->nick);
-			return CHAN_NO_MEM;
+
+	for (;;) {
+		if ((chan = find_channel(channel)) == NULL) {
+			if ((chan = new_channel(channel)) == NULL) {
+				return CHAN_NO_MEM;
+			}
+			if ((ret = list_add(channels, (void*)chan, channel)) != 0) {
+				free_channel(chan);
+				if (ret == LST_ALREADY_EXISTS) {
+					/* Somebody else created it meanwhile */
+					continue;
+				}
+				return ret == LST_INVALID_WORD ? CHAN_INVALID_NAME : CHAN_NO_MEM;
+			}
+		}
+		pthread_mutex_lock(&chan->mutex);
+		if (!chan->dead) {
+			break;
 		}
-		client->channels_count++;
+		/* The last user left after we found it; it's gone from the list by now */
+		pthread_mutex_unlock(&chan->mutex);
+		release_channel(chan);
+	}
+	worker_wakeups_init(&wakeups);
+	if ((ret = join_channel(client, chan, &wakeups)) != 0 && chan->users_count == 0) {
+		unlist_channel(chan);
+	}
+	pthread_mutex_unlock(&chan->mutex);
+	worker_wakeups_flush(&wakeups);
+	release_channel(chan);
+	if (ret != 0) {
+		return ret;
 	}
-	return 0;
-}
 
-/** Destroys a channel when it no longer holds any client, freeing every allocated resources. This is called by
-   `leave_channel()` when the last client leaves the channel.
-   @param chan An `irc_channel_ptr` holding the channel to destroy.
- */
-static void destroy_channel(irc_channel_ptr chan)
-{
-	(void)list_delete_nolock(channels, chan->name);
-	free(chan->name);
-	/*free(chan->topic);*/
-	destroy_trie(chan->users, TRIE_NO_FREE_DATA, NULL);
-	free(chan);
+	/* assert: client->channels_count < get_chanlimit() => exists i in [0, ..., get_chanlimit()-1] s.t. client->channels[i] == NULL */
+	for (i = 0; client->channels[i] != NULL; i++)
+		; /* Intentionally left blank */
+	/* assert: client->channels[i] == NULL */
+	if ((client->channels[i] = strdup(channel)) == NULL) {
+		do_part(client, channel, client->nick);
+		return CHAN_NO_MEM;
+	}
+	client->channels_count++;
+	return 0;
 }
 
-/** Callback function used by `do_quit()` and `do_part()` to process the event triggered for a client leaving a
-	channel.
-	This function will delete the client from the channel's user list, and notify every other channel user about this.
-	If the channel becomes empty as a result of this user leaving, `destroy_channel()` is called.
-	@param channel An `irc_channel_ptr` holding the target channel.
+/** Used by `do_quit()` and `do_part()` to process the event triggered for a client leaving a channel.
+	This function will delete the client from the channel's user list, and notify every other channel user about this,
+	while holding the channel's mutex. If the channel becomes empty as a result of this user leaving, it is removed
+	from the channels list with `unlist_channel()`.
+	@param channel The channel name.
 	@param args A `struct irc_channel_wrapper *` which must hold a valid pointer to the client leaving in the
-				`client` field.
-	@return `NULL` if the user was not on the channel, `args` otherwise.
-*/	
-static void *leave_channel(void *channel, void *args)
+				`client` field, and the message to send to the other channel users.
+	@return `0` on success; `CHAN_NO_SUCH_CHANNEL` if there is no such channel; `CHAN_NOT_ON_CHANNEL` if the user was
+		not on the channel.
+*/
+static int leave_channel(char *channel, struct irc_channel_wrapper *args)
 {
+	struct worker_wakeups wakeups;
 	irc_channel_ptr chan;
-	struct irc_channel_wrapper *info;
-	void *user;
+	struct chan_user *user;
+	struct chan_user *last;
+	int ret;
 
-	info = (struct irc_channel_wrapper*)args;
-	chan = (irc_channel_ptr)channel;
-	if ((user = delete_word_trie(chan->users, info->client->nick)) == NULL) {
-		return NULL;
+	if ((chan = find_channel(channel)) == NULL) {
+		return CHAN_NO_SUCH_CHANNEL;
 	}
-	free(user);
-	trie_for_each(((irc_channel_ptr)channel)->users, notify_channel_user, args);
-	if (--chan->users_count == 0) {
-		/* Channel empty, clear up */
-		destroy_channel(chan);
+	ret = 0;
+	worker_wakeups_init(&wakeups);
+	args->wakeups = &wakeups;
+	pthread_mutex_lock(&chan->mutex);
+	/* A dead channel has no users */
+	if (chan->dead || (user = delete_word_trie(chan->users, args->client->nick)) == NULL) {
+		ret = CHAN_NOT_ON_CHANNEL;
+	} else {
+		/* Swap-remove: the last member takes his place */
+		last = chan->members[chan->users_count - 1];
+		last->index = user->index;
+		chan->members[last->index] = last;
+		free(user);
+		if (__atomic_sub_fetch(&chan->users_count, 1, __ATOMIC_RELAXED) > 0) {
+			for_each_member(chan, notify_channel_user, (void*)args);
+		} else {
+			/* Channel empty, clear up */
+			unlist_channel(chan);
+		}
 	}
-	return args;
+	pthread_mutex_unlock(&chan->mutex);
+	worker_wakeups_flush(&wakeups);
+	release_channel(chan);
+	return ret;
 }
 
 /** This is the function invoked by the rest of the code to deal with QUIT messages.
-   It indirectly invokes `leave_channel()` using `list_find_and_execute_globalock()`.
-   The following actions are performed for each channel in the user's channels list:
+   It invokes `leave_channel()` for each channel in the user's channels list, which performs the following actions:
 	<ul>
 		<li>The user is deleted from the channel's user list</li>
 		<li>Other channel users are notified about this</li>
 		<li>If the channel becomes empty, it is deleted</li>
-		<li>Finally, the channel name is removed from this user's channels list</li>
 	</ul>
+   Finally, the channel name is removed from this user's channels list.
    @param client The client where the QUIT request came from.
    @param quit_msg Quit message. The code using this function should always provide a quit message.
    This must be a valid null terminated characters sequence.
  */
 void do_quit(struct irc_client *client, char *quit_msg) {
 	struct irc_channel_wrapper args;
-	int result;
+	int size;
 	int i;
+	if (client->channels_count == 0) {
+		return;
+	}
 	args.client = client;
-	cmd_print_reply(args.irc_reply, sizeof(args.irc_reply), ":%s!%s@%s QUIT :%s\r\n", client->nick, client->username, client->public_host, quit_msg);
+	size = cmd_print_from(args.irc_reply, sizeof(args.irc_reply), client, "QUIT", NULL, quit_msg);
+	/* The same message is shared by every channel he was in */
+	args.reply = shared_msg_new(args.irc_reply, (size_t) size);
 	for (i = 0; i < get_chanlimit(); i++) {
 		if (client->channels[i] != NULL) {
-			(void) list_find_and_execute_globalock(channels, client->channels[i], leave_channel, NULL, (void*)&args, NULL, &result);
+			(void)leave_channel(client->channels[i], &args);
 			free(client->channels[i]);
+			client->channels[i] = NULL;
 		}
 	}
 	client->channels_count = 0;
+	if (args.reply != NULL) {
+		shared_msg_release(args.reply);
+	}
 }
 
 /** This is the function invoked by the rest of the code to deal with PART messages.
-   It indirectly invokes `leave_channel()` using `list_find_and_execute_globalock()`. Note that `leave_channel()` is only
-      called if the channel really exists.
+   It invokes `leave_channel()`, which does nothing unless the channel really exists.
    When the channel exists, the user is deleted from the channel's user list, the channel name is removed from this user's channels list,
    other channel users are notified about this, and finally, if the channel becomes empty, it is deleted.
    @param client The client where the PART request came from.
@@ -425,15 +629,19 @@ int do_part(struct irc_client *client, char *channel, char *part_msg)
 	/* TODO - Check if channel name is valid */
 	int i;
 	struct irc_channel_wrapper args;
-	int result;
-	void *ret;
+	int size;
+	int ret;
 	args.client = client;
 	args.channel = channel;
 	
-	cmd_print_reply(args.irc_reply, sizeof(args.irc_reply), ":%s!%s@%s PART %s :%s\r\n", client->nick, client->username, client->public_host, channel, part_msg);
+	size = cmd_print_from(args.irc_reply, sizeof(args.irc_reply), client, "PART", channel, part_msg);
+	args.reply = shared_msg_new(args.irc_reply, (size_t) size);
 	
-	ret = list_find_and_execute_globalock(channels, channel, leave_channel, NULL, (void*)&args, NULL, &result);
-	if (result != 0 && ret == NULL) {
+	ret = leave_channel(channel, &args);
+	if (args.reply != NULL) {
+		shared_msg_release(args.reply);
+	}
+	if (ret == CHAN_NOT_ON_CHANNEL) {
 		/* Attempted to part a channel he's not part of */
 		return CHAN_NOT_ON_CHANNEL;
 	}
@@ -444,7 +652,7 @@ int do_part(struct irc_client *client, char *channel, char *part_msg)
 			; /* Intentionally left blank */
 		/* assert: i >= get_chanlimit() || strcasecmp(client->channels[i], ==, channel) */
 		if (i >= get_chanlimit()) {
-			/* This should never happen if we got past the test result != 0 && ret == NULL */
+			/* This should never happen if we got past the test ret == CHAN_NOT_ON_CHANNEL */
 			fprintf(stderr, "::channel.c:do_part(): User successfully parted from channel, but there's no such entry in client->channels\n");
 			return 0; /* Do we really want to return 0? Well, the part was successfull... */
 		}
@@ -470,21 +678,9 @@ static void send_msg_to_chan_aux(void *channel_user, void *args)
 	}
 }
 
-/** Iterates through every user in a channel and delivers a new message. This is called by `channel_msg()` using
-   `list_find_and_execute()`.
-   @param channel An `irc_channel_ptr` holding the target channel information.
-   @param arg A `struct irc_channel_wrapper ` holding the client who sent a message, the channel name, and the message.
-   @return This function always returns `NULL`.
- */
-static void *send_msg_to_chan(void *channel, void *arg)
-{
-	trie_for_each(((irc_channel_ptr)channel)->users, send_msg_to_chan_aux, arg);
-	return NULL;
-}
-
 /** Function responsible for dealing with channel PRIVMSG command. This is the function invoked by the rest of the code.
-   It indirectly invokes `send_msg_to_chan()` using `list_find_and_execute()`. On success, the message is delivered to
-      every other client on the channel.
+   The channel is looked up with `find_channel()`, and the message is delivered to every other client on the channel
+      while holding the channel's mutex.
    @param from The message's author.
    @param channel Target channel.
    @param msg The message.
@@ -494,19 +690,32 @@ int channel_msg(struct irc_client *from, char *channel, char *msg)
 {
 	/* TODO Check if client is really on channel */
 	struct irc_channel_wrapper args;
-	int result;
+	struct worker_wakeups wakeups;
+	irc_channel_ptr chan;
+	int size;
+	if ((chan = find_channel(channel)) == NULL) {
+		return CHAN_NO_SUCH_CHANNEL;
+	}
 	args.client = from;
 	args.channel = channel;
-	cmd_print_reply(args.irc_reply, sizeof(args.irc_reply), ":%s!%s@%s PRIVMSG %s :%s\r\n", from->nick, from->username, from->public_host, channel, msg);
-	list_find_and_execute(channels, channel, send_msg_to_chan, NULL, (void *) &args, NULL, &result);
-	if (result == 0) {
-		return CHAN_NO_SUCH_CHANNEL;
+	size = cmd_print_from(args.irc_reply, sizeof(args.irc_reply), from, "PRIVMSG", channel, msg);
+	args.reply = shared_msg_new(args.irc_reply, (size_t) size);
+	worker_wakeups_init(&wakeups);
+	args.wakeups = &wakeups;
+	pthread_mutex_lock(&chan->mutex);
+	for_each_member(chan, send_msg_to_chan_aux, (void*)&args);
+	pthread_mutex_unlock(&chan->mutex);
+	worker_wakeups_flush(&wakeups);
+	release_channel(chan);
+	if (args.reply != NULL) {
+		shared_msg_release(args.reply);
 	}
 	return 0;
 }
 
 /**
  * This function sends to the client a line denoting information about the channel, in response to a LIST command.
+ * It is called while holding the channels list lock, so it must not lock the channel.
  * @param data The channel data
  * @param args The client who invoked the LIST command.
  */
@@ -525,7 +734,7 @@ static void list_channel(void *data, void *args)
 					get_server_name(), 
 					client->nick, 
 					channel->name, 
-					channel->users_count, 
+					__atomic_load_n(&channel->users_count, __ATOMIC_RELAXED), 
 					channel->topic);
 					
 	(void)write_to(client, msg, size);
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <ev.h>
 #include <pthread.h>
@@ -9,6 +10,8 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
 #include "client.h"
 #include "client_list.h"
 #include "protocol.h"
@@ -21,6 +24,8 @@
 #include "read_msgs.h"
 #include "send_err.h"
 #include "channel.h"
+#include "worker.h"
+#include "resolver.h"
 
 /** @file
    @brief Implementation of functions that deal with irc clients
@@ -33,54 +38,230 @@
  */
 
 static void manage_client_messages(EV_P_ ev_io *watcher, int revents);
-void destroy_client(void *arg);
+static void interpret_client_messages(struct irc_client *client);
+static void destroy_client(struct irc_client *client);
 static void free_client(struct irc_client *client);
-static struct irc_client *create_client(struct irc_client_args_wrapper *args);
-void free_thread_arguments(struct irc_client_args_wrapper *);
-static void queue_async_cb(EV_P_ ev_async *w, int revents);
+static struct irc_client *create_client(struct irc_worker *worker, struct irc_client_args_wrapper *args);
+void free_client_arguments(struct irc_client_args_wrapper *);
 static void ping_timer_cb(EV_P_ ev_timer *w, int revents);
+static void write_ready_cb(EV_P_ ev_io *w, int revents);
+static void finish_callback(struct irc_client *client);
+static void continue_handshake(struct irc_client *client);
+static void dns_timer_cb(EV_P_ ev_timer *w, int revents);
+static void update_read_watcher(struct irc_client *client);
+static void hostname_resolved(struct irc_client *client, const char *hostname);
 
-/** Accepts a new client's connection. This function is indirectly called by the threads scheduler. When a new client
-   pops in, the main process allocates a new thread whose init function is this one.
-   This function creates a new client instance and starts an event loop for this client.
-   @param args A pointer to `struct irc_client_args_wrapper`, casted to `void `. It is assumed that it points to an
-      address in heap. This is always casted to `struct irc_client_args_wrapper `.
-   This parameter is `free()`'d when it is not needed anymore; the caller does not need to worry about freeing the
-      memory.
-   We chose heap allocation here because otherwise there would be a possible race condition: after the main process
-      calls `pthread_create()`, it is undefined which instruction is executed next (the next instructions inside the
-      main process, or the thread's init routine). In the unfortunate case that the main process kept executing and a
-      new client immediately arrived, there was a chance that `irc_client_args_wrapper` in the main's process stack
-      would be updated with the new client's values before the thread execution for this client started. Therefore, the
-      main process explicitly allocs memoryto pass arguments for each new client that arrives.
-   @return This function always returns `NULL`
+/** Sets up a new client's session. This is called by a worker, in the worker's thread, for every connection that the
+   main thread handed over to it (see `worker_dispatch()`).
+   This function creates a new client instance and registers the client's watchers in the worker's events loop. It
+      returns as soon as the client is set up; from now on, the client is served by the worker's loop, alongside every
+      other client assigned to the same worker.
+   For SSL clients, the SSL handshake is started here, and driven by the client's watchers until it completes (see
+      `continue_handshake()`). Until then, the client's timer enforces `get_handshake_timeout()` instead of sending
+      PINGs.
+   @param worker The worker that will serve this client.
+   @param args The new connection's arguments wrapper. It is assumed that it points to an address in heap. This
+      parameter is `free()`'d when it is not needed anymore; the caller does not need to worry about freeing the memory.
+   @return `0` on success; `-1` if the client could not be created, in which case the connection is closed. The caller
+      shall then call `worker_release()`, since this client will never be served.
  */
-void *new_client(void *args)
+int new_client(struct irc_worker *worker, struct irc_client_args_wrapper *args)
 {
 	struct irc_client *client;
-	if ((client = create_client((struct irc_client_args_wrapper*)args)) == NULL) {
-		return NULL;
+	int socket_fd;
+	SSL *ssl;
+
+	socket_fd = args->socket;
+	ssl = args->ssl;
+	/* Many clients share this thread; a blocking socket call would stall every one of them */
+	if (fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) | O_NONBLOCK) == -1) {
+		perror("::client.c:new_client(): Could not make client socket non-blocking");
+		free_client_arguments(args);
+		if (ssl != NULL) {
+			SSL_free(ssl);
+		}
+		close(socket_fd);
+		return -1;
+	}
+	if ((client = create_client(worker, args)) == NULL) {
+		if (ssl != NULL) {
+			SSL_free(ssl);
+		}
+		close(socket_fd);
+		return -1;
+	}
+	if (client->is_terminated) {
+		/* The welcome notices could not be queued */
+		destroy_client(client);
+		return 0;
 	}
-	pthread_cleanup_push(destroy_client, (void*)client);
 	/* At this point, we have:
 	        - A client structure successfully allocated
-	        - An events loop and 4 watchers - IO watcher, async watcher, and timers for PING
-	        - A thread's cleanup handler to exit gracefully
+	        - 3 watchers - read and write IO watchers, and a timer for PING - to attach to the worker's loop. The
+	          write watcher is only started when there is output pending.
 	   Let the party begin!
 	 */
-	ev_io_init(&client->io_watcher, manage_client_messages, client->socket_fd, EV_READ);
-	ev_io_start(client->ev_loop, &client->io_watcher);
-	ev_async_init(&client->async_watcher, queue_async_cb);
-	ev_async_start(client->ev_loop, &client->async_watcher);
+	if (client->dns_query != NULL) {
+		ev_timer_set(&client->dns_watcher, get_dns_timeout(), 0.);
+		ev_timer_start(client->ev_loop, &client->dns_watcher);
+	}
+	update_read_watcher(client);
 	client->last_activity = ev_now(client->ev_loop);
-	ev_init(&client->time_watcher, ping_timer_cb);
-	ping_timer_cb(client->ev_loop, &client->time_watcher, 0);
-	ev_run(client->ev_loop, 0); /* Go */
+	if (client->is_handshaking) {
+		ev_timer_set(&client->time_watcher, get_handshake_timeout(), 0.);
+		ev_timer_start(client->ev_loop, &client->time_watcher);
+		continue_handshake(client);
+	} else {
+		ev_timer_set(&client->time_watcher, get_ping_freq(), 0.);
+		ev_timer_start(client->ev_loop, &client->time_watcher);
+	}
+	finish_callback(client);
+	return 0;
+}
+
+/** Advances an SSL client's handshake. This is called when the client is set up, and then everytime the client's
+   socket is readable or writable while the handshake is in progress.
+   The socket is non-blocking, so `SSL_accept()` never waits for the client. When it needs more data, it fails with
+      `SSL_ERROR_WANT_READ`, and is called again by the read watcher, which is always active. When the socket did not
+      take everything it had to send, it fails with `SSL_ERROR_WANT_WRITE`, and the write watcher is started until
+      the socket is writable again.
+   Once the handshake is done, the handshake timeout is replaced by the regular PING timer, and `finish_callback()`
+      flushes whatever was queued for this client meanwhile (the welcome notices, at least).
+   @param client The client whose handshake is in progress.
+ */
+static void continue_handshake(struct irc_client *client)
+{
+	int ret;
+	int err;
+	if ((ret = SSL_accept(client->ssl)) == 1) {
+		client->is_handshaking = 0;
+		ev_io_stop(client->ev_loop, &client->write_watcher);
+		client->last_activity = ev_now(client->ev_loop);
+		ev_timer_stop(client->ev_loop, &client->time_watcher);
+		ev_timer_set(&client->time_watcher, get_ping_freq(), 0.);
+		ev_timer_start(client->ev_loop, &client->time_watcher);
+		update_read_watcher(client);
+		return;
+	}
+	err = SSL_get_error(client->ssl, ret);
+	if (err == SSL_ERROR_WANT_READ) {
+		ev_io_stop(client->ev_loop, &client->write_watcher);
+	} else if (err == SSL_ERROR_WANT_WRITE) {
+		ev_io_start(client->ev_loop, &client->write_watcher);
+	} else {
+		fprintf(stderr, "::client.c:continue_handshake(): SSL Handshake failed.\n");
+		ERR_clear_error();
+		terminate_session(client, SSL_HANDSHAKE_QUIT_MSG);
+	}
+}
+
+/** Starts or stops a client's read watcher. Nothing is read while the client's reverse lookup is pending, so his
+   registration waits for it; messages sent meanwhile wait in the socket. An SSL handshake, however, needs the read
+   watcher, and can make progress while the lookup is pending.
+   @param client The client.
+ */
+static void update_read_watcher(struct irc_client *client)
+{
+	if (client->dns_query != NULL && !client->is_handshaking) {
+		ev_io_stop(client->ev_loop, &client->io_watcher);
+	} else {
+		ev_io_start(client->ev_loop, &client->io_watcher);
+	}
+}
+
+/** Sets a client's hostname once his reverse lookup is over, and tells him about it. The client's hostname holds his
+   IP address until then.
+   If there's no memory to store the hostname or the cloaked host, the client's session is terminated.
+   @param client The client.
+   @param hostname The hostname found for the client's address; `NULL` if none was found, or if the lookup timed out,
+      in which case the client keeps his IP address.
+ */
+static void hostname_resolved(struct irc_client *client, const char *hostname)
+{
+	char *copy;
+	if (hostname != NULL) {
+		if ((copy = strdup(hostname)) == NULL) {
+			terminate_session(client, NO_MEM_QUIT_MSG);
+			return;
+		}
+		free(client->hostname);
+		client->hostname = copy;
+		client->host_reversed = 1;
+		yaircd_send(client, ":%s NOTICE AUTH :*** Found your hostname.\r\n", get_server_name());
+	} else {
+		yaircd_send(client, ":%s NOTICE AUTH :*** Couldn't resolve your hostname; using your IP address instead.\r\n",
+			    get_server_name());
+	}
+	if ((client->public_host =
+		     (client->host_reversed ? hide_host(client->hostname) : hide_ipv4(client->hostname))) == NULL ||
+	    client_update_prefix(client) == -1) {
+		terminate_session(client, NO_MEM_QUIT_MSG);
+	}
+}
 
-	/* This is never reached, but we need to pair up push() and pop() calls */
-	pthread_cleanup_pop(0);
+/** Rebuilds a client's `prefix`, the `nick!user@host` that begins every message sent on his behalf. Must be called
+   whenever his nickname, username or public host changes. Nothing is built until the three of them are known.
+   @param client The client.
+   @return `0` on success; `-1` if there's no memory, in which case `client->prefix` is left untouched.
+ */
+int client_update_prefix(struct irc_client *client)
+{
+	size_t nick_len;
+	size_t user_len;
+	size_t host_len;
+	char *prefix;
+	if (client->nick == NULL || client->username == NULL || client->public_host == NULL) {
+		return 0;
+	}
+	nick_len = strlen(client->nick);
+	user_len = strlen(client->username);
+	host_len = strlen(client->public_host);
+	if ((prefix = malloc(nick_len + user_len + host_len + 3)) == NULL) {
+		return -1;
+	}
+	memcpy(prefix, client->nick, nick_len);
+	prefix[nick_len] = '!';
+	memcpy(prefix + nick_len + 1, client->username, user_len);
+	prefix[nick_len + 1 + user_len] = '@';
+	memcpy(prefix + nick_len + user_len + 2, client->public_host, host_len + 1);
+	free(client->prefix);
+	client->prefix = prefix;
+	client->prefix_len = nick_len + user_len + host_len + 2;
+	return 0;
+}
+
+/** Called by the worker when the answer to a client's reverse lookup arrives, unless the lookup was cancelled. The
+   client's hostname is set, and the client is allowed to go on with his registration.
+   @param query The answered query. It is freed by the caller.
+   @warning This is meant to be called by the worker serving `query->client` only. See `worker_post_dns()`.
+ */
+void client_dns_done(struct dns_query *query)
+{
+	struct irc_client *client;
+	client = query->client;
+	ev_timer_stop(client->ev_loop, &client->dns_watcher);
+	client->dns_query = NULL;
+	hostname_resolved(client, query->status == DNS_FOUND ? query->hostname : NULL);
+	update_read_watcher(client);
+	finish_callback(client);
+}
 
-	return NULL;
+/** Callback function for a client's DNS timer. The resolver did not answer within `get_dns_timeout()` seconds; the
+   lookup is cancelled, and the client goes on with his IP address. If the lookup was already in progress, its answer
+   is still cached when it arrives.
+   @param w Pointer to this client's DNS timer. A pointer to the client is obtained with `(struct irc_client *)
+      ((char *)w - offsetof(struct irc_client, dns_watcher))`.
+   @param revents libev's flags. Not used for this specific callback.
+ */
+static void dns_timer_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct irc_client *client;
+	client = (struct irc_client*)((char*)w - offsetof(struct irc_client, dns_watcher));
+	resolver_cancel(client->dns_query);
+	client->dns_query = NULL;
+	hostname_resolved(client, NULL);
+	update_read_watcher(client);
+	finish_callback(client);
 }
 
 /** The core function that deals with a client. This is the callback function for a client's connection (previously set
@@ -96,6 +277,13 @@ void *new_client(void *args)
       voluntarily by issuing a QUIT command), `destroy_client()` is called, and the appropriate quit messageis spread
       around the network.
    Otherwise, it calls `notify_all_clients()` to spread the new message around the network.
+   The socket is read until it is empty, or until `READ_BUDGET` characters were read, and the messages are
+      interpreted after each read. If the budget runs out while OpenSSL still holds decrypted characters, the callback
+      is scheduled again with `ev_feed_event()`: the socket alone would never trigger it for them.
+   Clients served by this worker who got messages from this client are only flushed once the worker goes back to its
+      loop, so their queues are flushed with `worker_flush_ready()` between reads. Otherwise, a burst of up to
+      `READ_BUDGET` characters sent to a channel would pile up in every local member's queue, and evict members with a
+      small SendQ who are reading just fine.
    @param watcher The watcher that brought this callback function to life. This argument is safely casted to `struct
       irc_client `, since the watcher field is the first in `struct irc_client`. This is safe and itworks because the
       watcher is embedded inside each client's struct.
@@ -109,13 +297,9 @@ void *new_client(void *args)
 static void manage_client_messages(EV_P_ ev_io *watcher, int revents)
 {
 	struct irc_client *client;
-	char *msg_in;
-	int msg_size;
-	int params_no;
-	int parse_res;
-	char *prefix;
-	char *cmd;
-	char *params[MAX_IRC_PARAMS];
+	ssize_t bytes;
+	long budget;
+	int more;
 
 	if (revents & EV_ERROR) {
 		fprintf(stderr, "::client.c:manage_client_messages(): unexpected EV_ERROR on client event watcher\n");
@@ -129,9 +313,54 @@ static void manage_client_messages(EV_P_ ev_io *watcher, int revents)
 	}
 	client = (struct irc_client*)((char*)watcher - offsetof(struct irc_client, io_watcher));
 
-	read_data(client);
+	if (client->is_handshaking) {
+		continue_handshake(client);
+		finish_callback(client);
+		return;
+	}
+	budget = READ_BUDGET;
+	for (;;) {
+		if ((bytes = read_data(client, &more)) == -1) {
+			finish_callback(client);
+			return;
+		}
+		budget -= bytes;
+		interpret_client_messages(client);
+		if (!more || budget <= 0 || client->is_terminated) {
+			break;
+		}
+		worker_flush_ready(client->worker, client);
+	}
+
+	/* The socket will not tell us about characters OpenSSL is already holding */
+	if (!client->is_terminated && client->uses_ssl && SSL_pending(client->ssl) > 0) {
+		ev_feed_event(client->ev_loop, &client->io_watcher, EV_READ);
+	}
+	finish_callback(client);
+}
+
+/** Retrieves and interprets every complete IRC message in a client's messages buffer, after `read_data()` read new data
+   from his socket. Stops early if some command terminated the client's session.
+   @param client The client.
+ */
+static void interpret_client_messages(struct irc_client *client)
+{
+	char *msg_in;
+	int msg_size;
+	int params_no;
+	int parse_res;
+	char *prefix;
+	char *cmd;
+	char *params[MAX_IRC_PARAMS];
 
-	while ((msg_size = next_msg(&client->last_msg, &msg_in)) != MSG_CONTINUE) {
+	while (!client->is_terminated && (msg_size = next_msg(&client->last_msg, &msg_in)) != MSG_CONTINUE) {
+		if (msg_size == MSG_TOO_LONG) {
+			/* A lame client is messing around with the server. Log this malicious behavior. */
+			fprintf(stderr,
+				"Parse error: message exceeds maximum allowed length. Received by %s\n",
+				client->nick == NULL ? "<unregistered>" : client->nick);
+			continue;
+		}
 		if (msg_size == 0 || (msg_size == 1 && msg_in[msg_size - 1] == '\r')) {
 			/* Silently ignore empty messages */
 			printf("EMPTY MSG\n");
@@ -154,12 +383,14 @@ static void manage_client_messages(EV_P_ ev_io *watcher, int revents)
 }
 
 /** Creates a new client instance that will be used throughout this client's lifetime.
+   Every watcher is initialized here, but none is started; `new_client()` does that once the client is fully set up.
+   @param worker The worker that will serve this client. The client's events loop is the worker's loop.
    @param args A pre-filled arguments wrapper with appropriate information. See the documentation for `struct
       irc_client_args_wrapper` for further information.
    @return `NULL` if there aren't enough resources to create a new client; otherwise, pointer to `struct irc_client` for
       this user.
  */
-static struct irc_client *create_client(struct irc_client_args_wrapper *args)
+static struct irc_client *create_client(struct irc_worker *worker, struct irc_client_args_wrapper *args)
 {
 	struct irc_client *new_client;
 	char hostbuf[NI_MAXHOST];
@@ -168,25 +399,23 @@ static struct irc_client *create_client(struct irc_client_args_wrapper *args)
 	   char ip6[INET6_ADDRSTRLEN];
 	 */
 	if ((new_client = malloc(sizeof(struct irc_client))) == NULL) {
-		free_thread_arguments(args);
+		free_client_arguments(args);
 		return NULL;
 	}
-	if ((new_client->ev_loop = ev_loop_new(0)) == NULL) {
+	new_client->ev_loop = worker->ev_loop;
+	new_client->worker = worker;
+	new_client->wakeup_pending = 0;
+	new_client->ready_next = NULL;
+	if (client_queue_init(&new_client->write_queue, args->sendq) == -1) {
 		free(new_client);
-		free_thread_arguments(args);
-		return NULL;
-	}
-	if (client_queue_init(&new_client->write_queue) == -1) {
-		ev_loop_destroy(new_client->ev_loop);
-		free(new_client);
-		free_thread_arguments(args);
+		free_client_arguments(args);
 		return NULL;
 	}
 	if ((new_client->channels = calloc((size_t) get_chanlimit(), sizeof(*new_client->channels))) == NULL) {
 		client_queue_destroy(&new_client->write_queue);
-		ev_loop_destroy(new_client->ev_loop);
 		free(new_client);
-		free_thread_arguments(args);
+		free_client_arguments(args);
+		return NULL;
 	}
 	new_client->socket_fd = args->socket;
 	new_client->server = NULL; /* local client */
@@ -198,73 +427,121 @@ static struct irc_client *create_client(struct irc_client_args_wrapper *args)
 	new_client->username = NULL;
 	new_client->hostname = NULL;
 	new_client->public_host = NULL;
+	new_client->prefix = NULL;
+	new_client->prefix_len = 0;
 	new_client->channels_count = 0;
 	new_client->connection_status = STATUS_OK;
-	initialize_irc_message(&new_client->last_msg);
+	new_client->is_terminated = 0;
+	new_client->is_handshaking = new_client->uses_ssl;
+	new_client->dns_query = NULL;
+	initialize_irc_message(&new_client->last_msg, args->recvq);
+	/* Watchers must be initialized before anything is written: a failed write terminates the session, and
+	   destroying a client stops every watcher */
+	ev_io_init(&new_client->io_watcher, manage_client_messages, new_client->socket_fd, EV_READ);
+	ev_io_init(&new_client->write_watcher, write_ready_cb, new_client->socket_fd, EV_WRITE);
+	ev_init(&new_client->time_watcher, ping_timer_cb);
+	ev_init(&new_client->dns_watcher, dns_timer_cb);
 
 	yaircd_send(new_client, ":%s NOTICE AUTH :*** Looking up your hostname...\r\n", get_server_name());
 	if (!args->is_ipv6) {
-		if (getnameinfo((struct sockaddr*)&args->address.ipv4_address, args->address_length, hostbuf,
-				sizeof(hostbuf), NULL, 0, NI_NAMEREQD) != 0) {
-			yaircd_send(
-				new_client,
-				":%s NOTICE AUTH :*** Couldn't resolve your hostname; using your IP address instead.\r\n",
-				get_server_name());
-			if (inet_ntop(AF_INET, (void*)&args->address.ipv4_address.sin_addr, ip, sizeof(ip)) == NULL) {
-				/* Weird case ... no reverse lookup, and invalid IP..? */
-				fprintf(
-					stderr,
-					"::client.c:create_client(): Couldn't find a reverse hostname, and inet_ntop() reported an error.\n");
-				ev_loop_destroy(new_client->ev_loop);
-				free(new_client);
-				free_thread_arguments(args);
-				return NULL;
-			}
-			new_client->host_reversed = 0;
-			if ((new_client->hostname = strdup(ip)) == NULL) {
-				ev_loop_destroy(new_client->ev_loop);
-				free(new_client);
-				free_thread_arguments(args);
-				return NULL;
-			}
-		}else {
-			yaircd_send(new_client, ":%s NOTICE AUTH :*** Found your hostname.\r\n", get_server_name());
-			new_client->host_reversed = 1;
-			if ((new_client->hostname = strdup(hostbuf)) == NULL) {
-				ev_loop_destroy(new_client->ev_loop);
-				free(new_client);
-				free_thread_arguments(args);
-				return NULL;
-			}
+		if (inet_ntop(AF_INET, (void*)&args->address.ipv4_address.sin_addr, ip, sizeof(ip)) == NULL) {
+			/* Weird case ... invalid IP..? */
+			fprintf(stderr, "::client.c:create_client(): inet_ntop() reported an error.\n");
+			free(new_client->channels);
+			client_queue_destroy(&new_client->write_queue);
+			free(new_client);
+			free_client_arguments(args);
+			return NULL;
 		}
-		if ((new_client->public_host = (new_client->host_reversed ? hide_host(new_client->hostname) : hide_ipv4(new_client->hostname))) == NULL) {
-			free(new_client->hostname);
-			ev_loop_destroy(new_client->ev_loop);
+		/* The IP address is the client's hostname until (and unless) the reverse lookup finds something better */
+		new_client->host_reversed = 0;
+		if ((new_client->hostname = strdup(ip)) == NULL) {
+			free(new_client->channels);
+			client_queue_destroy(&new_client->write_queue);
 			free(new_client);
-			free_thread_arguments(args);
+			free_client_arguments(args);
 			return NULL;
 		}
+		switch (resolver_cache_lookup(args->address.ipv4_address.sin_addr, hostbuf, sizeof(hostbuf))) {
+		case DNS_FOUND:
+			hostname_resolved(new_client, hostbuf);
+			break;
+		case DNS_NOT_FOUND:
+			hostname_resolved(new_client, NULL);
+			break;
+		default:
+			/* The answer is delivered to client_dns_done(); new_client() arms the timeout */
+			new_client->dns_query = resolver_submit(new_client, worker, args->address.ipv4_address.sin_addr);
+			if (new_client->dns_query == NULL) {
+				hostname_resolved(new_client, NULL);
+			}
+			break;
+		}
 	}
-	free_thread_arguments(args);
+	free_client_arguments(args);
 	return new_client;
 }
 
-/** Callback function for a client's async watcher.
-   This function is called by libev when another thread issues `async_send()` on this thread's async watcher.
-   We use this mechanism to notify client threads that new data is queued, waiting to be written into the socket.
-   For example, if a thread from client A reads a PRIVMSG command with a message whose destination is B, then A's thread
-      willqueue the message into B's queue, and call `async_send()` on B's async watcher, to wake B up. When B wakes up,
-      this function is called.
+/** Called by a client's worker, in the worker's thread, when other threads queued new data for this client.
+   For example, if the worker serving client A reads a PRIVMSG command with a message whose destination is B, then A's
+      worker will queue the message into B's queue, and put B in the ready list of B's worker with `worker_notify()`,
+      waking that worker up. When B's worker wakes up, this function is called for B.
    Therefore, the main purpose of this function is to flush a client's queue.
-   @param w Pointer to this client's async watcher. A pointer to the client is obtained with `(struct irc_client *) ((char *)w - offsetof(struct irc_client, async_watcher))`. 
-			This pointer manipulation is necessary to extract the client's structure where `w` is embedded. In doubt, read about `offsetof()` macro in `stddef.h`'s manpage.
-   @param revents libev's flags. Not used for async callbacks.
+   @param client The client. His `wakeup_pending` flag is cleared before the queue is flushed, so that messages queued
+      from now on will wake the worker up again.
+   @warning `client` must not be used after this function returns, since it may have been freed.
  */
-static void queue_async_cb(EV_P_ ev_async *w, int revents)
+void client_wakeup(struct irc_client *client)
+{
+	__atomic_store_n(&client->wakeup_pending, 0, __ATOMIC_SEQ_CST);
+	finish_callback(client);
+}
+
+/** Callback function for a client's write watcher. The write watcher is only active while the client's output buffer
+   holds messages that the socket did not accept yet, or while an SSL handshake is waiting to write; libev calls this
+   function once the socket is writable again.
+   @param w Pointer to this client's write watcher. A pointer to the client is obtained with `(struct irc_client *)
+      ((char *)w - offsetof(struct irc_client, write_watcher))`.
+   @param revents libev's flags. Not used for this specific callback.
+ */
+static void write_ready_cb(EV_P_ ev_io *w, int revents)
 {
 	struct irc_client *client;
-	client = (struct irc_client*)((char*)w - offsetof(struct irc_client, async_watcher));
-	flush_queue(client, &client->write_queue);
+	client = (struct irc_client*)((char*)w - offsetof(struct irc_client, write_watcher));
+	if (client->is_handshaking) {
+		continue_handshake(client);
+	}
+	finish_callback(client);
+}
+
+/** Must be called by every watcher callback right before it returns to the loop, after it is done with `client`.
+   If the client's session is still alive, his output buffer is flushed, and the write watcher is started if the socket
+      did not take everything, or stopped if there is nothing left to write. This way, `EV_WRITE` is only watched while
+      there is output pending. If the session was terminated (or the flush failed), the client is destroyed.
+   Nothing is flushed while an SSL handshake is in progress; `continue_handshake()` manages the write watcher then.
+   This is also where slow consumers are evicted: if some message for this client was refused because his SendQ was
+      exceeded, the session is terminated with `SENDQ_EXCEEDED_QUIT_MSG`. Threads that enqueue messages for a client
+      always wake up his worker, so the eviction happens on the next iteration of the client's loop.
+   @param client The client served by the callback.
+   @warning `client` must not be used after this function returns, since it may have been freed.
+ */
+static void finish_callback(struct irc_client *client)
+{
+	if (!client->is_terminated && client_queue_sendq_exceeded(&client->write_queue)) {
+		terminate_session(client, SENDQ_EXCEEDED_QUIT_MSG);
+	}
+	if (!client->is_terminated && !client->is_handshaking) {
+		if (flush_queue(client, &client->write_queue) == -1) {
+			terminate_session(client, BAD_WRITE_QUIT_MSG);
+		} else if (client_is_queue_empty(&client->write_queue)) {
+			ev_io_stop(client->ev_loop, &client->write_watcher);
+		} else {
+			ev_io_start(client->ev_loop, &client->write_watcher);
+		}
+	}
+	if (client->is_terminated) {
+		destroy_client(client);
+	}
 }
 
 /** Called by the rest of the code everytime a client's session must be terminated. The reason for terminating a
@@ -277,24 +554,33 @@ static void queue_async_cb(EV_P_ ev_async *w, int revents)
 	`ERROR :Closing Link: &lt;nick&gt;[&lt;hostname&gt;] (&lt;quit message&gt;)`.
 	Whether the write is successfull or not is irrelevant, after attempting to notify the client about this,
 	the function calls `do_quit()`, to let every other client sharing a channel with this one that he's leaving,
-	and finally, `pthread_exit()` is called to free every resource allocated to this client and kill the thread.
+	and finally, the client is marked as terminated.
+	Many clients share the same worker thread, so this function does not unwind anything, and it does not free
+	the client either: the caller is typically deep inside a command handler, with the client's structures still
+	in use. Instead, it returns normally, and every watcher callback checks `is_terminated` before returning to
+	the loop, calling `destroy_client()` if it is set. Callers shall stop processing on behalf of this client
+	as soon as possible after this function returns. Calling it more than once for the same client is harmless;
+	only the first call has any effect.
 	@param client The client to disconnect.
 	@param quit_msg The quit message. This must be a valid pointer to a null-terminated characters sequence with
 	the quit message. Since no `free()`'s are performed on this parameter, it must NOT be a dynamically allocated pointer.
 	Typically, this will be a pointer to a string constant defined in `protocol.h` if the event triggering the QUIT
 	was an error on the server side. Otherwise, it is ok for this parameter to be a pointer to a local variable
 	stored in the stack of the calling function, as is the case with `cmd_quit()` in `interpretmsg.c`.
-	@note No other place in the code should call `pthread_exit()`. Always use this function to terminate a client's
-	session.
+	@note Always use this function to terminate a client's session.
 */
 void terminate_session(struct irc_client *client, char *quit_msg) {
 	int size;
 	char err_msg[MAX_MSG_SIZE+1];
+	if (client->is_terminated) {
+		return;
+	}
+	client->is_terminated = 1;
 	size = cmd_print_reply(err_msg, sizeof(err_msg), "ERROR :Closing Link: %s[%s] (%s)\r\n",
-				(client->is_registered ? client->nick : "*"), client->hostname, quit_msg);
+				(client->is_registered ? client->nick : "*"),
+				(client->hostname != NULL ? client->hostname : "*"), quit_msg);
 	(void) write_to(client, err_msg, size);
 	do_quit(client, quit_msg);
-	pthread_exit(NULL); /* Calls destroy_client() */
 }
 
 /** Callback function used by the time watcher for each client.
@@ -322,6 +608,12 @@ static void ping_timer_cb(EV_P_ ev_timer *w, int revents) {
 	int size;
 	ev_tstamp after;
 	client = (struct irc_client*)((char*)w - offsetof(struct irc_client, time_watcher));
+	if (client->is_handshaking) {
+		/* The timer was armed with get_handshake_timeout() */
+		terminate_session(client, HANDSHAKE_TIMEOUT_QUIT_MSG);
+		finish_callback(client);
+		return;
+	}
     after = client->last_activity - ev_now(client->ev_loop) + get_ping_freq();
 	if (after < 0.) {
 		if (client->connection_status == STATUS_OK) {
@@ -342,31 +634,24 @@ static void ping_timer_cb(EV_P_ ev_timer *w, int revents) {
 		ev_timer_set(w, get_ping_freq(), 0.);
         ev_timer_start(client->ev_loop, w);
     }
+	finish_callback(client);
 }
 
-/** This function is set by the thread init function (`new_client()`) as the cleanup handler for `pthread_exit()`, thus,
-   this is called when a fatal error with this client occurred andhe needs to be kicked out of the server.
-   Examples of fatal errors are: we were writing to his socket and processing a command he sent and suddenly the
-      connection was lost, causing write() to return an error; there's no space in client_list for this user; or
+/** Destroys a client whose session was terminated. Every watcher callback calls this function right before returning
+   to the loop if it finds out that `terminate_session()` was called on behalf of the client it was serving; this is the
+   only place where a client is freed.
+   Examples of reasons for termination are: we were writing to his socket and processing a command he sent and suddenly
+      the connection was lost, causing write() to return an error; there's no space in client_list for this user; or
       something else went terribly wrong and we can't keep a connection to this user.
-   The socket is closed, every watcher is stopped, the events loop is destroyed, the client is deleted from the client's
-      list (if his connection was registered), and every resource associated with this client is freed.
-   @param arg A pointer to a `struct irc_client` describing this client. This argument is always casted to `struct
-      irc_client `.
-   @warning This function is only active after we have a fully allocated client struct for this user. Problems with
-      structure allocation are dealt earlier in `new_client()`.
+   The client is deleted from the client's list (if he ever got a nickname), every watcher is stopped, the socket is
+      closed, and every resource associated with this client is freed.
+   @param client The client to destroy.
    @warning Care must be taken when killing a client. For example, deleting a client from the list can be problematic.
-      Clients list implementation is thread safe; consider the case that this thread was doing some processing and was
-      currently holding a lock to the clients list when a fatal error occurs, `pthread_exit()` is called, and we end up
-      in this function. This function would try to delete the client from the list, trying to obtain the lock again,
-      which would result in a deadlock, since the thread would be waiting for itself. Although it is a rare case, it is
-      extremely undesirable, therefore, abstract implementations used by each client's threaddo not call
-      `pthread_exit()` directly. Furthermore, imagine another example where we just killed the thread - what if this
-      thread was currently holding a lock to a shared list? This lock won't be released, and from now on,no other thread
-      will ever be able to access this shared resource.
-   This is why library functions such as `client_list_add()` and others use special return values or parameters to
-      indicate failure, so that the client's thread can decide to call `pthread_exit()` after making sure
-      everysynchronization mechanism is unlocked.
+      Clients list implementation is thread safe; if we were currently holding a lock to the clients list when a fatal
+      error occurred, trying to delete the client from the list would try to obtain the lock again, which would result
+      in a deadlock, since the thread would be waiting for itself. This is why `terminate_session()` does not free
+      anything, and why this function is only called once the callback that was processing this client is about to
+      return to the loop, when no locks are held.
    @note You may have wondered if closing the socket is safe, since we don't really know what happened: the socket can
       be invalid by this time, and closing it can yield an error. According to `close()` manpage, "Not checking the
       return value of `close()` is a common but nevertheless serious programming error. It is quite possible that errors
@@ -374,14 +659,9 @@ static void ping_timer_cb(EV_P_ ev_timer *w, int revents) {
       closing the file may lead to silent loss of data. This can especially be observed with NFS and with disk quota."
       We think this is great advice, but is not very applicable to sockets. We're killing this client anyway, why bother
       with some final errors on his socket? Thus, the return value for `close()` is ignored.
-   @note Every exiting path for a client ends up his thread with `pthread_exit()`. This destructor is always called when
-      the client exits the server. Due to `pthread_exit()`'s nature, we don't actually ever returnback to
-      `new_client()`.
-   @todo Notify other clients when someone leaves.
  */
-void destroy_client(void *arg)
+static void destroy_client(struct irc_client *client)
 {
-	struct irc_client *client = (struct irc_client*)arg;
 	/* First, we HAVE to delete this client from the clients list, no matter what.
 	   Why? Because if we delete him, we know for sure that no other thread will be able to reach him and
 	   issue client_enqueue() commands on this guy. List accesses are thread safe; other clients using the list to
@@ -389,18 +669,31 @@ void destroy_client(void *arg)
 	   enqueue operations do so atomically. Thus, after client_list_delete() is completed, no other thread will ever
 	      try to access
 	   this client's queue. This is required by client_queue_destroy(), see the documentation in client_queue.c
+	   Note that a client is added to the list as soon as he picks a nickname, even before he is registered.
 	 */
-	if (client->is_registered) {
+	if (client->nick != NULL) {
 		client_list_delete(client);
 	}
+	/* Nobody can reach him anymore, so he won't be put back in the ready list */
+	worker_forget(client);
+	/* The worker frees the query once the resolver is done with it */
+	if (client->dns_query != NULL) {
+		resolver_cancel(client->dns_query);
+	}
+	/* Last chance to deliver the ERROR message (and whatever else is pending). The socket is non-blocking, so
+	   this never stalls the worker; what doesn't fit is lost. There's no point in trying if the SSL handshake
+	   never completed */
+	if (!client->is_handshaking) {
+		(void)flush_queue(client, &client->write_queue);
+	}
+	worker_release(client->worker);
 	free_client(client);
 }
 
 /** Auxiliary function called by `destroy_client()` to free a client's resources.
-   It frees every dynamic allocated resource, closes the socket, stops the callback mechanism by detaching the watcher
-      from the events loop, and destroys this client'sev_loop.
+   It frees every dynamic allocated resource, closes the socket, and stops the callback mechanism by detaching the
+      watchers from the worker's events loop.
    @param client The client to free
-   @todo find the way to free client->ssl
  */
 static void free_client(struct irc_client *client)
 {
@@ -414,22 +707,22 @@ static void free_client(struct irc_client *client)
 	free(client->username);
 	free(client->server);
 	free(client->public_host);
+	free(client->prefix);
 	free(client->channels);
+	free_irc_message(&client->last_msg);
 	if (client_queue_destroy(&client->write_queue) == -1) {
 		fprintf(stderr, "Warning: client_queue_destroy() reported an error - THIS SHOULD NEVER HAPPEN!\n");
 	}
-	//if(client->ssl == NULL){
-	//SSL_shutdown(client->ssl);
-	//SSL_free(client->ssl);
-	//}
+	/* No SSL_shutdown(): the socket is non-blocking and the client is gone anyway */
+	if (client->ssl != NULL) {
+		SSL_free(client->ssl);
+	}
 	close(client->socket_fd);
 
 	/* Stop the callback mechanism for this client */
 	ev_io_stop(client->ev_loop, &client->io_watcher);
-	ev_async_stop(client->ev_loop, &client->async_watcher);
+	ev_io_stop(client->ev_loop, &client->write_watcher);
 	ev_timer_stop(client->ev_loop, &client->time_watcher);
-	
-	ev_break(client->ev_loop, EVBREAK_ONE); /* Stop iterating */
-	ev_loop_destroy(client->ev_loop);
+	ev_timer_stop(client->ev_loop, &client->dns_watcher);
 	free(client);
 }
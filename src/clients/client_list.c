@@ -3,7 +3,6 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
-#include <ctype.h>
 #include "client_list.h"
 
 /** @file
@@ -25,58 +24,34 @@
 /** A words list to hold every client */
 static Word_list_ptr clients;
 
-/** This function defines what characters are allowed inside a nickname. See RFC Section 2.3.1 to learn about this.
-   @param s The character to check.
-   @return `1` if `s` is allowed in a nickname; `0` otherwise.
+/** Translates from a special character (a character not in `[a-z]`) into its ID. Upper and lower case equivalents
+   share the same ID.
+   @param s A character, as an integer in `[0 .. 255]`.
+   @return `s`'s ID; `-1` if `s` is not a special character.
  */
-int nick_is_valid(char s)
-{
-	return
-		((s >= 'a' && s <= 'z') ||
-		 (s >= 'A' && s <= 'Z') || 
-		 s == '-' || s == '[' || s == ']' || 
-		 s == '\\' || s == '`' || s == '^' ||
-		 s == '{' || s == '}' || s == '|');
-}
+#define NICK_SPECIAL_ID(s) \
+	((s) == '-' ? 0 : (s) == '[' || (s) == '{' ? 1 : (s) == ']' || (s) == '}' ? 2 : (s) == '\\' || (s) == '|' ? 3 : \
+	 (s) == '`' ? 4 : (s) == '^' ? 5 : -1)
 
-/** Translates from an ID of a special character (a character not in `[a-z]` back to its corresponding character.
-   @param i ID
-   @return The special character whose ID is `i`; `-1` if `i` is an invalid ID.
+/** Defines what characters are allowed inside a nickname, and converts each of them into its ID. See RFC Section 2.3.1
+   to learn about which characters are allowed. Letters are case insensitive.
+   @param s A character, as an integer in `[0 .. 255]`.
+   @return `s`'s ID; `TRIE_INVALID_POS` if `s` is not allowed in a nickname.
  */
-static inline char special_id_to_char(int i)
-{
-	return (i == 0 ? '-' : i == 1 ? '{' : i == 2 ? '}' : i == 3 ? '|' : i == 4 ? '`' : i == 5 ? '^' : -1);
-}
+#define NICK_POS(s) \
+	((s) >= 'a' && (s) <= 'z' ? (s) - 'a' : (s) >= 'A' && (s) <= 'Z' ? (s) - 'A' : \
+	 NICK_SPECIAL_ID(s) == -1 ? TRIE_INVALID_POS : NICK_ALPHABET_SIZE + NICK_SPECIAL_ID(s))
 
 /** Converts a character ID back into its corresponding character.
    @param i ID
-   @return The character whose ID is `i`
- */
-char nick_pos_to_char(int i)
-{
-	return ((char)((i < NICK_ALPHABET_SIZE) ? ('a' + i) : special_id_to_char(i - NICK_ALPHABET_SIZE)));
-}
-
-/** Translates from a special character (a character not in `[a-z]` into its ID.
-   @param s A special character.
-   @return `s`'s ID; `-1` if `s` is an invalid character.
+   @return The character whose ID is `i`; `\0` if `i` is an invalid ID.
  */
-static inline int special_char_id(char s)
-{
-	return (s == '-' ? 0 : s == '[' || s == '{' ? 1 : s == ']' || s == '}' ? 2 : s == '\\' || 
-			s == '|' ? 3 : s == '`' ? 4 : s == '^' ? 5 : -1);
-}
+#define NICK_CHR(i) \
+	((i) < NICK_ALPHABET_SIZE ? 'a' + (i) : (i) == 26 ? '-' : (i) == 27 ? '{' : (i) == 28 ? '}' : (i) == 29 ? '|' : \
+	 (i) == 30 ? '`' : (i) == 31 ? '^' : '\0')
 
-/** Converts a character into its ID
-   @param s The character
-   @return `s`'s ID
- */
-int nick_char_to_pos(char s)
-{
-	return (((s >= 'a' && (s) <= 'z') || (s >= 'A' && s <= 'Z')) ?
-				tolower((unsigned char)s) - 'a' :
-				NICK_ALPHABET_SIZE + special_char_id(s));
-}
+/** The nicknames alphabet. This is shared by the clients list and by every channel's users list. */
+TRIE_ALPHABET(nick_alphabet, NICK_POS, NICK_CHR, NICK_EDGES_NO);
 
 /** Initializes clients list.
    @return `0` on success; `-1` on failure. `-1` indicates a resources allocation error.
@@ -86,7 +61,7 @@ int nick_char_to_pos(char s)
 int client_list_init(void)
 {
 	if ((clients =
-		     init_word_list(NULL, nick_is_valid, nick_pos_to_char, nick_char_to_pos, NICK_EDGES_NO)) == NULL) {
+		     init_word_list(NULL, &nick_alphabet)) == NULL) {
 		return -1;
 	}
 	return 0;
@@ -112,10 +87,12 @@ void client_list_destroy(void)
       a nonexisting client.
    @return The result of evaluating `(f)(matching_client, fargs)`. If no client matches, `NULL` is returned.
    @warning Remember that this whole operation - search the list, find a match, call `(f)()` is performed atomically.
-      Thus, `(f)()` must be fast (more clients can be waiting to read the list), but more important than that, careful
-      must be taken if `(f)()` uses synchronization tools (mutexes, semaphores, etc.) to perform its job. Always
-      remember that the global clients list is locked - using any locking mechanism inside `(f)()` is rarely necessary,
-      and can easily introduce deadlock conditions.
+      The clients list is only locked for reading during the search, and `(f)()` runs holding the matching client's
+      node lock only, so lookups for other clients proceed concurrently. Still, `(f)()` must be fast (other threads
+      looking up the same client, and any thread registering, renaming or removing a client, can be waiting for it),
+      but more important than that, careful must be taken if `(f)()` uses synchronization tools (mutexes, semaphores,
+      etc.) to perform its job. Using any locking mechanism inside `(f)()` is rarely necessary, and can easily
+      introduce deadlock conditions.
    @warning `(f)()` must not call `pthread_exit()`, otherwise, the lock for this list is never unlocked, and the whole
       IRCd freezes.
    @note `(f)()` shall cast its first argument to a client's structure pointer.
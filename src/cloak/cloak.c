@@ -4,6 +4,8 @@
 #include <openssl/md5.h>
 #include <openssl/sha.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "cloak.h"
 #include "serverinfo.h"
 
@@ -63,6 +65,15 @@
    Special care must be taken, since IPv6 addresses do not necessarily hold every field `a-h`. For example, `localhost`
    can be written using `::1`. This still needs some discussion, but a possible solution is to expand every IPv6 into
    a unified form where fields `a-h` can always be matched, and then use the above method safely.
+   Cloaking is on the path of every new connection, and clients tend to come back from the same hosts and subnets,
+   especially when a whole provider reconnects at once. Two things keep this cheap:
+   <ul>
+   <li>Every hash starts with one of three fixed `KEY:` prefixes. The SHA1 state after hashing each prefix is computed
+   once, by `cloak_init()`, and copied whenever a hash starts, so that only the variable part is hashed.</li>
+   <li>Each downsampled hash depends only on the text being hashed and on the order of the keys. Results are kept in a
+   bounded cache keyed by both, so a host, or a subnet component like `A.B.C` or `A.B`, is only hashed once while it
+   stays in the cache.</li>
+   </ul>
    @author Filipe Goncalves
    @date December 2013
  */
@@ -74,13 +85,79 @@
    `hide_host()` */
 #define MAX_HOST_LEN 128
 
-/** Takes 3 salt keys and a text, and stores `md5(sha1(salt1+":"+text+":"+salt2)+salt3)` into `result`.
-   @param salt1 The key used as a salt to prepend to `":"+text+":"`. Does not have to be null terminated.
-   @param salt2 The key used as a salt to append to `":"+text+":"`. Does not have to be null terminated.
-   @param salt3 The key used as a salt to append to `sha1(salt1+":"text+":"+salt2)`. Does not have to be null terminated.
-   @param salt1_len `salt1` length, excluding any possible null terminating character
-   @param salt2_len `salt2` length, excluding any possible null terminating character
-   @param salt3_len `salt3` length, excluding any possible null terminating character
+/** How many results the cloak cache holds. Keys are hashed into this many slots; a new result replaces whatever was
+   stored in its slot. */
+#define CLOAK_CACHE_SIZE 4096
+
+/** Longest text whose result is cached. Longer hostnames are hashed everytime. */
+#define CLOAK_CACHE_KEY_LEN 64
+
+/** Salts order used for reverse looked up hostnames and for `gamma`: `KEY1`, `KEY2`, `KEY3` */
+#define SALTS_123 0
+
+/** Salts order used for `alpha`: `KEY2`, `KEY3`, `KEY1` */
+#define SALTS_231 1
+
+/** Salts order used for `beta`: `KEY3`, `KEY1`, `KEY2` */
+#define SALTS_312 2
+
+/** A set of salt keys, in the order in which they are used by `do_md5()` */
+struct cloak_salts {
+	SHA_CTX prefix; /**<SHA1 state after hashing `salt1+":"`. */
+	const char *salt2; /**<Appended to `":"+text+":"`. */
+	size_t salt2_len; /**<`salt2` length. */
+	const char *salt3; /**<Appended to the SHA1 digest. */
+	size_t salt3_len; /**<`salt3` length. */
+};
+
+/** A cloak cache slot */
+struct cloak_cache_entry {
+	int salts; /**<Which salts order produced `value`; `-1` if the slot was never used. */
+	unsigned int value; /**<The downsampled hash. */
+	size_t key_len; /**<`key` length. */
+	char key[CLOAK_CACHE_KEY_LEN]; /**<The hashed text. Not null terminated. */
+};
+
+static struct cloak_salts salts[3]; /**<The three salts orders, indexed by `SALTS_123`, `SALTS_231`, and `SALTS_312`. */
+static struct cloak_cache_entry cache[CLOAK_CACHE_SIZE]; /**<The cloak cache. Protected by `cache_mutex`. */
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER; /**<Protects `cache` */
+
+/** Fills a salts order, hashing `salt1+":"` into its prefix state.
+   @param s The salts order to fill.
+   @param salt1 Number of the key used as `salt1`, as passed to `get_cloak_key()`.
+   @param salt2 Number of the key used as `salt2`.
+   @param salt3 Number of the key used as `salt3`.
+ */
+static void init_salts(struct cloak_salts *s, int salt1, int salt2, int salt3)
+{
+	SHA1_Init(&s->prefix);
+	SHA1_Update(&s->prefix, get_cloak_key(salt1), get_cloak_key_length(salt1));
+	SHA1_Update(&s->prefix, ":", 1);
+	s->salt2 = get_cloak_key(salt2);
+	s->salt2_len = get_cloak_key_length(salt2);
+	s->salt3 = get_cloak_key(salt3);
+	s->salt3_len = get_cloak_key_length(salt3);
+}
+
+/** Initializes the cloaking module: precomputes the SHA1 prefix states for the three salts orders, and empties the
+   cache.
+   @warning This function must be called exactly once, by the main thread, after the server's configuration was loaded
+      and before any client is cloaked.
+ */
+void cloak_init(void)
+{
+	int i;
+	init_salts(&salts[SALTS_123], 1, 2, 3);
+	init_salts(&salts[SALTS_231], 2, 3, 1);
+	init_salts(&salts[SALTS_312], 3, 1, 2);
+	for (i = 0; i < CLOAK_CACHE_SIZE; i++) {
+		cache[i].salts = -1;
+	}
+}
+
+/** Takes a salts order and a text, and stores `md5(sha1(salt1+":"+text+":"+salt2)+salt3)` into `result`.
+   The SHA1 state for `salt1+":"` was precomputed by `cloak_init()`; only the rest of the message is hashed here.
+   @param s The salts order.
    @param text A pointer to a characters sequence holding the text that shall be joined to the salt keys. This sequence
 			   does not have to be null terminated.
    @param text_len `text` length, excluding any possible null terminating character
@@ -91,26 +168,20 @@
    @warning `result` is not null terminated.
    @warning `result` shall be a valid and allocated memory location.
  */
-static void do_md5(const char *salt1,
-		   size_t salt1_len,
-		   const char *salt2,
-		   size_t salt2_len,
-		   const char *salt3,
-		   size_t salt3_len,
-		   const char *text,
-		   size_t text_len,
-		   unsigned char result[MD5_DIGEST_LENGTH])
+static void do_md5(const struct cloak_salts *s, const char *text, size_t text_len, unsigned char result[MD5_DIGEST_LENGTH])
 {
-	char buf1[salt1_len + salt2_len + text_len + 2]; /* +2 because we need space for two ':' */
-	char buf2[SHA_DIGEST_LENGTH + salt3_len];
-	strncpy(buf1, salt1, salt1_len);
-	buf1[salt1_len] = ':';
-	strncpy(buf1 + salt1_len + 1, text, text_len);
-	buf1[salt1_len + text_len + 1] = ':';
-	strncpy(buf1 + salt1_len + text_len + 2, salt2, salt2_len);
-	SHA1((const unsigned char*)buf1, (unsigned long) sizeof(buf1), (unsigned char*)buf2);
-	strncpy(buf2 + SHA_DIGEST_LENGTH, salt3, salt3_len);
-	MD5((const unsigned char*)buf2, sizeof(buf2), result);
+	SHA_CTX sha;
+	MD5_CTX md5;
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	sha = s->prefix;
+	SHA1_Update(&sha, text, text_len);
+	SHA1_Update(&sha, ":", 1);
+	SHA1_Update(&sha, s->salt2, s->salt2_len);
+	SHA1_Final(digest, &sha);
+	MD5_Init(&md5);
+	MD5_Update(&md5, digest, sizeof(digest));
+	MD5_Update(&md5, s->salt3, s->salt3_len);
+	MD5_Final(result, &md5);
 }
 
 /** Packs an MD5 hash consisting of `MD5_DIGEST_LENGTH` bytes into a singe integer.
@@ -154,6 +225,61 @@ static unsigned int downsample(unsigned char hash[MD5_DIGEST_LENGTH])
 	return sample;
 }
 
+/** Computes the cache slot for a text hashed with a given salts order (FNV-1a).
+   @param salts_order The salts order.
+   @param text The text.
+   @param len `text` length.
+   @return Index of the slot in `cache` where the result is stored.
+ */
+static unsigned int cache_slot(int salts_order, const char *text, size_t len)
+{
+	uint32_t h;
+	size_t i;
+	h = 2166136261U ^ (uint32_t)salts_order;
+	for (i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)text[i]) * 16777619U;
+	}
+	return h % CLOAK_CACHE_SIZE;
+}
+
+/** Computes `downsample(md5(sha1(salt1+":"+text+":"+salt2)+salt3))` for a salts order, going through the cache.
+   @param salts_order `SALTS_123`, `SALTS_231` or `SALTS_312`.
+   @param text The text to hash. Does not have to be null terminated.
+   @param len `text` length.
+   @return The downsampled hash.
+ */
+static unsigned int cloak_component(int salts_order, const char *text, size_t len)
+{
+	unsigned char hash[MD5_DIGEST_LENGTH];
+	struct cloak_cache_entry *entry;
+	unsigned int value;
+
+	if (len > CLOAK_CACHE_KEY_LEN) {
+		do_md5(&salts[salts_order], text, len, hash);
+		return downsample(hash);
+	}
+	entry = &cache[cache_slot(salts_order, text, len)];
+	pthread_mutex_lock(&cache_mutex);
+	if (entry->salts == salts_order && entry->key_len == len && memcmp(entry->key, text, len) == 0) {
+		value = entry->value;
+		pthread_mutex_unlock(&cache_mutex);
+		return value;
+	}
+	pthread_mutex_unlock(&cache_mutex);
+
+	/* Hash without holding the lock. Two threads may compute the same result concurrently; that's harmless */
+	do_md5(&salts[salts_order], text, len, hash);
+	value = downsample(hash);
+
+	pthread_mutex_lock(&cache_mutex);
+	entry->salts = salts_order;
+	entry->value = value;
+	entry->key_len = len;
+	memcpy(entry->key, text, len);
+	pthread_mutex_unlock(&cache_mutex);
+	return value;
+}
+
 /** Knows how to hide an IPv4 address. See this file's description for further details on the algorithm.
    @param host A pointer to a null terminated characters sequence denoting the user's ip address. Should be a string of
 			   the form "A.B.C.D".
@@ -163,25 +289,22 @@ static unsigned int downsample(unsigned char hash[MD5_DIGEST_LENGTH])
  */
 char *hide_ipv4(char *host)
 {
-	unsigned char alpha[MD5_DIGEST_LENGTH];
-	unsigned char beta[MD5_DIGEST_LENGTH];
-	unsigned char gamma[MD5_DIGEST_LENGTH];
+	unsigned int alpha;
+	unsigned int beta;
+	unsigned int gamma;
 	char result[(CHAR_BIT / BITS_IN_HEXA) * sizeof(unsigned) * 3 + 6];
 	size_t len;
 
 	len = strlen(host);
-	do_md5(get_cloak_key(2), get_cloak_key_length(2), get_cloak_key(3), get_cloak_key_length(3), get_cloak_key(
-		       1), get_cloak_key_length(1), host, len, alpha);
+	alpha = cloak_component(SALTS_231, host, len);
 	for (len--; host[len] != '.'; len--)
 		;  /* Intentionally left blank */
 	/* assert: host[len] == '.' */
-	do_md5(get_cloak_key(3), get_cloak_key_length(3), get_cloak_key(1), get_cloak_key_length(1), get_cloak_key(
-		       2), get_cloak_key_length(2), host, len, beta);
+	beta = cloak_component(SALTS_312, host, len);
 	for (len--; host[len] != '.'; len--)
 		;  /* Intentionally left blank */
-	do_md5(get_cloak_key(1), get_cloak_key_length(1), get_cloak_key(2), get_cloak_key_length(2), get_cloak_key(
-		       3), get_cloak_key_length(3), host, len, gamma);
-	sprintf(result, "%X.%X.%X.IP", downsample(alpha), downsample(beta), downsample(gamma));
+	gamma = cloak_component(SALTS_123, host, len);
+	sprintf(result, "%X.%X.%X.IP", alpha, beta, gamma);
 	return strdup(result);
 }
 
@@ -193,15 +316,13 @@ char *hide_ipv4(char *host)
  */
 char *hide_host(char *host)
 {
-	unsigned char alpha[MD5_DIGEST_LENGTH];
+	unsigned int alpha;
 	char *p;
 	char result[MAX_HOST_LEN];
-	size_t host_len = strlen(host);
 
-	do_md5(get_cloak_key(1), get_cloak_key_length(1), get_cloak_key(2), get_cloak_key_length(2), get_cloak_key(
-		       3), get_cloak_key_length(3), host, host_len, alpha);
+	alpha = cloak_component(SALTS_123, host, strlen(host));
 	for (p = host; *p != '\0' && (*p != '.' || !isalpha((unsigned char)*(p + 1))); p++)
 		;  /* Intentionally left blank */
-	snprintf(result, sizeof(result), "%s-%X%s", get_cloak_net_prefix(), downsample(alpha), *p == '\0' ? "" : p);
+	snprintf(result, sizeof(result), "%s-%X%s", get_cloak_net_prefix(), alpha, *p == '\0' ? "" : p);
 	return strdup(result);
 }
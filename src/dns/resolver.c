@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include "resolver.h"
+#include "worker.h"
+
+/** @file
+   @brief Asynchronous reverse DNS resolver implementation
+
+   Submitted queries are kept in a FIFO list, protected by a mutex, and picked up by the resolver threads, which sleep
+      on a condition variable while the list is empty. Each thread performs one blocking lookup at a time; the pool
+      size bounds how many lookups are in flight.
+   A query is never freed here. Once answered, or once a resolver thread finds out it was cancelled before it was
+      started, the query is handed back to its worker, which owns it from then on. This way, cancelling a query never
+      races with a resolver thread that is still using it.
+   The cache is a fixed array of `DNS_CACHE_SIZE` slots, indexed by a hash of the address. Each slot holds a single
+      address; collisions simply replace the older entry. Entries expire `cache_ttl` seconds after they were stored.
+   @author Filipe Goncalves
+   @date November 2013
+ */
+
+/** A cache slot */
+struct dns_cache_entry {
+	struct in_addr address; /**<The address this entry describes */
+	time_t expires; /**<When this entry stops being valid. `0` means the slot was never used. */
+	char *hostname; /**<The address's hostname; `NULL` if the address has no reverse hostname. */
+};
+
+/** An entry of the hosts table */
+struct hosts_entry {
+	struct in_addr address; /**<The address */
+	char *hostname; /**<The hostname that shall be reported for `address` */
+};
+
+static struct dns_query *pending_head; /**<Oldest pending query. Protected by `pending_mutex`. */
+static struct dns_query *pending_tail; /**<Most recent pending query. Protected by `pending_mutex`. */
+static pthread_mutex_t pending_mutex = PTHREAD_MUTEX_INITIALIZER; /**<Protects the pending queries list */
+static pthread_cond_t pending_cond = PTHREAD_COND_INITIALIZER; /**<Signaled when a query is added to the pending list */
+
+static struct dns_cache_entry cache[DNS_CACHE_SIZE]; /**<The cache. Protected by `cache_mutex`. */
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER; /**<Protects `cache` */
+static int ttl; /**<How many seconds a cache entry is valid */
+
+static struct hosts_entry *hosts; /**<The hosts table. It is loaded once by `resolver_init()`, and is read-only afterwards. */
+static int hosts_count; /**<How many entries are in `hosts` */
+
+static int getnameinfo_backend(struct in_addr address, char *hostname, size_t len);
+static dns_backend_t backend = getnameinfo_backend; /**<The function used to reverse addresses that are not in `hosts` */
+
+/** The default lookup backend, which asks the system's resolver with `getnameinfo()`.
+   @param address The address to reverse.
+   @param hostname Where to write the hostname.
+   @param len Size of `hostname`.
+   @return `DNS_FOUND` if a hostname was written in `hostname`; `DNS_NOT_FOUND` otherwise.
+ */
+static int getnameinfo_backend(struct in_addr address, char *hostname, size_t len)
+{
+	struct sockaddr_in sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr = address;
+	if (getnameinfo((struct sockaddr*)&sa, sizeof(sa), hostname, len, NULL, 0, NI_NAMEREQD) != 0) {
+		return DNS_NOT_FOUND;
+	}
+	return DNS_FOUND;
+}
+
+/** Loads a hosts table. The file has the same format as `/etc/hosts`: an IPv4 address, followed by the hostname to
+   report for it, one per line. Additional names on the same line are ignored, and so are lines starting with `#`, and
+   lines with IPv6 or malformed addresses.
+   @param path Path to the hosts file.
+   @return `0` on success; `-1` if the file could not be read, or if there's no memory to store its entries.
+ */
+static int load_hosts(const char *path)
+{
+	FILE *file;
+	char line[512];
+	char *ip;
+	char *name;
+	char *saveptr;
+	struct in_addr address;
+	struct hosts_entry *entries;
+	int capacity;
+
+	if ((file = fopen(path, "r")) == NULL) {
+		perror("::resolver.c:load_hosts(): Could not open hosts file");
+		return -1;
+	}
+	capacity = 0;
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if ((ip = strtok_r(line, " \t\r\n", &saveptr)) == NULL || *ip == '#' ||
+		    (name = strtok_r(NULL, " \t\r\n", &saveptr)) == NULL || inet_pton(AF_INET, ip, &address) != 1) {
+			continue;
+		}
+		if (hosts_count == capacity) {
+			capacity = (capacity == 0 ? 16 : 2 * capacity);
+			if ((entries = realloc(hosts, capacity * sizeof(*hosts))) == NULL) {
+				fprintf(stderr, "::resolver.c:load_hosts(): Could not allocate memory.\n");
+				fclose(file);
+				return -1;
+			}
+			hosts = entries;
+		}
+		if ((hosts[hosts_count].hostname = strdup(name)) == NULL) {
+			fprintf(stderr, "::resolver.c:load_hosts(): Could not allocate memory.\n");
+			fclose(file);
+			return -1;
+		}
+		hosts[hosts_count++].address = address;
+	}
+	fclose(file);
+	return 0;
+}
+
+/** Computes the cache slot for an address.
+   @param address The address.
+   @return Index of the slot in `cache` where `address` is stored.
+ */
+static unsigned int cache_slot(struct in_addr address)
+{
+	return (unsigned int)(((uint32_t)address.s_addr * 2654435761U) % DNS_CACHE_SIZE);
+}
+
+/** Stores an answer in the cache, replacing whatever occupied its slot.
+   @param address The address.
+   @param hostname The hostname found for `address`, or `NULL` to cache the fact that it has none.
+ */
+static void cache_store(struct in_addr address, const char *hostname)
+{
+	struct dns_cache_entry *entry;
+	char *copy;
+	copy = NULL;
+	if (hostname != NULL && (copy = strdup(hostname)) == NULL) {
+		/* Not worth complaining about; we just won't remember it */
+		return;
+	}
+	entry = &cache[cache_slot(address)];
+	pthread_mutex_lock(&cache_mutex);
+	free(entry->hostname);
+	entry->address = address;
+	entry->hostname = copy;
+	entry->expires = time(NULL) + ttl;
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+/** Looks up an address in the cache.
+   @param address The address.
+   @param hostname Where to write the cached hostname, if there is one.
+   @param len Size of `hostname`.
+   @return `DNS_FOUND` if the address is cached with a hostname, which was copied to `hostname`; `DNS_NOT_FOUND` if the
+      address is cached as having no hostname; `DNS_CACHE_MISS` if the address is not cached, or if its entry expired.
+ */
+int resolver_cache_lookup(struct in_addr address, char *hostname, size_t len)
+{
+	struct dns_cache_entry *entry;
+	int ret;
+	entry = &cache[cache_slot(address)];
+	pthread_mutex_lock(&cache_mutex);
+	if (entry->expires == 0 || entry->address.s_addr != address.s_addr || entry->expires <= time(NULL)) {
+		ret = DNS_CACHE_MISS;
+	} else if (entry->hostname == NULL) {
+		ret = DNS_NOT_FOUND;
+	} else {
+		strncpy(hostname, entry->hostname, len - 1);
+		hostname[len - 1] = '\0';
+		ret = DNS_FOUND;
+	}
+	pthread_mutex_unlock(&cache_mutex);
+	return ret;
+}
+
+/** Reverses an address, first with the hosts table, then with the backend.
+   @param address The address to reverse.
+   @param hostname Where to write the hostname.
+   @param len Size of `hostname`.
+   @return `DNS_FOUND` or `DNS_NOT_FOUND`.
+ */
+static int resolve(struct in_addr address, char *hostname, size_t len)
+{
+	int i;
+	for (i = 0; i < hosts_count; i++) {
+		if (hosts[i].address.s_addr == address.s_addr) {
+			strncpy(hostname, hosts[i].hostname, len - 1);
+			hostname[len - 1] = '\0';
+			return DNS_FOUND;
+		}
+	}
+	return (*backend)(address, hostname, len);
+}
+
+/** A resolver thread's starting point. Takes pending queries in submission order, answers them, stores the answers in
+   the cache, and hands each query back to its worker. Queries that were cancelled before a thread got to them are
+   handed back right away, without being answered.
+   @param arg Not used.
+   @return This function never returns.
+ */
+static void *resolver_main(void *arg)
+{
+	struct dns_query *query;
+	for (;;) {
+		pthread_mutex_lock(&pending_mutex);
+		while (pending_head == NULL) {
+			pthread_cond_wait(&pending_cond, &pending_mutex);
+		}
+		query = pending_head;
+		if ((pending_head = query->next) == NULL) {
+			pending_tail = NULL;
+		}
+		pthread_mutex_unlock(&pending_mutex);
+
+		query->status = DNS_NOT_FOUND;
+		if (!__atomic_load_n(&query->cancelled, __ATOMIC_RELAXED)) {
+			query->status = resolve(query->address, query->hostname, sizeof(query->hostname));
+			cache_store(query->address, query->status == DNS_FOUND ? query->hostname : NULL);
+		}
+		worker_post_dns(query->worker, query);
+	}
+	return NULL;
+}
+
+/** Starts the resolver threads and loads the hosts table.
+   @param threads How many lookups may be in flight at the same time. If this is `0` or negative, a single thread is
+      started.
+   @param cache_ttl How many seconds an answer is kept in the cache.
+   @param hosts_file Path to a hosts table to consult before the backend (see `load_hosts()`); `NULL` if there is none.
+   @return `0` on success; `-1` if the hosts table could not be loaded, or if the resolver threads could not be started,
+      in which case an error message is printed.
+   @warning This function must be called exactly once, by the main thread, before any connection is accepted.
+ */
+int resolver_init(int threads, int cache_ttl, const char *hosts_file)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int i;
+
+	ttl = cache_ttl;
+	if (hosts_file != NULL && load_hosts(hosts_file) == -1) {
+		return -1;
+	}
+	if (threads <= 0) {
+		threads = 1;
+	}
+	if (pthread_attr_init(&attr) != 0) {
+		perror("::resolver.c:resolver_init(): Could not initialize thread attributes");
+		return -1;
+	}
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&thread, &attr, resolver_main, NULL) != 0) {
+			perror("::resolver.c:resolver_init(): Could not create resolver thread");
+			pthread_attr_destroy(&attr);
+			return -1;
+		}
+	}
+	pthread_attr_destroy(&attr);
+	return 0;
+}
+
+/** Replaces the lookup backend. The hosts table, if any, is still consulted first.
+   @param new_backend The new backend. See `dns_backend_t`.
+   @warning This must be called before any query is submitted.
+ */
+void resolver_set_backend(dns_backend_t new_backend)
+{
+	backend = new_backend;
+}
+
+/** Submits a reverse lookup. The answer is delivered to `worker` with `worker_post_dns()`.
+   @param client The client waiting for the answer.
+   @param worker The worker serving `client`.
+   @param address The address to reverse.
+   @return The new query, which the worker can pass to `resolver_cancel()` if it does not want the answer anymore;
+      `NULL` if there's no memory.
+ */
+struct dns_query *resolver_submit(struct irc_client *client, struct irc_worker *worker, struct in_addr address)
+{
+	struct dns_query *query;
+	if ((query = malloc(sizeof(*query))) == NULL) {
+		return NULL;
+	}
+	query->address = address;
+	query->cancelled = 0;
+	query->client = client;
+	query->worker = worker;
+	query->next = NULL;
+
+	pthread_mutex_lock(&pending_mutex);
+	if (pending_tail == NULL) {
+		pending_head = query;
+	} else {
+		pending_tail->next = query;
+	}
+	pending_tail = query;
+	pthread_cond_signal(&pending_cond);
+	pthread_mutex_unlock(&pending_mutex);
+	return query;
+}
+
+/** Cancels a query. The worker still gets the query back, but it must free it without looking at the answer, nor at
+   `query->client`, which may be gone by then.
+   @param query The query to cancel.
+   @warning This must only be called by the worker that submitted `query`, before its answer was processed.
+ */
+void resolver_cancel(struct dns_query *query)
+{
+	__atomic_store_n(&query->cancelled, 1, __ATOMIC_RELAXED);
+}
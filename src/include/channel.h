@@ -28,6 +28,9 @@
 /** Used to report when a client attempts to join a channel, but he has hit the maximum number of channels allowed */
 #define CHAN_LIMIT_EXCEEDED 5
 
+/** Returned by `do_join()` when a user tries to join a channel he's already in */
+#define CHAN_ALREADY_ON_CHANNEL 6
+
 /** Opaque type for a channelused by the rest of the code */
 typedef struct irc_channel *irc_channel_ptr;
 
@@ -22,21 +22,34 @@
 /** `STATUS_TIMEOUT` means we've sent a PING request to this client and are waiting for the corresponding PONG reply. */
 #define STATUS_TIMEOUT 1
 
+struct irc_worker;
+struct dns_query;
+
 /** The structure that describes an IRC client */
 struct irc_client {
 	struct ev_io io_watcher; /**<io watcher for this client's socket. This watcher will be responsible for calling the appropriate callback function when there is interesting data to read from the socket. */
-	struct ev_async async_watcher; /**<async watcher used to wake up a client's thread when there is new data queued and waiting to be sent. */
+	struct ev_io write_watcher; /**<io watcher that fires when this client's socket is writable. It is only active while this client's output buffer (`write_queue`) holds data that the socket did not accept yet. */
 	struct ev_timer time_watcher; /**<A time watcher that calls a function every `get_ping_freq()` seconds to send a possible PING message to the client, if no other activity was detected recently.
 									  Once a PING is sent, the timer is set to expire after `get_timeout()` seconds; if no PONG reply arrives in between, the connection is assumed to be dead, and the
 									  client's session is terminated. See `ping_timer_cb()` */
+	struct ev_timer dns_watcher; /**<A timer that bounds how long this client waits for his reverse lookup. See `get_dns_timeout()`. */
+	struct dns_query *dns_query; /**<This client's pending reverse lookup; `NULL` if there is none. Nothing is read from a client while his lookup is pending, so that he cannot
+	                                register before his hostname is known. */
 	ev_tstamp last_activity; /**<Timestamp for the last activity on this connection. This is updated everytime new data is read from the socket. */
-	struct ev_loop *ev_loop; /**<libev loop for this client's thread. Each thread holds its own loop. */
-	struct msg_queue write_queue; /**<Write queue that holds messages waiting to be sent. @see client_queue.h */
+	struct ev_loop *ev_loop; /**<libev loop where this client's watchers are registered. This is the loop of the worker serving this client, shared with every other client of that worker. */
+	struct irc_worker *worker; /**<The worker thread serving this client. See `worker.h`. */
+	int wakeup_pending; /**<Set when other threads queued messages for this client, and he was added to his worker's ready list; cleared by `client_wakeup()`. Only accessed
+	                       with atomic builtins. See `worker_notify()`. */
+	struct irc_client *ready_next; /**<Next client in the worker's ready list. Protected by the worker's `ready_mutex`. */
+	struct msg_queue write_queue; /**<Write queue that holds messages waiting to be sent. This is the client's output buffer: every byte sent to this client goes through it. @see write_msgs_queue.h */
 	char *realname; /**<GECOS field. */
 	char *hostname; /**<reverse looked up hostname, or the IP address if no reverse is available. */
 	char *public_host; /**<cloaked hostname for this client. This is the address shown to other regular users, so that a client's address is kept private. */
 	char *nick; /**<nickname */
 	char *username; /**<ident field */
+	char *prefix; /**<`nick!user@host`, the source of every message sent on behalf of this client, as other users see it. It is built once `nick`, `username` and `public_host`
+	                 are known, and rebuilt whenever one of them changes, so that messages can be assembled without formatting it again. See `client_update_prefix()`. */
+	size_t prefix_len; /**<Length of `prefix`. */
 	char *server; /**<this client's server ip address. `NULL` if it's a local client. */
 	char **channels; /**<A dynamically allocated array of `char *` holding a list of the channels this client is in. Free positions hold a NULL pointer. */
 	int channels_count; /**<How many channels he joined, i.e., how many positions in `channels` are taken (not NULL). */
@@ -46,12 +59,13 @@ struct irc_client {
 	unsigned uses_ssl : 1; /**<bit field indicating if this client is using a secure connection. */
 	unsigned host_reversed : 1; /**<bit field indicating if we were able to reverse lookup this client's IP address. If this field is not set, then `hostname` holds an IP address, otherwise, a hostname. */
 	unsigned connection_status : 1; /**<bit field indicating the connection status: `STATUS_OK` in normal situations; `STATUS_TIMEOUT` if we're waiting for a PONG reply from a previous PING. */
+	unsigned is_terminated : 1; /**<bit field set by `terminate_session()`. A terminated client is destroyed as soon as the callback that is currently running on his behalf returns to the loop. */
+	unsigned is_handshaking : 1; /**<bit field indicating that this SSL client did not complete the SSL handshake yet. Nothing is read from or written to the client's SSL connection until the handshake is done. */
 	int socket_fd; /**<the socket descriptor used to communicate with this client. */
 	SSL *ssl; /**<main SSL structure, created per establish connection. */
 };
 
-/** This structure serves as a wrapper to pass arguments to this client's thread initialization function. `pthread_create()` is capable of passing a generic pointer holding the arguments, thus, we encapsulate
-	every argument to be passed to `new_client()` in this structure.
+/** This structure serves as a wrapper to hand a freshly accepted connection over to a worker. The main thread fills it, and the worker that was assigned to the connection passes it to `new_client()`.
 */
 struct irc_client_args_wrapper {
 	int socket; /**<socket file descriptor for the new connection. Typically, this is the return value from `accept()` */
@@ -63,10 +77,16 @@ struct irc_client_args_wrapper {
 	socklen_t address_length; /**<Length of the sockaddr attribute in use */
 	unsigned is_ipv6 : 1; /**<Bit-field indicating if this is an IPv6 connection. This field is used to remember what the union is holding. */
 	SSL *ssl; /**<main SSL structure for secure connected clients */
+	size_t sendq; /**<SendQ of the connection class of the socket this connection arrived on. */
+	int recvq; /**<RecvQ of the connection class of the socket this connection arrived on: the size of the client's messages buffer. */
+	struct irc_client_args_wrapper *next; /**<Next connection in a worker's handoff list. See `worker.h`. */
 };
 
 /* Documented in client.c */		
-void *new_client(void *args);
+int new_client(struct irc_worker *worker, struct irc_client_args_wrapper *args);
 void terminate_session(struct irc_client *client, char *quit_msg);
+void client_dns_done(struct dns_query *query);
+void client_wakeup(struct irc_client *client);
+int client_update_prefix(struct irc_client *client);
 
 #endif /* __IRC_CLIENT_GUARD__ */
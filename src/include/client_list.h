@@ -29,8 +29,6 @@ void client_list_destroy(void);
 void *client_list_find_and_execute(char *nick, void *(*f)(void *, void *), void *fargs, int *success);
 int client_list_add(struct irc_client *client, char *newnick);
 void client_list_delete(struct irc_client *client);
-int nick_is_valid(char s);
-char nick_pos_to_char(int i);
-int nick_char_to_pos(char s);
+extern const struct trie_alphabet nick_alphabet;
 
 #endif /* __IRC_CLIENT_LIST_GUARD__ */
@@ -22,6 +22,7 @@
 */
 
 /* Documented in C source file */
+void cloak_init(void);
 char *hide_ipv4(char *host);
 char *hide_host(char *host);
 
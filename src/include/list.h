@@ -1,12 +1,14 @@
 #ifndef __YAIRCD_GENERIC_LIST_GUARD__
 #define __YAIRCD_GENERIC_LIST_GUARD__
+#include "trie.h"
 
 /** @file
 	@brief Generic thread-safe words container.
 	
-	This file implements a generic thread-safe words container. It uses an underlying trie implementation, and a mutex to control concurrent accesses to this trie.
+	This file implements a generic thread-safe words container. It uses an underlying trie implementation, and a reader-writer lock to control concurrent accesses to this trie.
 	Thus, the functions provided here are nothing more than the same functions offered by the trie implementation, except that everything is wrapped in a structure
-	with accesses controlled by a mutex.
+	with accesses controlled by a reader-writer lock. Searches only take the lock for reading, so that lookups (such as finding a private message's target) never wait for
+	each other; only adding and deleting words takes it for writing.
 	
 	Two core functions, `list_find_and_execute()`, and `list_find_and_execute_globalock()`, are provided to perform atomic arbitrary operations on the list items. Besides the global locking mechanism,
 	each node added to a list is packed with a lock just for itself. This allows multiple threads to work on different list elements instead of having to wait for the global lock to become available even if their
@@ -45,7 +47,7 @@
 typedef struct yaircd_list *Word_list_ptr;
 
 /* Documented in .c source file */
-Word_list_ptr init_word_list(void (*free_function)(void *), int (*is_valid)(char), char (*pos_to_char)(int), int (*char_to_pos)(char), int charcount);
+Word_list_ptr init_word_list(void (*free_function)(void *), const struct trie_alphabet *alphabet);
 void destroy_word_list(Word_list_ptr list, int free_data);
 void *list_find_word(Word_list_ptr list, char *word);
 void *list_find_word_nolock(Word_list_ptr list, char *word);
@@ -1,5 +1,7 @@
 #ifndef __YAIRCD_MSGIO_GUARD__
 #define __YAIRCD_MSGIO_GUARD__
+#include <string.h>
+#include "protocol.h"
 #include "client.h"
 
 /** @file
@@ -12,15 +14,6 @@
 	@see msgio.c
 */
 
-/** A macro that knows how to write to a client. It is an abstraction used by every function that wants to write to a client socket.
-	It knows how to deal with plaintext sockets and SSL sockets. No other function in the whole ircd should worry about this.
-	@param client The client to notify.
-	@param buf A characters sequence, possibly not null-terminated, that shall be written to this client's socket.
-	@param len How many characters from `buf` are to be written into this client's socket.
-	@note On success, exactly `len` characters will be written to `client`'s socket, and the macro evaluates to `0`. On failure, the macro evaluates to `-1`.
-*/
-#define write_to(client,buf,len) ((client)->uses_ssl ? SSL_write((client)->ssl, (buf), (len)) : send((client)->socket_fd, (buf), (len), 0))
-
 /** A macro that knows how to read from a client socket. It is an abstraction used by every function that wants to read from a client.
 	It knows how to deal with plaintext sockets and SSL sockets. No other function in the whole ircd should worry about this.
 	On success, the macro evaluates to a positive integer of type `ssize_t` denoting the number of characters read on success. If the other end closed the connection, the macro evaluates to `0`.
@@ -34,10 +27,59 @@
 */
 #define read_from(client,buf,len) ((client)->uses_ssl ? SSL_read((client)->ssl, (buf), (len)) : recv((client)->socket_fd, (buf), (len), 0))
 
+/** How many characters a `struct msg_builder` holds before its lines are queued to the client: room for 4 full IRC messages. */
+#define MSG_BUILDER_SIZE (4 * MAX_MSG_SIZE)
+
+/** Builds replies to a client without a format string: each piece is copied as it is, and its length is either known in advance or measured once.
+	Several lines may be built in a row; they are queued to the client together, with a single `write_to()` call, by `msg_send()`, or earlier if the buffer fills up.
+	A line never grows past `MAX_MSG_SIZE` characters, CR LF included, and it is only truncated at parameter boundaries: a middle parameter that does not fit is left out,
+	along with any other middle parameter after it, but the trailing parameter is still added, cut short if needed. Typical use:
+	
+		struct msg_builder msg;
+		msg_builder_init(&msg, client);
+		msg_add_numeric(&msg, ERR_NOSUCHNICK);
+		msg_add_param(&msg, nick);
+		msg_add_trailing_const(&msg, "No such nick/channel");
+		msg_end_line(&msg);
+		msg_send(&msg);
+	
+	@see msgio.c
+*/
+struct msg_builder {
+	struct irc_client *client; /**<The client the replies are for. */
+	size_t len; /**<How many characters `buf` holds. */
+	size_t line_begin; /**<Where the line being built begins in `buf`. */
+	unsigned line_full : 1; /**<Set when the line being built was cut short; nothing else is added to it. */
+	unsigned params_full : 1; /**<Set when a middle parameter did not fit in the line being built; no other middle parameter is added to it. */
+	char buf[MSG_BUILDER_SIZE]; /**<The lines built so far. */
+};
+
+/** Appends a string literal to the line being built, as `msg_add()` does. */
+#define msg_add_const(msg, lit) msg_add((msg), (lit), sizeof(lit) - 1)
+
+/** Appends a null terminated characters sequence to the line being built, as `msg_add()` does. */
+#define msg_add_str(msg, str) msg_add((msg), (str), strlen(str))
+
+/** Appends a string literal as the trailing parameter of the line being built. See `msg_add_trailing()`. */
+#define msg_add_trailing_const(msg, lit) msg_add_trailing((msg), (lit), sizeof(lit) - 1)
+
 /* Functions documented in the source file */
+int write_to(struct irc_client *client, const char *buf, size_t len);
+int io_would_block(struct irc_client *client, int ret);
 void yaircd_send(struct irc_client *client, const char *fmt, ...);
 int cmd_print_reply(char *buf, size_t size, const char *msg, ...);
-inline void write_to_noerr(struct irc_client *client, char *buf, size_t len);
-inline ssize_t read_from_noerr(struct irc_client *client, char *buf, size_t len);
+int cmd_print_from(char *buf, size_t size, struct irc_client *from, const char *cmd, const char *middle,
+		   const char *trailing);
+void msg_builder_init(struct msg_builder *msg, struct irc_client *client);
+void msg_add(struct msg_builder *msg, const char *str, size_t len);
+void msg_add_param(struct msg_builder *msg, const char *param);
+void msg_add_int(struct msg_builder *msg, long n);
+void msg_add_numeric(struct msg_builder *msg, const char *numeric);
+void msg_add_trailing(struct msg_builder *msg, const char *str, size_t len);
+void msg_end_line(struct msg_builder *msg);
+void msg_send(struct msg_builder *msg);
+void write_to_noerr(struct irc_client *client, char *buf, size_t len);
+void write_shared_noerr(struct irc_client *client, struct shared_msg *msg);
+ssize_t read_from_noerr(struct irc_client *client, char *buf, size_t len);
 
 #endif /* __YAIRCD_MSGIO_GUARD__ */
@@ -435,6 +435,16 @@
 /** Quit message for when `write_to()` is not successfull */
 #define BAD_WRITE_QUIT_MSG "Write error on client's socket"
 
+/** Quit message for clients that do not read fast enough, and let their output buffer grow beyond the SendQ configured
+	for their connection class */
+#define SENDQ_EXCEEDED_QUIT_MSG "Max SendQ exceeded"
+
+/** Quit message for SSL clients whose handshake failed */
+#define SSL_HANDSHAKE_QUIT_MSG "SSL handshake failed"
+
+/** Quit message for SSL clients that did not complete the handshake in time */
+#define HANDSHAKE_TIMEOUT_QUIT_MSG "SSL handshake timed out"
+
 /* End misc */
 
 #endif /* __PROTOCOL_SPECS_GUARD__ */
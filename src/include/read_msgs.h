@@ -1,5 +1,6 @@
 #ifndef __YAIRCD_READ_MSGS_GUARD__
 #define __YAIRCD_READ_MSGS_GUARD__
+#include <sys/types.h>
 #include "protocol.h"
 
 /** @file
@@ -21,6 +22,14 @@
 */
 #define MSG_CONTINUE -1
 
+/** Return value for `next_msg()` when a message longer than `MAX_MSG_SIZE` was thrown away. The messages after it are still read as usual. */
+#define MSG_TOO_LONG -2
+
+/** How many characters a client's read watcher callback reads, at most, before going back to the events loop. Reading until the socket is empty makes a burst go through in one
+	callback, instead of one callback per buffer full; this budget keeps a client that sends without pause from starving the other clients served by the same worker.
+*/
+#define READ_BUDGET 65536
+
 /** This structure represents the status of a socket read. Socket reading is undeterministic by nature: multiple messages can arrive in a single read, or no complete messages may arrive.
 	Note that even though we're using TCP connections, the sockets implementation uses buffers, and will not always deliver data exactly as it was sent in the other end.
 	For example, a client may write "NICK <nick>\\r\\n" and then "USER <user> 0 * :GECOS field\\r\\n", but in the server side, when we read, we get the whole thing with one read.
@@ -31,16 +40,20 @@
 	make it look like only one single, full IRC messages arrives to the socket at a time.
 */	
 struct irc_message {
-	char msg[MAX_MSG_SIZE]; /**<IRC message buffer, holding up to `MAX_MSG_SIZE` characters, including the terminating characters \\r\\n. This buffer is not null terminated. */
-	int index; /**<This field denotes the next free position in `msg`. Any new data arriving on the socket shall be written starting at `msg[index]`. `index` is always lower than `MAX_MSG_SIZE`. */
-	int last_stop; /**<Used to keep track of where we previously stopped processing the current message. This field allows `next_msg()` to resume parsing for the rest of the information not yet parsed but already retrieved from the socket. */
+	char *msg; /**<IRC messages buffer, holding up to `size` characters, including the terminating characters \\r\\n of each message. This buffer is not null terminated. `NULL` until the client first sends something. */
+	int size; /**<Size of `msg`. This is the `recvq` of the client's connection class, and it is always a multiple of 32. */
+	int index; /**<This field denotes the next free position in `msg`. Any new data arriving on the socket shall be written starting at `msg[index]`. `index` is always lower than or equal to `size`. */
 	int msg_begin; /**<Index that denotes the position in `msg` where the current message begins. There can be old messages behind which were already reported. Anything behind `msg_begin` is trash. */
+	unsigned int *newlines; /**<Bitmap of the newlines in `msg[msg_begin..index-1]` not yet reported by `next_msg()`: bit `i % 32` of `newlines[i / 32]` is set if `msg[i]` is a newline. Filled by `read_data()` as data arrives; bits are cleared as messages are reported. Allocated along with `msg`. */
+	unsigned discarding : 1; /**<Set when a message longer than `MAX_MSG_SIZE` was thrown away before its terminator arrived. Characters are discarded until the next newline. */
 };
 
 struct irc_client;
 /* Documented in read_msgs.c */
-void initialize_irc_message(struct irc_message *in);
-void read_data(struct irc_client *client);
+void read_msgs_init(void);
+void initialize_irc_message(struct irc_message *in, int size);
+void free_irc_message(struct irc_message *in);
+ssize_t read_data(struct irc_client *client, int *more);
 int next_msg(struct irc_message *client_msg, char **msg);
 
 #endif /* __YAIRCD_READ_MSGS_GUARD__ */
@@ -0,0 +1,68 @@
+#ifndef __YAIRCD_RESOLVER_GUARD__
+#define __YAIRCD_RESOLVER_GUARD__
+#include <stddef.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+/** @file
+	@brief Asynchronous reverse DNS resolver
+
+	Reverse lookups used to be performed with a blocking `getnameinfo()` call while a new client was being set up. Since many clients share the same worker, a slow resolver
+	would stall every client served by that worker. Lookups are now performed by a small pool of resolver threads, and workers never wait for them.
+
+	A worker submits a query with `resolver_submit()`. Once a resolver thread is done with it, the query is handed back to the worker that submitted it (see `worker_post_dns()`),
+	and the answer is processed in the worker's thread, like any other event. If the answer does not arrive in time, the worker gives up on it with `resolver_cancel()`, and the
+	client keeps his IP address as his hostname.
+
+	Answers, positive or negative, are kept in a cache shared by every worker, so that clients reconnecting from the same address do not hit the resolver again until the
+	entry expires.
+
+	The resolver consults an optional hosts table before asking the system's resolver, and the lookup function itself can be replaced with `resolver_set_backend()`. This
+	allows the whole path to be exercised against a local table or a stub, without a DNS server.
+
+	@author Filipe Goncalves
+	@date November 2013
+	@see resolver.c
+*/
+
+/** How many addresses the cache can hold. Addresses are hashed into this many slots; a new answer replaces whatever was stored in its slot. */
+#define DNS_CACHE_SIZE 4096
+
+/** Returned by `resolver_cache_lookup()` if there is no valid cache entry for an address */
+#define DNS_CACHE_MISS -1
+
+/** The address has no reverse hostname */
+#define DNS_NOT_FOUND 0
+
+/** The address was successfully reversed */
+#define DNS_FOUND 1
+
+struct irc_client;
+struct irc_worker;
+
+/** A reverse lookup request. Queries are created by `resolver_submit()` and travel from the submitting worker to a resolver thread, and back to the worker. The worker
+	frees them once the answer was processed, or once it arrives for a query that was cancelled meanwhile.
+*/
+struct dns_query {
+	struct in_addr address; /**<The address to reverse. */
+	char hostname[NI_MAXHOST]; /**<The hostname found. Only valid if `status` is `DNS_FOUND`. */
+	int status; /**<`DNS_FOUND` or `DNS_NOT_FOUND`. Written by the resolver thread before the query is handed back. */
+	int cancelled; /**<Set by the worker when it no longer waits for this query. Only accessed with atomic builtins. */
+	struct irc_client *client; /**<The client waiting for this answer. Must not be used if the query was cancelled. */
+	struct irc_worker *worker; /**<The worker that submitted the query, and where the answer is delivered. */
+	struct dns_query *next; /**<Next query in the resolver's pending list, or in the worker's list of answers. */
+};
+
+/** A reverse lookup backend. It shall write the hostname for `address` in `hostname`, null terminated, and return `DNS_FOUND`; or return `DNS_NOT_FOUND` if there
+	is no hostname. It is called by the resolver threads, concurrently, so it must be thread safe.
+*/
+typedef int (*dns_backend_t)(struct in_addr address, char *hostname, size_t len);
+
+/* Documented in resolver.c */
+int resolver_init(int threads, int cache_ttl, const char *hosts_file);
+void resolver_set_backend(dns_backend_t backend);
+int resolver_cache_lookup(struct in_addr address, char *hostname, size_t len);
+struct dns_query *resolver_submit(struct irc_client *client, struct irc_worker *worker, struct in_addr address);
+void resolver_cancel(struct dns_query *query);
+
+#endif /* __YAIRCD_RESOLVER_GUARD__ */
@@ -11,9 +11,11 @@
 	@date November 2013
 */
 
+struct worker_wakeups;
+
 /* Functions documented in the source file */
 void send_motd(struct irc_client *client);
 void send_welcome(struct irc_client *client);
-void notify_privmsg(struct irc_client *from, struct irc_client *to, char *dest, char *message);
+void notify_privmsg(struct irc_client *from, struct irc_client *to, char *dest, char *message, struct worker_wakeups *wakeups);
 
 #endif /* __YAIRCD_SEND_RPL_GUARD__ */
@@ -27,6 +27,16 @@
 /** Knows how to access a MOTD's entry line */
 #define motd_entry_line(m) (*(m))
 
+/** The MOTD replies (`RPL_MOTDSTART`, one `RPL_MOTD` per line, and `RPL_ENDOFMOTD`), rendered once, when the MOTD is read.
+	The replies sent to every client are the same, except for the target, which is the client's nickname. Thus, the rendered replies are stored in pieces,
+	and the nickname goes in between each of them. See `motd_replies_render()`.
+*/
+struct motd_replies {
+	char *text; /**<Every piece, one after the other. */
+	size_t *ends; /**<Where each piece ends in `text`. */
+	int pieces; /**<How many pieces there are. */
+};
+
 /* Documented in .c source file */
 int loadServerInfo(void);
 const char *get_server_name(void);
@@ -37,13 +47,26 @@ int get_std_socket_port(void);
 int get_ssl_socket_port(void);
 int get_std_socket_hangup(void);
 int get_ssl_socket_hangup(void);
+int get_std_socket_sendq(void);
+int get_ssl_socket_sendq(void);
+int get_std_socket_recvq(void);
+int get_ssl_socket_recvq(void);
 const char *get_cert_path(void);
 const char *get_priv_key_path(void);
 const char *get_cloak_net_prefix(void);
 const char *get_cloak_key(int i);
 size_t get_cloak_key_length(int i);
 int get_chanlimit(void);
+int get_worker_threads(void);
+int get_resolver_threads(void);
+double get_dns_timeout(void);
+int get_dns_cache_ttl(void);
+const char *get_hosts_file(void);
 double get_ping_freq(void);
 double get_timeout(void);
+double get_handshake_timeout(void);
 MOTD_ENTRY get_motd(void);
+const struct motd_replies *get_motd_replies(void);
+size_t motd_replies_length(const struct motd_replies *motd, size_t nick_len);
+void motd_replies_render(const struct motd_replies *motd, const char *nick, size_t nick_len, char *buf);
 #endif /* __YAIRCD_SERVINFO_GUARD__ */
@@ -1,22 +1,33 @@
 #ifndef TRIE_GUARD
 #define TRIE_GUARD
+#include <stddef.h>
 
 /** @file
 	@brief Flexible trie with some neat options.
 
 	This file describes every trie operations available to the various list managers (nicknames list, commands list, channels list, and any other list of strings)
 	It allows client code (by client we mean "the code that uses this") to define which characters are allowed inside a word.
-	Client code is required to provide functions that convert a letter into a position (ID) and a position back into a letter. IDs must be unique, consecutive, and start at 0; there can be no gaps
-	in the sequence, because IDs are used to index an array. So, for example, to allow an alphabet which consists of the characters `[a-z]` and `[0-9]`, client code must find a mapping which converts 
+	Client code is required to describe an alphabet that converts a letter into a position (ID) and a position back into a letter. IDs must be unique, consecutive, and start at 0; there can be no gaps
+	in the sequence, and there can be at most 256 of them, because IDs are used as the keys of each node's children. So, for example, to allow an alphabet which consists of the characters `[a-z]` and `[0-9]`, client code must find a mapping which converts 
 	any of these characters into an integer `i` such that `i >= 0 && i <= 35` (26 letters for the alphabet and 10 digits).
 	One possible mapping would be to map any letter `c` in `[a-z]` to `c - &lsquo;a&rsquo;` and any number `i` in `[0-9]` to `&lsquo;z&rsquo; + i - &lsquo;0&rsquo;`.
 	
+	Alphabets are lookup tables built at compile time with `TRIE_ALPHABET()`, so that a trie never calls back into client code while it walks a word: checking and
+	converting each character is a single table access. See `struct trie_alphabet`.
+	
 	Please refer to http://en.wikipedia.org/wiki/Trie if you are not sure how a trie works. It always guarantees `O(n)` insertion, deletion and search time, where `n` is the size of the word. When compared to hash tables,
 	it is a good alternative, since hash tables provide `O(1)` access, but normally take about `O(n)` time to compute the hash function, and there can be collisions.
 	
+	Nodes are adaptive and paths are compressed (see `struct trie_node`), so a node costs memory in proportion to the children it actually has, rather than to the size of
+	the alphabet. This matters for big alphabets such as the one used for channel names, where a plain array of edges costs 2 KB per character of every name.
+	
+	Nodes are allocated from slabs owned by each trie, so that adding and removing words rarely reaches the system allocator, and a trie's nodes tend to sit close to each
+	other in memory.
+	
 	@author Filipe Goncalves
 	@date November 2013
 	@see trie.c
+	
 	@warning This implementation is reentrant, but it is not thread safe. The same trie instance cannot be fed into this implementation from different threads concurrently. 
 	Upper caller needs to make the necessary use of mutexes or other synchronization primitives.
 */
@@ -37,42 +48,127 @@
 */
 #define TRIE_NO_FREE_DATA 0
 
-/** A node in a trie. */
+/** Position of the characters that are not part of an alphabet. See `struct trie_alphabet`. */
+#define TRIE_INVALID_POS -1
+
+/** An alphabet. It tells which characters may appear in a word, and maps each of them to its position. Alphabets are meant to be defined with `TRIE_ALPHABET()`,
+	and a single instance is shared by every trie that uses the same alphabet.
+*/
+struct trie_alphabet {
+	short pos[256]; /**<Position of each character, indexed by the character as an `unsigned char`; `TRIE_INVALID_POS` if the character is not allowed. `pos[0]` must always be `TRIE_INVALID_POS`. */
+	char chr[256]; /**<Maps each position back to a character. Characters that map to the same position (such as upper and lower case letters) are represented by one of them. */
+	int size; /**<How many positions are used. Every position is in `[0 .. size-1]`. */
+};
+
+/** Expands to `F(b), F(b+1), ..., F(b+15)`. Used by `TRIE_ALPHABET()`. */
+#define TRIE_EXPAND16(F, b) \
+	F((b)), F((b)+1), F((b)+2), F((b)+3), F((b)+4), F((b)+5), F((b)+6), F((b)+7), \
+	F((b)+8), F((b)+9), F((b)+10), F((b)+11), F((b)+12), F((b)+13), F((b)+14), F((b)+15)
+
+/** Expands to `F(0), F(1), ..., F(255)`. Used by `TRIE_ALPHABET()`. */
+#define TRIE_EXPAND256(F) \
+	TRIE_EXPAND16(F, 0), TRIE_EXPAND16(F, 16), TRIE_EXPAND16(F, 32), TRIE_EXPAND16(F, 48), \
+	TRIE_EXPAND16(F, 64), TRIE_EXPAND16(F, 80), TRIE_EXPAND16(F, 96), TRIE_EXPAND16(F, 112), \
+	TRIE_EXPAND16(F, 128), TRIE_EXPAND16(F, 144), TRIE_EXPAND16(F, 160), TRIE_EXPAND16(F, 176), \
+	TRIE_EXPAND16(F, 192), TRIE_EXPAND16(F, 208), TRIE_EXPAND16(F, 224), TRIE_EXPAND16(F, 240)
+
+/** Defines an alphabet. The tables are filled at compile time, by evaluating two macros for every value in `[0 .. 255]`.
+	For example, an alphabet of lower case letters can be defined with:
+	<pre>
+	#define LOWER_POS(c) ((c) >= 'a' && (c) <= 'z' ? (c) - 'a' : TRIE_INVALID_POS)
+	#define LOWER_CHR(p) ((p) < 26 ? 'a' + (p) : '\0')
+	static TRIE_ALPHABET(lower_alphabet, LOWER_POS, LOWER_CHR, 26);
+	</pre>
+	@param name Name of the `const struct trie_alphabet` variable to define. Storage class specifiers, such as `static`, can be written before the macro.
+	@param pos_of A macro that takes a character, as an integer in `[0 .. 255]`, and evaluates to its position, or to `TRIE_INVALID_POS`. It must be a constant
+		expression, and it must reject `0`.
+	@param chr_of A macro that takes a position in `[0 .. 255]` and evaluates to its character. It must be a constant expression. Its value for positions that are
+		not used does not matter.
+	@param size How many positions are used.
+*/
+#define TRIE_ALPHABET(name, pos_of, chr_of, size) \
+	const struct trie_alphabet name = { { TRIE_EXPAND256(pos_of) }, { TRIE_EXPAND256(chr_of) }, (size) }
+
+/** A node that has no children. See `struct trie_node`. */
+#define TRIE_LEAF 0
+
+/** A node with room for up to 4 children. See `struct trie_node`. */
+#define TRIE_NODE4 1
+
+/** A node with room for up to 16 children. See `struct trie_node`. */
+#define TRIE_NODE16 2
+
+/** A node with room for up to 48 children. See `struct trie_node`. */
+#define TRIE_NODE48 3
+
+/** A node with room for every possible child. See `struct trie_node`. */
+#define TRIE_NODE256 4
+
+/** How many different kinds of nodes there are */
+#define TRIE_NODE_TYPES 5
+
+/** How many characters a node can hold in its compressed path. Longer paths are split among a chain of nodes. */
+#define TRIE_MAX_PREFIX 8
+
+/** A node in a trie.
+	The trie is an adaptive radix tree: instead of reserving an edge for every character of the alphabet in every node, each node is allocated with room for just as
+	many children as it needs, and it is replaced by a bigger (or smaller) node as children come and go. There are 4 sizes of inner nodes, holding up to 4, 16, 48
+	and 256 children, plus leaves, which hold no children at all. This structure is the header shared by every node kind; the children are stored right after it,
+	in a layout that depends on `type` (see trie.c).
+	Paths are compressed: a node that would have a single child and hold no word is merged into that child, and the characters it stood for are kept in the child's
+	`prefix`. Thus, the path from a node's parent down to the node is made of the edge's character followed by every character in `prefix`.
+*/
 struct trie_node {
-	char is_word; /**<Indicates if the path from root down to this node denotes a word */
-	int children; /**<Says how many children are present in `edges[]` */
-	struct trie_node **edges; /**<Edges pointing to this node's children. This is a dynamically allocated array. Each `edges[i]` represents the character returned by `(*trie->pos_to_char)(i)`. */
+	unsigned char type; /**<What kind of node this is: `TRIE_LEAF`, `TRIE_NODE4`, `TRIE_NODE16`, `TRIE_NODE48` or `TRIE_NODE256` */
+	unsigned char is_word; /**<Indicates if the path from root down to this node (including `prefix`) denotes a word */
+	unsigned char prefix_len; /**<How many characters are in `prefix` */
+	unsigned char prefix[TRIE_MAX_PREFIX]; /**<Compressed path. These are character positions, as found in the alphabet's `pos` table. */
+	unsigned short children; /**<Says how many children this node has */
 	void *data; /**<Pointer to arbitrary data associated with this node. This is valid only if `is_word` is true, and it is used by the client code to associate data with words. */
 };
 
+/** A slab of nodes of the same kind. Nodes are carved from big chunks of memory, and nodes that are freed are kept in a free list to be reused, instead of going
+	back to `malloc()`. Chunks start small, so that small tries (such as the users list of a channel) stay small, and double in size up to `TRIE_SLAB_MAX_CHUNK`
+	bytes as the trie grows. See trie.c.
+*/
+struct trie_slab {
+	void *free_list; /**<Nodes that were freed, linked through their first bytes */
+	char *next; /**<Next node that was never used in the current chunk */
+	char *end; /**<End of the current chunk */
+	int chunk_nodes; /**<How many nodes the next chunk will hold */
+	unsigned long live; /**<How many nodes are in use */
+	unsigned long free; /**<How many nodes are in `free_list` */
+	size_t bytes; /**<How many bytes were allocated for this slab's chunks */
+};
+
 /** A trie */
 struct trie_t {
-	struct trie_node *root; /**<Root node */
+	struct trie_node *root; /**<Root node. The root node never has a compressed path. */
 	void (*free_f)(void *, void *); /**<A pointer to a function that is responsible for free'ing a node's `data` when it is about to be destroyed. See `destroy_trie()` and `delete_word_trie()` for further info. */									     
-	int (*is_valid)(char s); /**<A pointer to a function that returns `1` if `s` is a valid character (considered part of a word), and `0` otherwise. */
-	char (*pos_to_char)(int p); /**<A pointer to a function that converts an index position from `edges` back to its character representation. */
-	int (*char_to_pos)(char s); /**<A pointer to a function that converts a character `s` into a valid, unique position that is used to index `edges`. */
-	int edges_no; /**<Number of edges. It is valid to reference any position in `edges[0 .. edges_no-1]`. */
+	const struct trie_alphabet *alphabet; /**<Which characters are valid, and their positions */
+	struct trie_slab slabs[TRIE_NODE_TYPES]; /**<Where nodes come from, one slab for each kind of node */
+	void *chunks; /**<Every chunk allocated by the slabs, so that they can be freed when the trie is destroyed */
 };
 
 /** A stack element describing a node in a path of a prefix search. */
 struct trie_node_stack_elm {
 	struct trie_node *el; /**<Pointer to the node that this element describes */
 	struct trie_node_stack_elm *next; /**<Pointer to the next stack element */
-	char letter; /**<Letter that was last used to reach this node, namely, the result of calling `(*trie->pos_to_char)(i)` for an edge `i` such that `edges[i] == `el`. */
-	int depth; /**<Depth of this element on the stack. Starts counting from 1. */
+	int letter; /**<Letter that was last used to reach this node, namely, `trie->alphabet->chr[i]`, as an `unsigned char`, for the edge `i` leading to `el`; `-1` for the node where the prefix ends, which was not reached through a new edge. */
+	int skip; /**<How many characters of `el`'s compressed path are part of the prefix, and shall not be written to `path`. This is only non-zero for the node where the prefix ends. */
+	int depth; /**<How many characters were written to `path` before reaching this node. */
 };
 
 /** A stack used to maintain state between different calls to `find_by_prefix_next_trie()`. */
 struct trie_node_stack {
-	char *path; /**<A characters sequence describing the path from the root node down to the current node. Each `trie_node_stack_elm` in the stack writes to `path[element->depth-1]`. */
+	char *path; /**<A characters sequence describing the path from the node where the prefix ends down to the current node. Each `trie_node_stack_elm` in the stack writes its letter and compressed path starting at `path[element->depth]`. */
 	char *prefix; /**<The prefix originally passed to `find_by_prefix_next_trie()` in the first call that started this search. */
 	int depth; /**<Max. depth allowed. Only character sequences of at most `depth-1` will be reported and written to `path`. When a match is found, `path` is null terminated; it must hold enough space for at least `depth` characters. */
 	struct trie_node_stack_elm *top; /**<The top of the stack */
 };
 
 /* These functions are documented in the C file that implements them */
-struct trie_t *init_trie(void (*free_function)(void *, void *), int (*is_valid)(char), char (*pos_to_char)(int), int (*char_to_pos)(char), int edges);
+struct trie_t *init_trie(void (*free_function)(void *, void *), const struct trie_alphabet *alphabet);
 void destroy_trie(struct trie_t *trie, int free_data, void *args);
 int add_word_trie(struct trie_t *trie, char *word, void *data);
 void *delete_word_trie(struct trie_t *trie, char *word);
@@ -80,4 +176,5 @@ void *find_word_trie(struct trie_t *trie, char *word);
 void trie_for_each(struct trie_t *trie, void (*f)(void *, void *), void *args);
 struct trie_node_stack *find_by_prefix_next_trie(struct trie_t *trie, struct trie_node_stack *st, const char *prefix, int depth, char *result, int *err_code, void **data);
 void free_trie_stack(struct trie_node_stack *st);
+void trie_node_stats(struct trie_t *trie, unsigned long *live, unsigned long *free_nodes, size_t *bytes);
 #endif /* TRIE_GUARD */
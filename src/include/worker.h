@@ -0,0 +1,73 @@
+#ifndef __YAIRCD_WORKER_GUARD__
+#define __YAIRCD_WORKER_GUARD__
+#include <pthread.h>
+#include <ev.h>
+#include "client.h"
+#include "resolver.h"
+
+/** @file
+	@brief Pool of event loop worker threads
+
+	Clients are served by a fixed pool of worker threads that is created once, at boot time. Each worker runs its own libev loop, and every client assigned to a worker
+	has its IO and timer watchers registered in that worker's loop. A worker multiplexes as many clients as it is given; no thread is ever created or destroyed
+	because a client arrived or left.
+
+	Workers are also woken up by the resolver threads, when the reverse lookups they submitted are answered. See `resolver.h`.
+
+	Threads that queue messages for a client served by another worker (channel fan-out, private messages) do not wake the client up directly. The client is put in its
+	worker's ready list with `worker_notify()`, unless it is already there, and the worker is woken up once, no matter how many of its clients got new messages. Callers
+	that hold a lock while delivering collect the workers to wake up in a `struct worker_wakeups`, and wake them up with `worker_wakeups_flush()` after releasing the
+	lock. During busy bursts, wakeups thus scale with the number of workers that have active recipients, rather than with the number of messages.
+
+	The main thread keeps accepting connections in the default loop. Accepted connections are handed to a worker with `worker_dispatch()`, which picks the worker serving
+	the fewest clients and wakes it up with an async watcher. The client's structure is then created by the worker itself, inside the worker's loop.
+
+	@author Filipe Goncalves
+	@date November 2013
+	@see worker.c
+*/
+
+/** How many different workers a `struct worker_wakeups` can hold. Workers notified beyond this are woken up right away. */
+#define WORKER_WAKEUPS_MAX 16
+
+/** Describes a worker thread. */
+struct irc_worker {
+	pthread_t thread_id; /**<The worker's thread ID. Workers are detached; this is kept for debugging purposes. */
+	struct ev_loop *ev_loop; /**<This worker's events loop. Every client served by this worker registers its watchers here. */
+	struct ev_async handoff_watcher; /**<async watcher used by the main thread to wake the worker up when new connections were handed over to it. */
+	pthread_mutex_t handoff_mutex; /**<Protects `handoff`. */
+	struct irc_client_args_wrapper *handoff; /**<Linked list of accepted connections waiting to be picked up by this worker, most recent first. */
+	int clients; /**<How many clients are currently assigned to this worker. This is read and written with atomic builtins only. */
+	struct ev_async dns_watcher; /**<async watcher used by the resolver threads to wake the worker up when answers to its reverse lookups are available. */
+	pthread_mutex_t dns_mutex; /**<Protects `dns_answers`. */
+	struct dns_query *dns_answers; /**<Linked list of answered (or cancelled) reverse lookups waiting to be picked up by this worker. */
+	struct ev_async ready_watcher; /**<async watcher used by other threads to wake the worker up when clients in `ready` have new messages queued. */
+	pthread_mutex_t ready_mutex; /**<Protects `ready`. */
+	struct irc_client *ready; /**<Linked list, through `ready_next`, of clients served by this worker whose queues must be flushed. A client is in this list if and only if
+	                             his `wakeup_pending` flag is set. */
+	int ready_pending; /**<Set when `ready_watcher` was signaled and the worker did not pick up the ready list yet. Only accessed with atomic builtins. */
+	unsigned long notified; /**<How many times another thread queued messages for one of this worker's clients. Only accessed with atomic builtins. */
+	unsigned long wakeups; /**<How many times `ready_watcher` was actually signaled. Only accessed with atomic builtins. */
+};
+
+/** A set of workers to wake up. Threads delivering messages while holding a lock pass one of these to `worker_notify()`, and wake the workers up with
+	`worker_wakeups_flush()` once the lock is released. It must be initialized with `worker_wakeups_init()`.
+*/
+struct worker_wakeups {
+	struct irc_worker *workers[WORKER_WAKEUPS_MAX]; /**<The workers to wake up */
+	int count; /**<How many positions of `workers` are used */
+};
+
+/* Documented in worker.c */
+int workers_init(int threads);
+void worker_dispatch(struct irc_client_args_wrapper *args);
+void worker_release(struct irc_worker *worker);
+void worker_post_dns(struct irc_worker *worker, struct dns_query *query);
+void worker_wakeups_init(struct worker_wakeups *wakeups);
+void worker_notify(struct irc_client *client, struct worker_wakeups *wakeups);
+void worker_wakeups_flush(struct worker_wakeups *wakeups);
+void worker_flush_ready(struct irc_worker *worker, struct irc_client *current);
+void worker_forget(struct irc_client *client);
+void worker_wakeup_stats(unsigned long *notified, unsigned long *wakeups);
+
+#endif /* __YAIRCD_WORKER_GUARD__ */
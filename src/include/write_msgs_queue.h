@@ -1,44 +1,75 @@
 #ifndef __IRC_CLIENT_QUEUE_GUARD__
 #define __IRC_CLIENT_QUEUE_GUARD__
-#include <pthread.h>
+#include <stddef.h>
 /** @file
 	@brief Client's messages queue management functions
 
-	This file provides a module that knows how to operate on a client's messages queue. Every function is reentrant and thread-safe.
-	It is easy for a client's thread to wake up and read incoming data using an IO watcher. However, sporadically, we also need to wake up a client's thread to write to his socket.
-	For example, if user A PRIVMSGs user B, user A's thread must be able to somehow inform user B thread that something needs to be sent to user B.
-	To do so, we use an async watcher. An async watcher allows an arbitrary thread X to wake up another thread Y. Thread Y must be running an events loop and must have initialized and started an async watcher.
-	An async watcher works pretty much the same way as an IO watcher, but libev's documentation explicitly states that queueing is not supported. In other words, if more async messages arrive when we are processing
-	an async callback, these will be silently discarded. To avoid losing messages like this, we implement our own messages queueing system.
-	Each client holds a queue of messages waiting to be written to his socket. These messages can originate from any thread.
+	This file provides a module that knows how to operate on a client's messages queue. Every function is reentrant. Enqueue operations can be performed by any thread, but messages
+	are only removed by the worker serving the client that owns the queue.
+	Clients also need to be written to on behalf of other clients, which may be served by other workers: if user A PRIVMSGs user B, the worker serving A must get the message to B.
+	Each client holds a queue of messages waiting to be written to his socket, and these messages can originate from any thread. A thread that queues a message for a client served by
+	another worker puts the client in that worker's ready list with `worker_notify()`, and the worker flushes the queue once it wakes up. See `worker.h`.
 	
-	Every operation in a client's queue shall be invoked through the use of the functions declared in this file, to ensure thread safety.
+	Every operation in a client's queue shall be invoked through the use of the functions declared in this file, to ensure thread safety. Queues are lock-free: the same client's queue
+	is written by every thread delivering something to him (every peer in a busy channel, for example), and a lock would make these threads queue up behind each other, and behind the
+	client's own worker while it flushes.
+	
+	Queues do not hold characters sequences, they hold `struct shared_msg` instances. A shared message is immutable and reference counted, so the same message can sit in many queues at
+	once: a message sent to a channel is formatted once, and each recipient's queue just takes a new reference to it. The message is freed when the last queue holding it releases it.
 	
 	@author Filipe Goncalves
 	@date November 2013
 */
 
-/** Defines the queue size. The queue size determines how many messages are allowed to be on hold waiting to be written to the client's socket.
-	Each client's queue is writable by any other client's thread that wishes to deliver a message to this client. Queue operations are thread safe and reentrant.
+/** Maximum number of messages gathered by `flush_queue()` in a single socket write. This bounds the `iovec` array used for plaintext clients, and must not exceed `IOV_MAX`. */
+#define FLUSH_MAX_MSGS 64
+
+/** Size of the buffer where `flush_queue()` coalesces messages for SSL clients. This is the maximum payload of a TLS record, so each flush produces a single record. */
+#define FLUSH_TLS_BUFFER_SIZE 16384
+
+/** An immutable, reference counted IRC message. Instances are created with `shared_msg_new()` or `shared_msg_alloc()`, and are never modified once enqueued, thus, they can be read by any number of threads without locking.
+	The reference count is only touched with atomic builtins.
 */
-#define WRITE_QUEUE_SIZE 512
+struct shared_msg {
+	int refcount; /**<How many references to this message are alive. The message is freed when this drops to `0`. */
+	size_t length; /**<Length of `text`, excluding the null terminator. */
+	char text[]; /**<The message itself, null terminated. */
+};
 
-/** The structure that holds a queue */
+/** A node in a client's queue. Nodes are allocated by the producer that enqueues a message, and freed by the client's worker. */
+struct msg_queue_node {
+	struct msg_queue_node *next; /**<next (more recent) node in the queue. Written with atomic builtins, since it is how producers publish new nodes. */
+	struct shared_msg *msg; /**<the message held by this node. Meaningless once the node became the queue's `head`. */
+};
+
+/** The structure that holds a queue. This is a lock-free, multiple producers, single consumer queue: any thread can enqueue messages, but only the worker serving the client removes them.
+	It is a linked list that always holds at least one node. `head` is a dummy node whose message was already consumed (or, initially, never existed); the oldest message is in `head->next`.
+	Producers only touch `tail`, which they swap atomically with the node they are inserting; the consumer only touches `head`. Thus, producers never wait for the consumer, nor for each other.
+*/
 struct msg_queue {
-	char *messages[WRITE_QUEUE_SIZE]; /**<a queue with messages */
-	int top; /**<index denoting the position where a new element will be inserted in `messages`. Will always be less than `WRITE_QUEUE_SIZE` */
-	int bottom; /**<index denoting the position where the least recent element is located. This is the element that will be dequeued in the next dequeue operation. */
-	int elements; /**<indicates how many elements are stored in this queue at the moment. */
-	pthread_mutex_t mutex; /**<a mutex to coordinate concurrent access to a queue. */
+	struct msg_queue_node *head; /**<the dummy node preceding the oldest message. Only the consumer reads or writes this. */
+	struct msg_queue_node *tail; /**<the most recently inserted node. Only accessed with atomic builtins. */
+	size_t head_offset; /**<how many characters of the oldest message were already written to the socket. This is non-zero after a partial write. Only the consumer reads or writes this. */
+	size_t bytes; /**<how many characters are held by the messages in this queue, including the part of the oldest message that was already written. Only accessed with atomic builtins. */
+	size_t max_bytes; /**<the client's SendQ: `bytes` is never allowed to grow beyond this. */
+	int sendq_exceeded; /**<set to `1` once an enqueue operation was refused because the SendQ was exceeded, or because there was no memory for a new node. It is never reset; the client is
+	                       evicted by his worker as soon as the worker notices it. Only accessed with atomic builtins. */
 };
 
 struct irc_client;
 /* Documented in write_msgs_queue.c */
-int client_queue_init(struct msg_queue *queue);
+int client_queue_init(struct msg_queue *queue, size_t max_bytes);
 int client_queue_destroy(struct msg_queue *queue);
+struct shared_msg *shared_msg_alloc(size_t length);
+struct shared_msg *shared_msg_new(const char *text, size_t length);
+void shared_msg_ref(struct shared_msg *msg);
+void shared_msg_release(struct shared_msg *msg);
 int client_enqueue(struct msg_queue *queue, char *message);
-char *client_dequeue(struct msg_queue *queue);
+int client_enqueue_shared(struct msg_queue *queue, struct shared_msg *msg);
+struct shared_msg *client_dequeue(struct msg_queue *queue);
 int client_is_queue_empty(struct msg_queue *queue);
-void flush_queue(struct irc_client *client, struct msg_queue *queue);
+int client_queue_sendq_exceeded(struct msg_queue *queue);
+size_t client_queue_bytes(struct msg_queue *queue);
+int flush_queue(struct irc_client *client, struct msg_queue *queue);
 
 #endif /* __IRC_CLIENT_QUEUE_GUARD__ */
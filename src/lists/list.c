@@ -6,10 +6,14 @@
 
 /** @file
    @brief Generic thread-safe words container.
-   This file implements a generic thread-safe words container. It uses an underlying trie implementation, and a mutex to
-      control concurrent accesses to this trie.
+   This file implements a generic thread-safe words container. It uses an underlying trie implementation, and a
+      reader-writer lock to control concurrent accesses to this trie.
    Thus, the functions provided here are nothing more than the same functions offered by the trie implementation, except
-      that everything is wrapped in a structurewith accesses controlled by a mutex.
+      that everything is wrapped in a structurewith accesses controlled by a reader-writer lock.
+   Lists are read far more often than they are written: every private message and every WHOIS looks a nickname up,
+      whereas only registration, NICK and QUIT change the clients list. Searches (`list_find_word()`,
+      `list_find_and_execute()` and `list_for_each()`) only take the lock for reading, so they never wait for each
+      other. Operations that add or delete words take it for writing.
    Two core functions, `list_find_and_execute()`, and `list_find_and_execute_globalock()`, are provided to perform
       atomic arbitrary operations on the list items. Besides the global locking mechanism,each node added to a list is
       packed with a lock just for itself. This allows multiple threads to work on different list elements instead of
@@ -32,7 +36,8 @@
 
 /** Structure defining a generic thread-safe words list. */
 struct yaircd_list {
-	pthread_mutex_t mutex; /**<Mutex to synchronize concurrent access to this list */
+	pthread_rwlock_t lock; /**<Reader-writer lock to synchronize concurrent access to this list. Searches hold it for
+	                          reading; insertions and deletions hold it for writing. */
 	struct trie_t *trie; /**<The underlying list implementation. A trie is used to associate words to data. */
 	void (*free_func)(void *); /**<Pointer to a function that knows how to free a generic data type stored in this
 	                              list by the code using this module. */
@@ -91,16 +96,11 @@ static void free_yaircd_node(void *node_generic, void *arg)
    @param free_function Each word can be associated to a generic pointer hereby denoted `data`. This function will be
       called to free a node's `data` when it is removed from the list. It can be NULL if nothing shall be done when
       deleting a node. See `destroy_word_list()` and `list_delete()` for further info.
-   @param is_valid Pointer to function that returns `1` if a char is part of this wordlist's alphabet; `0` otherwise.
-   @param pos_to_char Pointer to function that converts an index position from `edges` back to its character
-      representation.
-   @param char_to_pos Pointer to function that converts a character `s` into a valid, unique position.
-   @param charcount How many characters compose this list's alphabet.
+   @param alphabet The characters allowed in this list's words. See `TRIE_ALPHABET()`.
    @return A pointer to a new, empty word list instance, or `NULL` is there weren't enough resources to create a new
       list.
  */
-Word_list_ptr init_word_list(void (*free_function)(void *), int (*is_valid)(char), char (*pos_to_char)(
-				     int), int (*char_to_pos)(char), int charcount)
+Word_list_ptr init_word_list(void (*free_function)(void *), const struct trie_alphabet *alphabet)
 {
 	Word_list_ptr new_list;
 
@@ -108,13 +108,13 @@ Word_list_ptr init_word_list(void (*free_function)(void *), int (*is_valid)(char
 	if (new_list == NULL) {
 		return NULL;
 	}
-	if (pthread_mutex_init(&new_list->mutex, NULL) != 0) {
+	if (pthread_rwlock_init(&new_list->lock, NULL) != 0) {
 		free(new_list);
 		return NULL;
 	}
 	new_list->free_func = free_function;
-	if ((new_list->trie = init_trie(free_yaircd_node, is_valid, pos_to_char, char_to_pos, charcount)) == NULL) {
-		pthread_mutex_destroy(&new_list->mutex);
+	if ((new_list->trie = init_trie(free_yaircd_node, alphabet)) == NULL) {
+		pthread_rwlock_destroy(&new_list->lock);
 		free(new_list);
 		return NULL;
 	}
@@ -135,14 +135,14 @@ void destroy_word_list(Word_list_ptr list, int free_data)
 	args.free_data = free_data;
 	args.free_func = list->free_func;
 	destroy_trie(list->trie, TRIE_FREE_DATA, (void*)&args);
-	if (pthread_mutex_destroy(&list->mutex) != 0) {
-		perror("::list.c:destroy_word_list(): Could not destroy mutex");
+	if (pthread_rwlock_destroy(&list->lock) != 0) {
+		perror("::list.c:destroy_word_list(): Could not destroy reader-writer lock");
 	}
 }
 
 /** Finds a given word, and returns the data associated with this word, if a match was found.
-   This function does not lock the global list mutex, it should only be called from within a function that is holding a
-      lock.
+   This function does not lock the global list lock, it should only be called from within a function that is holding
+      it, either for reading or for writing.
    @param list The list to perform the search on
    @param word A pointer to a null terminated characters sequence holding the word to search for
    @return `NULL` if no match was found, or word contains invalid characters according to the `is_valid()` function
@@ -169,16 +169,16 @@ void *list_find_word_nolock(Word_list_ptr list, char *word)
 void *list_find_word(Word_list_ptr list, char *word)
 {
 	void *ret;
-	pthread_mutex_lock(&list->mutex);
+	pthread_rwlock_rdlock(&list->lock);
 	ret = list_find_word_nolock(list, word);
-	pthread_mutex_unlock(&list->mutex);
+	pthread_rwlock_unlock(&list->lock);
 	return ret;
 }
 
 /** Finds and performs an action on a word's data atomically, if a match exists.
    This is the magical function that allows parallelism and locking at the same time. First, the global lock is obtained
-      to search the list for a match. If a match is not found, `nomatch_fun` is called, and then theglobal lock is
-      released and the function returns.
+      for reading to search the list for a match. If a match is not found, `nomatch_fun` is called, and then theglobal
+      lock is released and the function returns.
    If a match is found, this function guarantees that a unique lock attached to the match is obtained, and then the
       global list lock is released. Then, `match_fun` is called with the datapreviously associated to `word`. As a
       consequence, this function is atomically executed with respect to the specific structure associated to `word`.
@@ -186,21 +186,25 @@ void *list_find_word(Word_list_ptr list, char *word)
    This means that multiple threads don't necessarily have to wait for each other when they want to do some work on
       different list nodes. However, if a thread is doing some work on node B, and another thread comes in andasks for
       node B, it will have to wait for the former thread to finish processing, and it will do so while holding the
-      global list lock. That is, if two threads concurrently try to access the same node, one of them willhave to wait,
-      and will force every other thread trying to access ANY node to wait.
+      global list lock for reading. That is, if two threads concurrently try to access the same node, one of them will
+      have to wait, and will force every thread trying to add or delete ANY node to wait. Other searches can still
+      proceed, since they only need the lock for reading as well.
    This is necessary; we can't obtain the unique lock for a node without holding a global lock, otherwise, the
       unfortunate situation in which we release the global lock; another thread deletes node B, and then we get back and
-      try to lock node B could arise, and we would be in very big trouble.
+      try to lock node B could arise, and we would be in very big trouble. Holding the lock for reading is enough for
+      this: deleting node B requires the lock for writing.
    User supplied functions (`match_fun` and `nomatch_fun`) are allowed to be `NULL`, in that case, the corresponding
       pointer to the function is ignored.
-   When `word` was not found in the list, `nomatch_fun` is called with `nomatch_fargs` while holding a global list lock.
+   When `word` was not found in the list, `nomatch_fun` is called with `nomatch_fargs` while holding the global list
+      lock for reading.
    When `word` is found, a unique lock associated to `word` is obtained, the global lock is released, and `match_fun` is
       called with the generic data that was previously associated to `word` as its first parameter, and with
       `match_fargs` as second parameter.
    This function should only be called with a `match_fun` that can't possibly invoke list operations that will add or
       delete elements from the list.
-   On the other hand, since `nomatch_fun` is called while holding the global lock, it is safe to perform other list
-      operations, as far as it uses operations that do not lock (`list_find_word_nolock()` and others).
+   `nomatch_fun` is called while holding the global lock for reading, so it may search the list with
+      `list_find_word_nolock()`, but it must not add or delete elements either, since other threads may be searching the
+      list at the same time.
    @param list The list to perform the search on.
    @param word A pointer to a null terminated characters sequence holding the word to search for.
    @param match_fun A pointer to a function returning a generic pointer that shall be called if a match is found. Under
@@ -209,7 +213,7 @@ void *list_find_word(Word_list_ptr list, char *word)
       matching node's data, and the second is `match_fargs`. Because it does not hold a global lock to the list, this
       function shall not invoke other list operations, especially add or remove.
    @param nomatch_fun A pointer to a function returning a generic pointer that shall be called if a match is not found.
-      Under such scenario, the function is called while holding the global list lock, and it is passed
+      Under such scenario, the function is called while holding the global list lock for reading, and it is passed
         `nomatch_fargs`.
    @param match_fargs This will be passed to `match_fun` as a second parameter when a match is found.
    @param nomatch_fargs This will be passed to `nomatch_fun` when a match is not found.
@@ -228,11 +232,9 @@ void *list_find_word(Word_list_ptr list, char *word)
    @warning The functions must not call `pthread_exit()`.
    @warning Read the documentation carefully, and make sure to understand which locks are active inside `match_fun` and
       `nomatch_fun`. It is easy to create deadlock situations when not paying attention.
-   @note `nomatch_fun` is free to add or delete elements from the list, since it will be executing inside a globally
-      atomic block. Keep in mind that `list_add_nolock()` and `list_delete_nolock()` must be used instead of the regular
-      functions. On the other hand, `match_fund` must not add or delete elements from the list, since `match_fun` is
-      executed without holding a global lock for the list. See `list_find_and_execute_globalock()` for a possible
-       workaround.
+   @note Neither `nomatch_fun` nor `match_fun` may add or delete elements from the list: `nomatch_fun` only holds the
+      global lock for reading, and `match_fun` is executed without holding a global lock for the list at all. See
+      `list_find_and_execute_globalock()` for a possible workaround.
  */
 void *list_find_and_execute(Word_list_ptr list,
 			    char *word,
@@ -245,16 +247,16 @@ void *list_find_and_execute(Word_list_ptr list,
 	void *ret;
 	struct yaircd_node *node;
 	*success = 0;
-	pthread_mutex_lock(&list->mutex);
+	pthread_rwlock_rdlock(&list->lock);
 	ret = find_word_trie(list->trie, word);
 	if (ret == NULL) {
 		ret = (nomatch_fun != NULL ? (*nomatch_fun)(nomatch_fargs) : NULL);
-		pthread_mutex_unlock(&list->mutex);
+		pthread_rwlock_unlock(&list->lock);
 		return ret;
 	}
 	node = (struct yaircd_node*)ret;
 	pthread_mutex_lock(&node->mutex);
-	pthread_mutex_unlock(&list->mutex);
+	pthread_rwlock_unlock(&list->lock);
 	ret = (match_fun != NULL ? (*match_fun)(node->data, match_fargs) : NULL);
 	pthread_mutex_unlock(&node->mutex);
 	*success = 1;
@@ -263,7 +265,7 @@ void *list_find_and_execute(Word_list_ptr list,
 
 /** Similar to `list_find_and_execute()`, except that both `match_fun` and `nomatch_fun` are executed while holding a
    global lock. This must be used everytime `match_fun` can possibly add or delete items from the list.
-   First, a global lock for the list is obtained. The list is searched for `word`.
+   First, a global lock for the list is obtained for writing. The list is searched for `word`.
    When a match is found, it is guaranteed that `match_fun` is called with the data previously associated to `word` and
       with `match_fargs` only when no other thread is working on the same node.
    This holds true even for threads that may be working on this node without holding a global lock. It is safe for
@@ -311,11 +313,11 @@ void *list_find_and_execute_globalock(Word_list_ptr list,
 	void *ret;
 	struct yaircd_node *node;
 	*success = 0;
-	pthread_mutex_lock(&list->mutex);
+	pthread_rwlock_wrlock(&list->lock);
 	ret = find_word_trie(list->trie, word);
 	if (ret == NULL) {
 		ret = (nomatch_fun != NULL ? (*nomatch_fun)(nomatch_fargs) : NULL);
-		pthread_mutex_unlock(&list->mutex);
+		pthread_rwlock_unlock(&list->lock);
 		return ret;
 	}
 	node = (struct yaircd_node*)ret;
@@ -329,13 +331,13 @@ void *list_find_and_execute_globalock(Word_list_ptr list,
 	 */
 	pthread_mutex_unlock(&node->mutex);
 	ret = (match_fun != NULL ? (*match_fun)(node->data, match_fargs) : NULL);
-	pthread_mutex_unlock(&list->mutex);
+	pthread_rwlock_unlock(&list->lock);
 	*success = 1;
 	return ret;
 }
 
 /** Adds a new word to a list if that word is not stored in the list yet without obtaining any lock.
-   This funtion should only be called by anyone holding a lock for the list.
+   This funtion should only be called by anyone holding the list's lock for writing.
    @param list The list to add the word to.
    @param data Pointer to the new node's data. Cannot be `NULL`.
    @param word A null terminated characters sequence that will be associated to `data`.
@@ -399,13 +401,13 @@ int list_add(Word_list_ptr list, void *data, char *word)
 		return LST_NO_MEM;
 	}
 	new_node->data = data;
-	pthread_mutex_lock(&list->mutex);
+	pthread_rwlock_wrlock(&list->lock);
 	if (find_word_trie(list->trie, word) != NULL) {
 		ret = LST_ALREADY_EXISTS;
 	}else {
 		ret = add_word_trie(list->trie, word, new_node);
 	}
-	pthread_mutex_unlock(&list->mutex);
+	pthread_rwlock_unlock(&list->lock);
 	if (ret == TRIE_INVALID_WORD || ret == TRIE_NO_MEM || ret == LST_ALREADY_EXISTS) {
 		pthread_mutex_destroy(&new_node->mutex);
 		free(new_node);
@@ -414,8 +416,8 @@ int list_add(Word_list_ptr list, void *data, char *word)
 }
 
 /** Deletes an entry from a list. If no such entry exists, nothing happens.
-   The deletion operation will only take place after both the global lock and a unique lock associated to `word` are
-      obtained. Thus, when an entry is deleted,no thread is ever doing some processing with that node.
+   The deletion operation will only take place after both the global lock (for writing) and a unique lock associated to
+      `word` are obtained. Thus, when an entry is deleted,no thread is ever doing some processing with that node.
    @param list The list.
    @param word A null terminated characters sequence denoting the entry to be deleted.
    @return If the word existed, its associated data is returned. Otherwise, `NULL` is returned.
@@ -426,17 +428,17 @@ void *list_delete(Word_list_ptr list, char *word)
 	void *ret;
 	void *old_data;
 	struct yaircd_node *node;
-	pthread_mutex_lock(&list->mutex);
+	pthread_rwlock_wrlock(&list->lock);
 	ret = find_word_trie(list->trie, word);
 	if (ret == NULL) {
-		pthread_mutex_unlock(&list->mutex);
+		pthread_rwlock_unlock(&list->lock);
 		return NULL;
 	}
 	node = (struct yaircd_node*)ret;
 	pthread_mutex_lock(&node->mutex);
 	(void)delete_word_trie(list->trie, word);
 	pthread_mutex_unlock(&node->mutex);
-	pthread_mutex_unlock(&list->mutex);
+	pthread_rwlock_unlock(&list->lock);
 	old_data = node->data;
 	free_yaircd_node((void*)node, NULL);
 	return old_data;
@@ -444,7 +446,8 @@ void *list_delete(Word_list_ptr list, char *word)
 
 /** Deletes an entry from a list. If no such entry exists, nothing happens.
    This function does not try to obtain the global list lock nor the unique lock associated to a node, thus, it should
-      only be called from within a function holding a lock to the list and to the node being deleted.
+      only be called from within a function holding the list's lock for writing, and the lock to the node being deleted
+      (or knowing that no other thread can be holding it, see `list_find_and_execute_globalock()`).
    @param list The list.
    @param word A null terminated characters sequence denoting the entry to be deleted.
    @return If the word existed, its associated data is returned. Otherwise, `NULL` is returned.
@@ -480,6 +483,7 @@ static void unpack_and_execute(void * node, void * pack)
  * @param list The list containing the trie of struct yaircd_node's (there are two levels of indirection to reach channels' information)
  * @param f A function to be packed with `fargs`
  * @param fargs Arguments to be packed together with `f`
+ * @warning The list is only locked for reading while `f` runs, so `f` must not add or delete elements from the list.
  */
 void list_for_each(Word_list_ptr list, void (*f)(void *, void *), void *fargs)
 {
@@ -488,8 +492,8 @@ void list_for_each(Word_list_ptr list, void (*f)(void *, void *), void *fargs)
 	function.f = f;
 	function.args = fargs;  
 	
-	pthread_mutex_lock(&list->mutex);
+	pthread_rwlock_rdlock(&list->lock);
 	trie_for_each(list->trie, unpack_and_execute, &function);
-	pthread_mutex_unlock(&list->mutex);
+	pthread_rwlock_unlock(&list->lock);
 	return;
 }
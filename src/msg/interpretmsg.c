@@ -14,6 +14,7 @@
 #include "send_err.h"
 #include "send_rpl.h"
 #include "msgio.h"
+#include "worker.h"
 
 /** @file
    @brief Functions responsible for interpreting an IRC message.
@@ -21,6 +22,11 @@
    The goal is to provide an abstract function that shall be called everytime a new message arrived from a client. That
    function will interpret the message, decide if it's valid, and generate the appropriate command reply, or error
    reply if it was an invalid message.
+   Every message goes through `interpret_msg()`, so finding the command's function must be cheap. `cmds_init()` puts the
+   commands of `cmds_registered` and `cmds_unregistered` in two small hash tables, indexed by the command's length and
+   its first and last characters; a lookup is one hash, one table access and one case insensitive comparison, done with
+   a lookup table. The commands tries are still filled with every command, and serve commands that share a slot with
+   another one (a new command may well do so), as well as unknown commands.
    @author Filipe Goncalves
    @author Fabio Ribeiro
    @date November 2013
@@ -39,6 +45,29 @@ static struct trie_t *commands_registered;
 /** A trie used to store function pointers to process every commands issued by unregistered connections */
 static struct trie_t *commands_unregistered;
 
+/** How many slots a commands hash table has. Must be a power of 2. */
+#define CMD_TABLE_SIZE 32
+
+/** Case folding for commands: maps upper case letters to lower case, and every other character to itself.
+	@param c The character, as an integer in `[0 .. 255]`.
+ */
+#define CMD_FOLD(c) ((c) >= 'A' && (c) <= 'Z' ? (c) - 'A' + 'a' : (c))
+
+/** Case folding lookup table, built at compile time from `CMD_FOLD()` */
+static const unsigned char cmd_fold[256] = { TRIE_EXPAND256(CMD_FOLD) };
+
+/** The hash function for the commands hash tables. The commands in `cmds_registered` and `cmds_unregistered` do not
+   collide with it.
+	@param cmd The command, as an `unsigned char` pointer.
+	@param len The command's length. Must be at least 1.
+ */
+#define CMD_HASH(cmd, len) (((len) + cmd_fold[(cmd)[0]] + cmd_fold[(cmd)[(len)-1]]) & (CMD_TABLE_SIZE - 1))
+
+/** Hash table for the commands issued by registered connections. Empty slots hold `NULL`. */
+static const struct cmd_func *table_registered[CMD_TABLE_SIZE];
+/** Hash table for the commands issued by unregistered connections. Empty slots hold `NULL`. */
+static const struct cmd_func *table_unregistered[CMD_TABLE_SIZE];
+
 /** This structure defines a trie commands' node. It contains the command itself, i.e., the path taken by the trie to
    arrive at this node, and a pointer to a function that knows how to process this command. */
 struct cmd_func {
@@ -104,7 +133,7 @@ static const struct cmd_func cmds_registered[] = {
 	If no error condition occurs and the client already chose username, realname and GECOS, the client's request is
 	   acknowledged with the welcome message (see `send_welcome()`), along with the MOTD. If no error occurs, but
 	   the client has not yet defined realname, username and GECOS, no reply is given.
-	If there's no memory to store the new nickname, `pthread_exit()` is called, and the client's connection is
+	If there's no memory to store the new nickname, `terminate_session()` is called, and the client's connection is
 	   closed.
 	@param client The client who issued the command.
 	@param prefix Null terminated characters sequence holding the command's prefix, as returned by `parse_msg()`.
@@ -131,6 +160,7 @@ static const struct cmd_func cmds_registered[] = {
  */
 void cmd_nick_unregistered(struct irc_client *client, char *prefix, char *cmd, char *params[], int params_size)
 {
+	char *newnick;
 	if (params_size < 1) {
 		send_err_nonicknamegiven(client);
 		return;
@@ -139,31 +169,37 @@ void cmd_nick_unregistered(struct irc_client *client, char *prefix, char *cmd, c
 		send_err_erroneusnickname(client, params[0]);
 		return;
 	}
-	switch (client_list_add(client, params[0])) {
+	if ((newnick = strdup(params[0])) == NULL) {
+		/* No memory for this client's nick, sorry! */
+		terminate_session(client, NO_MEM_QUIT_MSG);
+		return;
+	}
+	switch (client_list_add(client, newnick)) {
 	case LST_INVALID_WORD:
 		send_err_erroneusnickname(client, params[0]);
+		free(newnick);
 		return;
 	case LST_NO_MEM:
+		free(newnick);
 		terminate_session(client, NO_MEM_QUIT_MSG);
 		return;
 	case LST_ALREADY_EXISTS:
 		send_err_nicknameinuse(client, params[0]);
+		free(newnick);
 		return;
 	}
 	if (client->nick != NULL) {
 		client_list_delete(client);
 		free(client->nick);
 	}
-	if ((client->nick = strdup(params[0])) == NULL) {
-		/* No memory for this client's nick, sorry! */
-		client_list_delete(client);
+	client->nick = newnick;
+	if (client_update_prefix(client) == -1) {
 		terminate_session(client, NO_MEM_QUIT_MSG);
 		return;
 	}
 	if (client->nick != NULL && client->username != NULL && client->realname != NULL) {
 		client->is_registered = 1;
 		send_welcome(client);
-		send_motd(client);
 	}
 }
 
@@ -176,7 +212,7 @@ void cmd_nick_unregistered(struct irc_client *client, char *prefix, char *cmd, c
 	If no error condition occurs and the client already defined a nickname, the client's request is acknowledged
 	   with the welcome message (see `send_welcome()`), along with the MOTD. If no error occurs and no nickname has
 	   been chosen yet, no reply is generated.
-	If there's no memory to store the new information, `pthread_exit()` is called, and the client's connection is
+	If there's no memory to store the new information, `terminate_session()` is called, and the client's connection is
 	   closed.
 	@param client The client who issued the command.
 	@param prefix Null terminated characters sequence holding the command's prefix, as returned by `parse_msg()`.
@@ -198,17 +234,15 @@ void cmd_user_unregistered(struct irc_client *client, char *prefix, char *cmd, c
 		free(client->realname);
 	}
 	if ((client->username = strdup(params[0])) == NULL ||
-	    (client->realname = strdup(params[3])) == NULL) {
-		if (client->nick != NULL) {
-			client_list_delete(client);
-		}
+	    (client->realname = strdup(params[3])) == NULL ||
+	    client_update_prefix(client) == -1) {
+		/* The nick, if any, is removed from the clients list when the client is destroyed */
 		terminate_session(client, NO_MEM_QUIT_MSG);
 		return;
 	}
 	if (client->nick != NULL && client->username != NULL && client->realname != NULL) {
 		client->is_registered = 1;
 		send_welcome(client);
-		send_motd(client);
 	}
 }
 
@@ -284,16 +318,23 @@ void cmd_quit(struct irc_client *client, char *prefix, char *cmd, char *params[]
 	terminate_session(client, msg);
 }
 
+/** Arguments wrapper for `cmd_privmsg_aux()`. */
+struct privmsg_args {
+	struct cmd_parse *info; /**<Informations returned by `parse_msg()` */
+	struct worker_wakeups wakeups; /**<Where the target's worker is collected, to be woken up once the target's list
+	                                  node lock is released */
+};
+
 /** Callback function used by `cmd_privmsg()` when a PRIVMSG command is issued on a one-to-one private conversation. The
    clients list implementation will call this function while holding a lock to the target client list node.
         @param target_client A `(struct irc_client *)` holding the target client's informations.
-        @param args A wrapper holding informations returned by `parse_msg()` packed in a pointer to `struct cmd_parse`.
+        @param args A pointer to `struct privmsg_args`.
  */
 static void *cmd_privmsg_aux(void *target_client, void *args)
 {
-	struct cmd_parse *info = (struct cmd_parse*)args;
+	struct privmsg_args *privmsg = (struct privmsg_args*)args;
 	struct irc_client *target = (struct irc_client*)target_client;
-	notify_privmsg(info->from, target, target->nick, info->params[1]);
+	notify_privmsg(privmsg->info->from, target, target->nick, privmsg->info->params[1], &privmsg->wakeups);
 	return NULL;
 }
 
@@ -354,6 +395,7 @@ conversation (channel message).
 void cmd_privmsg(struct irc_client *client, char *prefix, char *cmd, char *params[], int params_size)
 {
 	struct cmd_parse wrapper;
+	struct privmsg_args privmsg;
 	int status;
 	if (params_size == 0) {
 		send_err_norecipient(client, "PRIVMSG");
@@ -374,7 +416,10 @@ void cmd_privmsg(struct irc_client *client, char *prefix, char *cmd, char *param
 			send_err_nosuchnick(client, params[0]);
 		}
 	} else {
-		(void)client_list_find_and_execute(params[0], cmd_privmsg_aux, (void*)&wrapper, &status);
+		privmsg.info = &wrapper;
+		worker_wakeups_init(&privmsg.wakeups);
+		(void)client_list_find_and_execute(params[0], cmd_privmsg_aux, (void*)&privmsg, &status);
+		worker_wakeups_flush(&privmsg.wakeups);
 		if (status == 0) {
 			send_err_nosuchnick(client, params[0]);
 		}
@@ -644,34 +689,24 @@ void cmd_list(struct irc_client *client, char *prefix, char *cmd, char *params[]
 	list_each_channel(client);
 }
 
-/** Defines what is a valid character for a command. We only allow alphabetic characters to be part of a command.
-	@param c The character to check.
-	@return `0` if `c` is an invalid character, `1` otherwise.
+/** Defines what is a valid character for a command, and maps it into its unique ID. We only allow alphabetic
+characters to be part of a command, and we use a direct, case insensitive mapping in which `c` is mapped to the integer
+`c - &lsquo;a&rsquo;`.
+	@param c The character to map, as an integer in `[0 .. 255]`.
+	@return A unique integer that represents `c`'s ID; `TRIE_INVALID_POS` if `c` is an invalid character.
  */
-static int is_valid(char c)
-{
-	return isalpha((unsigned char)c);
-}
+#define COMMAND_POS(c) \
+	((c) >= 'a' && (c) <= 'z' ? (c) - 'a' : (c) >= 'A' && (c) <= 'Z' ? (c) - 'A' : TRIE_INVALID_POS)
 
 /** Defines a mapping from a character ID back into its character representation. The commands trie maps a character `c`
 to `c - &lsquo;a&rsquo;`, thus, to map back, we just need to return `c + &lsquo;a&rsquo;`.
 	@param c Unique ID for a character
-	@return A character `i` such that `char_to_pos(i) == c`
+	@return A character `i` such that `COMMAND_POS(i) == c`
  */
-static char pos_to_char(int c)
-{
-	return c - 'a';
-}
+#define COMMAND_CHR(c) ((c) < 'z' - 'a' + 1 ? 'a' + (c) : '\0')
 
-/** Maps a character into its unique ID. We use a direct mapping in which `c` is mapped to the integer `c -
-&lsquo;a&rsquo;`.
-	@param c The character to map.
-	@return A unique integer that represents `c`'s ID.
- */
-static int char_to_pos(char c)
-{
-	return tolower((unsigned char)c) - 'a';
-}
+/** The commands alphabet */
+static TRIE_ALPHABET(command_alphabet, COMMAND_POS, COMMAND_CHR, 'z' - 'a' + 1);
 
 /** Inserts a set of commands stored in an array of commands into a given trie. This function is used by `cmds_init()`.
 Its purpose is to loop through an array of `struct cmd_fund` and add each command to the specified trie.
@@ -694,33 +729,81 @@ static int add_commands(struct trie_t *trie, const struct cmd_func *array, size_
 	return 0;
 }
 
-/** Initializes the commands tries. There is a trie for commands issued by registered users, and a trie for command
-requests coming from unregistered users. This function initializes both tries, and calls `add_commands()` to iterate
-through each of the commands arrays and add each element to the appropriate trie.
+/** Fills a commands hash table. A command that hashes to a slot already taken is left out of the table, so that it is
+only found by the commands trie; a message is printed, since the hash function should be adjusted for it.
+	@param table The hash table to fill.
+	@param array An array of `struct cmd_func`; `cmds_unregistered` or `cmds_registered`.
+	@param array_size How many elements are stored in `array`.
+ */
+static void fill_commands_table(const struct cmd_func **table, const struct cmd_func *array, size_t array_size)
+{
+	const unsigned char *cmd;
+	size_t i;
+	int h;
+	for (i = 0; i < array_size; i++) {
+		cmd = (const unsigned char*)array[i].command;
+		h = CMD_HASH(cmd, strlen(array[i].command));
+		if (table[h] != NULL) {
+			fprintf(stderr, "::interpretmsg.c:fill_commands_table(): %s and %s share a slot, %s is left in the trie.\n",
+				table[h]->command, array[i].command, array[i].command);
+			continue;
+		}
+		table[h] = &array[i];
+	}
+}
+
+/** Looks a command up in a commands hash table.
+	@param table The hash table.
+	@param cmd The command, as returned by `parse_msg()`.
+	@return The matching entry; `NULL` if the command is not in the table, in which case it may still be in the
+	   commands trie.
+ */
+static const struct cmd_func *find_command(const struct cmd_func **table, const char *cmd)
+{
+	const unsigned char *a = (const unsigned char*)cmd;
+	const unsigned char *b;
+	const struct cmd_func *entry;
+	size_t len;
+
+	if ((len = strlen(cmd)) == 0 || (entry = table[CMD_HASH(a, len)]) == NULL) {
+		return NULL;
+	}
+	/* Commands in the arrays are lower case */
+	for (b = (const unsigned char*)entry->command; *b != '\0' && cmd_fold[*a] == *b; a++, b++)
+		;  /* Intentionally left blank */
+	return *a == '\0' && *b == '\0' ? entry : NULL;
+}
+
+/** Initializes the commands tries and hash tables. There is a trie and a hash table for commands issued by registered
+users, and another pair for command requests coming from unregistered users. This function initializes both tries, calls
+`add_commands()` to iterate through each of the commands arrays and add each element to the appropriate trie, and calls
+`fill_commands_table()` to do the same for the hash tables.
 	@return `0` on success; `-1` if any of the tries could not be successfully filled due to resource allocation
 	   errors.
  */
 int cmds_init(void)
 {
 	int i, j;
-	if ((commands_registered = init_trie(NULL, is_valid, pos_to_char, char_to_pos, 'z' - 'a' + 1)) == NULL) {
+	if ((commands_registered = init_trie(NULL, &command_alphabet)) == NULL) {
 		return -1;
 	}
-	if ((commands_unregistered = init_trie(NULL, is_valid, pos_to_char, char_to_pos, 'z' - 'a' + 1)) == NULL) {
+	if ((commands_unregistered = init_trie(NULL, &command_alphabet)) == NULL) {
 		free(commands_registered);
 		return -1;
 	}
 	i = add_commands(commands_unregistered, cmds_unregistered, array_count(cmds_unregistered));
 	j = add_commands(commands_registered, cmds_registered, array_count(cmds_registered));
+	fill_commands_table(table_unregistered, cmds_unregistered, array_count(cmds_unregistered));
+	fill_commands_table(table_registered, cmds_registered, array_count(cmds_registered));
 	return -!(i == 0 && j == 0);
 }
 
 /** Interprets an IRC message. Assumes that the message is syntactically correct, that is, `parse_msg()` did not return
    an error condition.
    Interpreting a message consists of redirecting the request to the appropriate function that knows how to process it.
-      This is done by searching through the commands trie (a different trie is selected whether the request came from a
-      registered or unregistered connection), and invoking the function pointed to by the trie's node data if a match is
-      found.
+      This is done by searching through the commands hash table, and then through the commands trie if the hash table
+      has no match (a different table and trie are selected whether the request came from a registered or unregistered
+      connection), and invoking the function found if there is a match.
    If a match is not found, `ERR_NOTREGISTERED` is sent if the request came from an unregistered connection;
       `ERR_UNKNOWNCOMMAND` is sent if the request came from a registered connection.
    If a match is found, i.e., the command invoked really exists, the appropriate function is called to dispatch this
@@ -737,14 +820,16 @@ int cmds_init(void)
  */
 void interpret_msg(struct irc_client *client, char *prefix, char *cmd, char *params[], int params_size)
 {
-	struct cmd_func *command_func;
+	const struct cmd_func *command_func;
 	if (!client->is_registered) {
-		if ((command_func = (struct cmd_func*)find_word_trie(commands_unregistered, cmd)) == NULL) {
+		if ((command_func = find_command(table_unregistered, cmd)) == NULL &&
+		    (command_func = (struct cmd_func*)find_word_trie(commands_unregistered, cmd)) == NULL) {
 			send_err_notregistered(client);
 			return;
 		}
 	} else {
-		if ((command_func = (struct cmd_func*)find_word_trie(commands_registered, cmd)) == NULL) {
+		if ((command_func = find_command(table_registered, cmd)) == NULL &&
+		    (command_func = (struct cmd_func*)find_word_trie(commands_registered, cmd)) == NULL) {
 			send_err_unknowncommand(client, cmd);
 			return;
 		}
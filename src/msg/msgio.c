@@ -1,5 +1,6 @@
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -8,6 +9,8 @@
 #include <ev.h>
 #include "protocol.h"
 #include "msgio.h"
+#include "serverinfo.h"
+#include "write_msgs_queue.h"
 
 /** @file
    @brief Implementation for send_ functions.
@@ -16,33 +19,95 @@
    @date November 2013
  */
 
-/** Similar to `write_to()`, but in case of socket error, `terminate_session()` is called using `BAD_WRITE_QUIT_MSG` as a quit message.
-   @param client The client to read from.
-   @param buf Buffer to store the message read.
-   @param len Maximum length of the message. This is usually bounded by the size of `buf`. This parameter avoids buffer
-      overflow.
+/** Knows how to write to a client. It is an abstraction used by every function that wants to write to a client.
+   Nothing is written to the socket right away: the characters are appended to the client's output buffer, which is
+      his messages write queue, and the worker serving the client flushes it once it is done processing the current
+      event. Sockets are non-blocking, so a slow reader can never stall the worker (or, worse, a worker holding a
+      channel lock); whatever the socket does not accept at once waits in the queue until the socket is writable again.
+   @param client The client to write to.
+   @param buf A characters sequence, possibly not null-terminated, that shall be written to this client's socket.
+   @param len How many characters from `buf` are to be written into this client's socket.
+   @return `0` if the characters were queued; `-1` if the client's output buffer is full, or if there's no memory.
+   @warning This must only be called by the worker serving `client`, since no wake up is issued. Other threads shall use
+      `client_enqueue()` or `client_enqueue_shared()`, followed by `worker_notify()`, and call `worker_wakeups_flush()`
+      if they collected the wakeups in a `struct worker_wakeups`.
+ */
+int write_to(struct irc_client *client, const char *buf, size_t len)
+{
+	struct shared_msg *msg;
+	int ret;
+	if ((msg = shared_msg_new(buf, len)) == NULL) {
+		return -1;
+	}
+	ret = client_enqueue_shared(&client->write_queue, msg);
+	shared_msg_release(msg);
+	return ret;
+}
+
+/** Determines if a failed socket read or write on a non-blocking socket just means that the operation would block, as
+   opposed to a real error.
+   @param client The client whose socket was used.
+   @param ret The value returned by `recv()`, `writev()`, `SSL_read()` or `SSL_write()`. It must be less than or equal to
+      `0`, and `errno` must not have been modified since the call.
+   @return `1` if the operation shall be retried later; `0` if the connection is broken or was closed.
  */
-inline void write_to_noerr(struct irc_client *client, char *buf, size_t len)
+int io_would_block(struct irc_client *client, int ret)
+{
+	int err;
+	if (client->uses_ssl) {
+		err = SSL_get_error(client->ssl, ret);
+		return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE;
+	}
+	return ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+}
+
+/** Similar to `write_to()`, but if the characters cannot be queued, `terminate_session()` is called using
+   `SENDQ_EXCEEDED_QUIT_MSG` as a quit message if the client's SendQ was exceeded, or `BAD_WRITE_QUIT_MSG` otherwise.
+   @param client The client to write to.
+   @param buf A characters sequence, possibly not null-terminated, that shall be written to this client's socket.
+   @param len How many characters from `buf` are to be written.
+ */
+void write_to_noerr(struct irc_client *client, char *buf, size_t len)
 {
 	if (write_to(client, buf, len) == -1) {
-		terminate_session(client, BAD_WRITE_QUIT_MSG);
+		terminate_session(client, client_queue_sendq_exceeded(&client->write_queue) ?
+				  SENDQ_EXCEEDED_QUIT_MSG : BAD_WRITE_QUIT_MSG);
+	}
+}
+
+/** Similar to `write_to_noerr()`, but queues a shared message that the caller built in place, rather than copying the
+   characters. See `shared_msg_alloc()`.
+   @param client The client to write to.
+   @param msg The message. The caller's reference is left untouched.
+ */
+void write_shared_noerr(struct irc_client *client, struct shared_msg *msg)
+{
+	if (client_enqueue_shared(&client->write_queue, msg) == -1) {
+		terminate_session(client, client_queue_sendq_exceeded(&client->write_queue) ?
+				  SENDQ_EXCEEDED_QUIT_MSG : BAD_WRITE_QUIT_MSG);
 	}
 }
 
 /** Similar to `read_from()`, but in case of socket error, `terminate_session()` is called using `BAD_READ_QUIT_MSG` as a quit message.
+   Sockets are non-blocking; a read that would block is not an error.
    @param client The client to read from.
    @param buf Buffer to store the message read.
    @param len Maximum length of the message. This is usually bounded by the size of `buf`. This parameter avoids buffer
       overflow.
-   @return A positive integer denoting the number of characters read.
+   @return A positive integer denoting the number of characters read; `0` if there is nothing to read at the moment
+      (this happens, for example, when only part of a TLS record arrived); `-1` if the session was terminated.
  */
-inline ssize_t read_from_noerr(struct irc_client *client, char *buf, size_t len)
+ssize_t read_from_noerr(struct irc_client *client, char *buf, size_t len)
 {
 	ssize_t msg_size;
-	if ((msg_size = read_from(client, buf, len)) <= 0) {
-		terminate_session(client, BAD_READ_QUIT_MSG);
+	if ((msg_size = read_from(client, buf, len)) > 0) {
+		return msg_size;
+	}
+	if (io_would_block(client, (int)msg_size)) {
+		return 0;
 	}
-	return msg_size;
+	terminate_session(client, BAD_READ_QUIT_MSG);
+	return -1;
 }
 
 /** A printf equivalent version for yaIRCd that sends a set of arbitrarily long IRC messages into a client's socket.
@@ -108,3 +173,200 @@ int cmd_print_reply(char *buf, size_t size, const char *msg, ...)
 	}
 	return ret;
 }
+
+/** Appends a characters sequence to a message being built by `cmd_print_from()`, truncating it if needed.
+   @param buf The message.
+   @param pos How many characters the message holds.
+   @param limit How many characters, at most, the message can hold.
+   @param str What to append. It need not be null terminated.
+   @param len How many characters to append from `str`.
+   @return How many characters the message holds afterwards.
+ */
+static size_t append_reply(char *buf, size_t pos, size_t limit, const char *str, size_t len)
+{
+	if (len > limit - pos) {
+		len = limit - pos;
+	}
+	memcpy(buf + pos, str, len);
+	return pos + len;
+}
+
+/** Builds a message sent on behalf of a client, of the form `:nick!user@host cmd middle :trailing`, followed by CR LF.
+   The client's cached prefix (see `client_update_prefix()`) and the other pieces are copied as they are, so this is
+      cheaper than `cmd_print_reply()` on the paths that deliver messages to many users. Output is truncated exactly
+      like `cmd_print_reply()` does, and the buffer is null terminated.
+   @param buf Output buffer
+   @param size How many characters, at most, can be written in `buf`. Must be greater than or equal to 3.
+   @param from The message's source. His prefix must have been built, which is always the case once he is registered.
+   @param cmd The command, such as `"PRIVMSG"`.
+   @param middle The parameter that follows the command, or `NULL` if there is none.
+   @param trailing The last parameter, which is sent after a ':' and may contain spaces, or `NULL` if there is none.
+   @return A number less than `size` indicating how many characters, excluding the null terminator, were written.
+ */
+int cmd_print_from(char *buf, size_t size, struct irc_client *from, const char *cmd, const char *middle,
+		   const char *trailing)
+{
+	size_t limit = size - 3;
+	size_t pos;
+
+	pos = append_reply(buf, 0, limit, ":", 1);
+	pos = append_reply(buf, pos, limit, from->prefix, from->prefix_len);
+	pos = append_reply(buf, pos, limit, " ", 1);
+	pos = append_reply(buf, pos, limit, cmd, strlen(cmd));
+	if (middle != NULL) {
+		pos = append_reply(buf, pos, limit, " ", 1);
+		pos = append_reply(buf, pos, limit, middle, strlen(middle));
+	}
+	if (trailing != NULL) {
+		pos = append_reply(buf, pos, limit, " :", 2);
+		pos = append_reply(buf, pos, limit, trailing, strlen(trailing));
+	}
+	buf[pos++] = '\r';
+	buf[pos++] = '\n';
+	buf[pos] = '\0';
+	return (int)pos;
+}
+
+/** Prepares a `struct msg_builder` to build replies to a client.
+   @param msg The builder.
+   @param client The client the replies are for.
+ */
+void msg_builder_init(struct msg_builder *msg, struct irc_client *client)
+{
+	msg->client = client;
+	msg->len = 0;
+	msg->line_begin = 0;
+	msg->line_full = 0;
+	msg->params_full = 0;
+}
+
+/** Tells how many more characters fit in the line being built, leaving room for CR LF.
+   @param msg The builder.
+   @return How many characters can still be added to the line.
+ */
+static size_t line_room(struct msg_builder *msg)
+{
+	return msg->line_begin + MAX_MSG_SIZE - 2 - msg->len;
+}
+
+/** Appends characters to the line being built. If they do not fit, as many as possible are added, and the line is
+   closed to further additions.
+   @param msg The builder.
+   @param str What to append. It need not be null terminated.
+   @param len How many characters to append from `str`.
+ */
+void msg_add(struct msg_builder *msg, const char *str, size_t len)
+{
+	if (msg->line_full) {
+		return;
+	}
+	if (len > line_room(msg)) {
+		len = line_room(msg);
+		msg->line_full = 1;
+	}
+	memcpy(msg->buf + msg->len, str, len);
+	msg->len += len;
+}
+
+/** Appends a space and a middle parameter to the line being built, unless they do not fit, in which case nothing is
+   added, and neither is any other middle parameter of this line.
+   @param msg The builder.
+   @param param The parameter. It need not be null terminated.
+   @param len The parameter's length.
+ */
+static void add_param(struct msg_builder *msg, const char *param, size_t len)
+{
+	if (msg->line_full || msg->params_full || len + 1 > line_room(msg)) {
+		msg->params_full = 1;
+		return;
+	}
+	msg->buf[msg->len] = ' ';
+	memcpy(msg->buf + msg->len + 1, param, len);
+	msg->len += len + 1;
+}
+
+/** Appends a middle parameter, preceded by a space, to the line being built. A parameter that does not fit is not
+   added at all, and neither is any other middle parameter of this line; the trailing parameter still is.
+   @param msg The builder.
+   @param param Null terminated characters sequence with the parameter.
+ */
+void msg_add_param(struct msg_builder *msg, const char *param)
+{
+	add_param(msg, param, strlen(param));
+}
+
+/** Appends an integer, in decimal, as a middle parameter of the line being built. See `msg_add_param()`.
+   @param msg The builder.
+   @param n The integer.
+ */
+void msg_add_int(struct msg_builder *msg, long n)
+{
+	char digits[3 * sizeof(n) + 1];
+	unsigned long u;
+	size_t i;
+
+	u = n < 0 ? -(unsigned long)n : (unsigned long)n;
+	i = sizeof(digits);
+	do {
+		digits[--i] = (char)('0' + u % 10);
+		u /= 10;
+	} while (u != 0);
+	if (n < 0) {
+		digits[--i] = '-';
+	}
+	add_param(msg, digits + i, sizeof(digits) - i);
+}
+
+/** Begins a numeric reply line: appends the server's name, the numeric, and the reply's target, which is the client's
+   nickname, or `*` if he is not registered yet.
+   @param msg The builder. Nothing must have been added to the current line yet.
+   @param numeric The numeric, one of the `RPL_*` or `ERR_*` constants.
+ */
+void msg_add_numeric(struct msg_builder *msg, const char *numeric)
+{
+	msg_add_const(msg, ":");
+	msg_add_str(msg, get_server_name());
+	msg_add_const(msg, " ");
+	msg_add_str(msg, numeric);
+	msg_add_param(msg, msg->client->is_registered ? msg->client->nick : "*");
+}
+
+/** Appends the trailing parameter, preceded by " :", to the line being built. It may contain spaces, and it is cut short
+   if it does not fit. More characters may be added to it afterwards with `msg_add()`.
+   @param msg The builder.
+   @param str The parameter. It need not be null terminated.
+   @param len The parameter's length.
+ */
+void msg_add_trailing(struct msg_builder *msg, const char *str, size_t len)
+{
+	msg_add_const(msg, " :");
+	msg_add(msg, str, len);
+}
+
+/** Terminates the line being built with CR LF, and begins a new one. If the next line might not fit in the builder, the
+   lines built so far are queued to the client.
+   @param msg The builder.
+ */
+void msg_end_line(struct msg_builder *msg)
+{
+	msg->buf[msg->len++] = '\r';
+	msg->buf[msg->len++] = '\n';
+	if (sizeof(msg->buf) - msg->len < MAX_MSG_SIZE) {
+		msg_send(msg);
+	}
+	msg->line_begin = msg->len;
+	msg->line_full = 0;
+	msg->params_full = 0;
+}
+
+/** Queues every line built so far to the client, with `write_to_noerr()`. The builder can be used again afterwards.
+   @param msg The builder. The line being built, if any, must have been terminated with `msg_end_line()`.
+ */
+void msg_send(struct msg_builder *msg)
+{
+	if (msg->len > 0) {
+		write_to_noerr(msg->client, msg->buf, msg->len);
+	}
+	msg->len = 0;
+	msg->line_begin = 0;
+}
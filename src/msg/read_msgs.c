@@ -1,5 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
 #include <ev.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include "read_msgs.h"
 #include "client.h"
 #include "msgio.h"
@@ -12,72 +18,195 @@
 	Functions defined in this module deal with this problem. The rest of the code is not worried about the sockets API, and it should be absolutely independent of the way messages are retrieved.
 	
 	The basic layout to use this module is as follows: everytime there is new data to read, `read_data()` shall be called. This function will read as many characters as it can from the socket, considering the space available in the client's messages buffer. Then, the upper layer code shall call `next_msg()` untill MSG_CONTINUE is returned, which is the code for indicating that there are no more complete IRC messages in the buffer left to process. Note that there can still be some piece of a message that has not been fully read from the socket yet; in that case, the whole cycle begins again, and the buffer is automatically flushed to read the remaining characters from the socket.
+	`read_data()` tells the caller whether the socket may hold more data. Reading again right away, up to `READ_BUDGET` characters, saves a trip through the events loop for every buffer full of a burst, and it is the only way to get to data that OpenSSL already took from the socket: the socket will not become readable again for it.
+	
+	The messages buffer holds several IRC messages (its size is the connection class' `recvq`), and it is only allocated when the client first sends something. A message longer than `MAX_MSG_SIZE` is thrown away on its own; the messages around it are not affected.
+	
+	Finding the terminators is done once per read, not once per message. `read_data()` scans every chunk it reads as
+	soon as it arrives and records where the newlines are in a bitmap (`struct irc_message`'s `newlines`, one bit per
+	buffer position). `next_msg()` then only has to pick the lowest bit set, so a burst with many lines (pasted text, bots)
+	is split without looking at its characters again. The scan itself is vectorized: it compares 32 characters at a time
+	with AVX2 when the CPU supports it, 16 at a time with SSE2 otherwise, and falls back to a plain loop on other
+	architectures. The scanner is selected once by `read_msgs_init()`.
 	
 	@author Filipe Goncalves
 	@date November 2013
 */
 
-/** Initializes a `struct irc_message`, typically from a client.
+/** Initializes a `struct irc_message`, typically from a client. The buffer itself is allocated by `read_data()` when it
+   is first needed.
    @param in The structure to initialize.
+   @param size The buffer size, in characters. Sizes smaller than twice `MAX_MSG_SIZE` are raised to that, so that a
+      partial message left in the buffer never keeps a full message from being read after it; the size is also rounded up
+      to a multiple of 32, one newlines bitmap word.
  */
-void initialize_irc_message(struct irc_message *in)
+void initialize_irc_message(struct irc_message *in, int size)
 {
+	if (size < 2 * (int)MAX_MSG_SIZE) {
+		size = 2 * (int)MAX_MSG_SIZE;
+	}
+	in->msg = NULL;
+	in->newlines = NULL;
+	in->size = (size + 31) & ~31;
 	in->index = 0;
-	in->last_stop = 0;
 	in->msg_begin = 0;
-};
-
-/** Copies every characters from `buf[0..length-1] to `to`. Assumes `to` has enough space, which is safe because this
-   function is only used inside this fileas an auxiliary function from `next_msg()`.
-   @param to Pointer to the beginning of the target buffer.
-   @param buf Pointer to the buffer being copied.
-   @param length How many characters to copy from `buf`.
-   @note `to` and `buf` may overlap in memory, and in fact that is the case. `next_msg()` uses this function to bring a
-      message to the front of the queue.
+	in->discarding = 0;
+}
+
+/** Frees a `struct irc_message`'s buffer, if it was ever allocated.
+   @param in The structure to free.
+ */
+void free_irc_message(struct irc_message *in)
+{
+	free(in->msg);
+	in->msg = NULL;
+	in->newlines = NULL;
+}
+
+/** Allocates the buffer and the newlines bitmap of a `struct irc_message` with a single allocation. The bitmap goes
+   right after the buffer, whose size is a multiple of 32, so it is properly aligned.
+   @param in The structure, initialized with `initialize_irc_message()`.
+   @return `0` on success; `-1` if there's no memory.
+ */
+static int alloc_irc_message(struct irc_message *in)
+{
+	size_t map_size = in->size / 32 * sizeof(*in->newlines);
+	if ((in->msg = malloc(in->size + map_size)) == NULL) {
+		return -1;
+	}
+	in->newlines = (unsigned int*)(in->msg + in->size);
+	memset(in->newlines, 0, map_size);
+	return 0;
+}
+
+/** Portable newlines scanner, used when no vectorized version is available.
+   @param buf Where to start scanning. Bit `0` of `map[0]` corresponds to `buf[0]`.
+   @param length How many characters to scan.
+   @param map Where to write the newlines bitmap. Words `map[0..(length-1)/32]` are overwritten; bits for positions at or
+      after `length` are cleared.
+ */
+static void scan_newlines_scalar(const char *buf, int length, unsigned int *map)
+{
+	int i;
+	for (i = 0; i < length; i++) {
+		if (i % 32 == 0) {
+			map[i / 32] = 0;
+		}
+		if (buf[i] == '\n') {
+			map[i / 32] |= 1U << (i % 32);
+		}
+	}
+}
+
+#ifdef __SSE2__
+/** SSE2 newlines scanner: compares 16 characters at a time. See `scan_newlines_scalar()` for the parameters. */
+static void scan_newlines_sse2(const char *buf, int length, unsigned int *map)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	unsigned int lo;
+	unsigned int hi;
+	int i;
+	for (i = 0; i + 32 <= length; i += 32) {
+		lo = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buf + i)), nl));
+		hi = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buf + i + 16)), nl));
+		map[i / 32] = lo | (hi << 16);
+	}
+	scan_newlines_scalar(buf + i, length - i, map + i / 32);
+}
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SCAN_NEWLINES_AVX2
+/** AVX2 newlines scanner: compares 32 characters at a time, which is exactly one bitmap word. See
+   `scan_newlines_scalar()` for the parameters.
+   @warning Only call this function if the CPU supports AVX2. `read_msgs_init()` checks it.
+ */
+__attribute__((target("avx2")))
+static void scan_newlines_avx2(const char *buf, int length, unsigned int *map)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	int i;
+	for (i = 0; i + 32 <= length; i += 32) {
+		map[i / 32] = (unsigned int)_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(buf + i)), nl));
+	}
+	scan_newlines_scalar(buf + i, length - i, map + i / 32);
+}
+#endif
+
+/** The newlines scanner in use. Set by `read_msgs_init()`. */
+static void (*scan_newlines)(const char *buf, int length, unsigned int *map) = scan_newlines_scalar;
+
+/** Selects the fastest newlines scanner this CPU supports.
+   @warning This function must be called exactly once, by the main thread, before any client connects.
  */
-static void bring_to_top(char *to, char *buf, int length)
+void read_msgs_init(void)
 {
-	if (buf == to) {
-		return;
+#ifdef __SSE2__
+	scan_newlines = scan_newlines_sse2;
+#endif
+#ifdef HAVE_SCAN_NEWLINES_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		scan_newlines = scan_newlines_avx2;
 	}
-	for (; length-- > 0; *to++ = *buf++)
-		;  /* Intentionally left blank */
+#endif
 }
 
-/** Called everytime there is new data to read from the socket. After calling this function, it is advised to use
-   `next_msg()` to retrieve the IRC messages that can be extracted from this read,otherwise, the caller risks losing
-   space in the messages buffer.
+/** Records the newlines found in `client_msg->msg[from..to-1]`, which was just read from the socket.
+   The scan starts at the beginning of the bitmap word that holds position `from`, so that every word is written at
+      once; bits for positions before `from` in that word are kept as they were, since some of them may be newlines not
+      yet reported by `next_msg()`.
+   @param client_msg The messages buffer.
+   @param from Index of the first new character.
+   @param to Index one past the last new character.
+ */
+static void mark_newlines(struct irc_message *client_msg, int from, int to)
+{
+	int start = from & ~31;
+	unsigned int keep = (1U << (from - start)) - 1;
+	unsigned int old = client_msg->newlines[start / 32] & keep;
+
+	scan_newlines(client_msg->msg + start, to - start, client_msg->newlines + start / 32);
+	client_msg->newlines[start / 32] = (client_msg->newlines[start / 32] & ~keep) | old;
+}
+
+/** Called everytime there is new data to read from the socket. After calling this function, the caller must use
+   `next_msg()` to retrieve the IRC messages that can be extracted from this read, until `MSG_CONTINUE` is returned.
    @param client The client that transmitted new data.
-   @note This function never overflows. If it is called repeatedly without calling `next_msg()`, it will eventually run
-      out of space and throw away everything read, emptying the buffer.
-   @note This function only eads what it can. This means that, for example, there may be 256 characters available to
-      read from the socket, but if there's only space to read 28, only 28 are read.
-   This is generally the case when IRC messages were fragmented and we are waiting for the rest of some message, which
-      means our buffer is not empty.
-   The function shall be called again if it is known that there is more data in the socket to parse, but only after
-      calling `next_msg()` to free some space in the buffer.
+   @param more Set to `1` if the socket may still hold data after this read: either the read filled the buffer, or
+      OpenSSL holds characters it already decrypted. The caller shall call this function again once it is done with
+      `next_msg()`. Set to `0` otherwise.
+   @note This function only reads what it can. Since `next_msg()` leaves at most a partial message in the buffer, which
+      is never longer than `MAX_MSG_SIZE`, there is always room for at least another `MAX_MSG_SIZE` characters.
+   @return The number of characters read, which may be `0` if nothing could be read at the moment; `-1` if the read
+      failed, if the connection was closed, or if there's no memory for the buffer, in which case the client's session
+      was terminated and the caller must not touch the messages buffer anymore.
  */
-void read_data(struct irc_client *client)
+ssize_t read_data(struct irc_client *client, int *more)
 {
 	struct irc_message *client_msg = &client->last_msg;
-	if (sizeof(client_msg->msg) <= client_msg->index) {
-		/* If we get here, it means we have read a characters sequence of at least MAX_MSG_SIZE length without
-		   finding
-		   the message terminators \r\n. A lame client is messing around with the server. Reset the message
-		      buffer and log
-		   this malicious behavior.
-		 */
-		fprintf(stderr,
-			"Parse error: message exceeds maximum allowed length. Received by %s\n",
-			client->nick == NULL ? "<unregistered>" : client->nick);
-		initialize_irc_message(client_msg);
+	size_t space;
+	ssize_t msg_size;
+
+	*more = 0;
+	if (client_msg->msg == NULL && alloc_irc_message(client_msg) == -1) {
+		fprintf(stderr, "::read_msgs.c:read_data(): Could not allocate messages buffer.\n");
+		terminate_session(client, NO_MEM_QUIT_MSG);
+		return -1;
+	}
+	space = (size_t)(client_msg->size - client_msg->index);
+	msg_size = read_from_noerr(client, client_msg->msg + client_msg->index, space);
+	if (msg_size <= 0) {
+		return msg_size;
 	}
-	client_msg->index += read_from_noerr(client,
-					     client_msg->msg + client_msg->index,
-					     sizeof(client_msg->msg) - client_msg->index);
+	mark_newlines(client_msg, client_msg->index, client_msg->index + msg_size);
+	client_msg->index += msg_size;
+	*more = (size_t)msg_size == space || (client->uses_ssl && SSL_pending(client->ssl) > 0);
 	/* We got something new, update activity timestamp for this client */
 	client->last_activity = ev_now(client->ev_loop);
 	client->connection_status = STATUS_OK;
+	return msg_size;
 }
 
 /** Analyzes the incoming messages buffer and the information read from the socket to determine if there's any IRC
@@ -90,6 +219,9 @@ void read_data(struct irc_client *client)
    @return This function returns `MSG_CONTINUE`, which is a negative constant, if no new message is available.
    This means that, at the moment, it is not possible to retrieve a complete IRC message, and that the caller shall wait
       until there is more incoming data in the socket.
+   `MSG_TOO_LONG`, also negative, is returned when a message longer than `MAX_MSG_SIZE` was thrown away. The caller may
+      log it, and shall keep calling this function: there may be more messages after it. If the terminator of such a
+      message was not read yet, the rest of the message is discarded as it arrives.
    In case of success, the length of a new IRC message is returned (excluding the count for the terminating newline
       character), and `msg` will point to the beginning of the message.
    The message's characters are in `(msg)[0..length-1]`. On success, `length` is guaranteed to be greater than or equal
@@ -109,27 +241,50 @@ void read_data(struct irc_client *client)
 int next_msg(struct irc_message *client_msg, char **msg)
 {
 	int i;
-	int len;
-	char *buf = client_msg->msg;
-	for (i = client_msg->last_stop; i < client_msg->index && buf[i] != '\n'; i++)
-		;  /* Intentionally left blank */
-
-	/* assert: i == client_msg->index || buf[i] == '\n' */
-	if (i == client_msg->index) {
-		bring_to_top(client_msg->msg,
-			     client_msg->msg + client_msg->msg_begin,
-			     client_msg->index -= client_msg->msg_begin);
-		client_msg->last_stop = client_msg->index;
-		client_msg->msg_begin = 0;
-		return MSG_CONTINUE;
-	}else {
+	int w;
+	int begin;
+	unsigned int *map = client_msg->newlines;
+
+	for (;;) {
+		/* Newlines already reported were cleared from the bitmap, so the lowest bit set is the next terminator */
+		for (w = client_msg->msg_begin / 32; w * 32 < client_msg->index && map[w] == 0; w++)
+			;  /* Intentionally left blank */
+
+		if (w * 32 >= client_msg->index) {
+			/* No terminator left, so the bitmap is empty and stays valid after the partial message is moved */
+			begin = client_msg->msg_begin;
+			client_msg->index -= begin;
+			client_msg->msg_begin = 0;
+			if (client_msg->index < (int)MAX_MSG_SIZE) {
+				memmove(client_msg->msg, client_msg->msg + begin, client_msg->index);
+				return MSG_CONTINUE;
+			}
+			/* The partial message is already too long; drop it, and whatever comes until its terminator */
+			client_msg->index = 0;
+			if (client_msg->discarding) {
+				return MSG_CONTINUE;
+			}
+			client_msg->discarding = 1;
+			return MSG_TOO_LONG;
+		}
 		/* Wooho, a new message! */
-		len = i - client_msg->msg_begin;
-		*msg = client_msg->msg + client_msg->msg_begin;
-		if ((client_msg->last_stop = client_msg->msg_begin = i + 1) == sizeof(client_msg->msg)) {
-			/* Wrap around */
-			initialize_irc_message(client_msg);
+		i = w * 32 + __builtin_ctz(map[w]);
+		map[w] &= map[w] - 1;
+		begin = client_msg->msg_begin;
+		client_msg->msg_begin = i + 1;
+		if (client_msg->msg_begin == client_msg->index) {
+			/* Everything was consumed; the next read starts at the beginning of the buffer */
+			client_msg->index = client_msg->msg_begin = 0;
+		}
+		if (client_msg->discarding) {
+			/* This was the end of a message that was already reported as too long */
+			client_msg->discarding = 0;
+			continue;
+		}
+		if (i - begin >= (int)MAX_MSG_SIZE) {
+			return MSG_TOO_LONG;
 		}
-		return len;
+		*msg = client_msg->msg + begin;
+		return i - begin;
 	}
 }
@@ -1,49 +1,139 @@
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <openssl/ssl.h>
 #include "client.h"
 #include "write_msgs_queue.h"
 #include "msgio.h"
 /** @file
    @brief Client's messages write queue management functions
    This file provides a module that knows how to operate on a client's messages write queue.
-   It is easy for a client's thread to wake up and read incoming data using an IO watcher. However, sporadically, we
-      also need to wake up a client's thread to write to his socket.
-   For example, if user A PRIVMSGs user B, user A's thread must be able to somehow inform user B thread that something
-      needs to be sent to user B.
-   To do so, we use an async watcher. An async watcher allows an arbitrary thread X to wake up another thread Y. Thread
-      Y must be running an events loop and must have initialized and started an async watcher.
-   An async watcher works pretty much the same way as an IO watcher, but libev's documentation explicitly states that
-      queueing is not supported. In other words, if more async messages arrive when we are processing an async callback,
-      these will be silently discarded. Or, if multiple async requests are issued by different threads, they may all
-	  be packed in a single callback. To avoid losing messages like this, we implement our own messages queueing
-      system.
+   A worker learns that a client has data to read through an IO watcher. However, clients also need to be written to
+      on behalf of other clients, which may be served by other workers. For example, if user A PRIVMSGs user B, the
+      worker serving A must tell the worker serving B that something needs to be sent to B.
+   To do so, the message is queued in B's queue, and B is put in his worker's ready list with `worker_notify()`. The
+      worker is woken up, and flushes the queue of every client in its ready list (see `worker.h`). libev's async
+      watchers do not queue anything, and several wakeups may be folded into a single callback, so the queues are what
+      keep messages from being lost.
    Each client holds a queue of messages waiting to be written to his socket. These messages can originate from any
-      thread.
+      thread. The queue is lock-free: producers link new nodes with an atomic exchange on the queue's tail, and the
+      client's worker, the only consumer, removes them from the head. See `struct msg_queue`.
+   The queue is the client's only output buffer: sockets are non-blocking, and even the replies a worker sends to the
+      client it is serving are queued first and flushed when the worker is done processing (see `write_to()`).
    Every operation in a client's queue shall be invoked through the use of the functions declared in this file.
+   Messages are stored as `struct shared_msg`. When the same message must reach many clients (channel messages, quits,
+      parts, joins), the sender formats it once, creates a single shared message, and enqueues it in every recipient's
+      queue with `client_enqueue_shared()`. Each queue owns a reference; no per-recipient copies are made.
+   Each queue keeps track of how many bytes it is holding, and refuses to grow beyond the client's SendQ. When a
+      message is refused, the queue is flagged, and the client's worker evicts the client with "Max SendQ exceeded"
+      (see `finish_callback()`). Past that point, the queue drops every new message: the client is on his way out
+      anyway, and the whole point of a SendQ is to stop a stalled client from hoarding memory.
    @author Filipe Goncalves
    @date November 2013
  */
 
+/** Creates a new shared message with room for `length` characters, for callers that write the message in place
+   rather than copying it from somewhere else. The message is null terminated, but its contents are undefined: the
+   caller must fill `text` before enqueueing it. Like `shared_msg_new()`, the new message holds one reference, owned by
+   the caller.
+   @param length The message's length.
+   @return A new shared message, or `NULL` if there's no memory.
+ */
+struct shared_msg *shared_msg_alloc(size_t length)
+{
+	struct shared_msg *msg;
+	if ((msg = malloc(sizeof(*msg) + length + 1)) == NULL) {
+		return NULL;
+	}
+	msg->refcount = 1;
+	msg->length = length;
+	msg->text[length] = '\0';
+	return msg;
+}
+
+/** Creates a new shared message holding a copy of `text`. The new message holds one reference, owned by the caller,
+   that must be released with `shared_msg_release()` once the caller is done enqueueing it.
+   @param text The message to copy. It does not need to be null terminated.
+   @param length How many characters of `text` to copy.
+   @return A new shared message, or `NULL` if there's no memory.
+ */
+struct shared_msg *shared_msg_new(const char *text, size_t length)
+{
+	struct shared_msg *msg;
+	if ((msg = shared_msg_alloc(length)) != NULL) {
+		memcpy(msg->text, text, length);
+	}
+	return msg;
+}
+
+/** Takes a new reference to a shared message.
+   @param msg The message. The caller must already hold a reference to it.
+ */
+void shared_msg_ref(struct shared_msg *msg)
+{
+	__atomic_add_fetch(&msg->refcount, 1, __ATOMIC_RELAXED);
+}
+
+/** Releases a reference to a shared message. The message is freed when the last reference is released.
+   @param msg The message to release.
+ */
+void shared_msg_release(struct shared_msg *msg)
+{
+	if (__atomic_sub_fetch(&msg->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(msg);
+	}
+}
+
 /** Initializes a queue. This function is typically called when a new client is created.
    No queue insertions or deletions can be performed before initializing a queue.
    @param queue The queue to initialize.
+   @param max_bytes The client's SendQ, i.e., how many bytes this queue may hold at most.
    @return `0` on success; `-1` if there aren't enough resources to initialize a queue.
    @warning Undefined behavior will occur if queue operations are invoked in a non-initialized queue.
  */
-int client_queue_init(struct msg_queue *queue)
+int client_queue_init(struct msg_queue *queue, size_t max_bytes)
 {
-	queue->top = 0;
-	queue->bottom = 0;
-	queue->elements = 0;
-	return pthread_mutex_init(&queue->mutex, NULL);
+	if ((queue->head = malloc(sizeof(*queue->head))) == NULL) {
+		return -1;
+	}
+	queue->head->next = NULL;
+	queue->head->msg = NULL;
+	queue->tail = queue->head;
+	queue->head_offset = 0;
+	queue->bytes = 0;
+	queue->max_bytes = max_bytes;
+	queue->sendq_exceeded = 0;
+	return 0;
+}
+
+/** Removes the oldest message from a queue. The node that held it becomes the new dummy head, and the old head is
+   freed.
+   @param queue The queue.
+   @return The oldest message, whose reference is transferred to the caller; `NULL` if the queue is empty. A producer
+      that is halfway through inserting a message is not waited for: its message is not visible until the node is
+      linked, so the queue may look empty for a moment. The producer wakes the client's worker after enqueueing, so the
+      message is picked up in the next loop iteration.
+   @warning Only the worker serving the client that owns `queue` may call this.
+ */
+static struct shared_msg *pop_msg(struct msg_queue *queue)
+{
+	struct msg_queue_node *head;
+	struct msg_queue_node *next;
+	head = queue->head;
+	if ((next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE)) == NULL) {
+		return NULL;
+	}
+	queue->head = next;
+	__atomic_sub_fetch(&queue->bytes, next->msg->length, __ATOMIC_RELAXED);
+	free(head);
+	return next->msg;
 }
 
 /** Destroys a queue. This function is typically called when a client is exiting and is about to be destroyed.
    @param queue The queue to destroy.
-   @return `0` on success, `-1` if the destroy operation was not successfull. The error condition should never happen if
-      this module is used properly and no race conditions occur. If `-1` is returned, it means something went terribly
-      wrong with the thread synchronization mechanism used in a queue. For example, maybe a queue destroy operation was
-      invoked whena lock to this queue was active.
+   @return Always `0`.
    @warning Queue destroy operations must be performed carefully to avoid race conditions. The code that uses this
       module must ensure that after a queue is destroyed, no other thread will try to insert new messages in this queue.
       The program shall consider the case that a thread successfully destroys a queue, and is immediately interrupted
@@ -52,91 +142,242 @@ int client_queue_init(struct msg_queue *queue)
  */
 int client_queue_destroy(struct msg_queue *queue)
 {
-	int i;
-	int j;
-	for (i = queue->bottom, j = 0; j < queue->elements; i = (i + 1) % WRITE_QUEUE_SIZE, j++) {
-		free(queue->messages[i]);
+	struct shared_msg *msg;
+	while ((msg = pop_msg(queue)) != NULL) {
+		shared_msg_release(msg);
 	}
-	return pthread_mutex_destroy(&queue->mutex);
+	free(queue->head);
+	return 0;
 }
 
 /** Inserts a new message in a queue.
+   This is a convenience wrapper around `client_enqueue_shared()` for messages with a single recipient. Code delivering
+      the same message to several clients shall create a shared message once and use `client_enqueue_shared()` instead.
    @param queue The target queue where the message shall be written to.
-   @param message A null terminated characters sequence to enqueue. A fresh new copy of `message` is performed using
-      `strdup()`, to ensure that the characters sequence lives for as long as it is needed. The caller of this function
-      need not worry about allocating and freeing resources, this module will take care of that.
-   @return `0` on success; `-1` if there is no space left in this client's queue, or if there's no memory to perform a
-      fresh copy of the message.
+   @param message A null terminated characters sequence to enqueue. A fresh new copy of `message` is performed, to
+      ensure that the characters sequence lives for as long as it is needed. The caller of this function need not worry
+      about allocating and freeing resources, this module will take care of that.
+   @return `0` on success; `-1` if the client's SendQ was exceeded, or if there's no memory to perform a fresh copy of
+      the message.
  */
 int client_enqueue(struct msg_queue *queue, char *message)
 {
-	char *str;
-	pthread_mutex_lock(&queue->mutex);
-	if ((str = strdup(message)) == NULL || queue->elements == WRITE_QUEUE_SIZE) {
-		pthread_mutex_unlock(&queue->mutex);
+	struct shared_msg *msg;
+	int ret;
+	if ((msg = shared_msg_new(message, strlen(message))) == NULL) {
+		return -1;
+	}
+	ret = client_enqueue_shared(queue, msg);
+	shared_msg_release(msg);
+	return ret;
+}
+
+/** Inserts a shared message in a queue. On success, the queue takes a new reference to `msg`; the caller's reference
+   is left untouched.
+   The SendQ is enforced by reserving the message's size in `bytes` before inserting it; if the reservation goes beyond
+      `max_bytes`, it is undone. The new node is then published by atomically swapping it with `tail`, and linking it
+      to the previous tail. This never blocks, no matter how many threads are enqueueing to the same client.
+   @param queue The target queue where the message shall be written to.
+   @param msg The message to enqueue.
+   @return `0` on success; `-1` if the message would take the queue beyond the client's SendQ, or if there's no memory
+      for a new node. In both cases the queue is flagged (see `client_queue_sendq_exceeded()`), and every subsequent
+      enqueue operation fails.
+ */
+int client_enqueue_shared(struct msg_queue *queue, struct shared_msg *msg)
+{
+	struct msg_queue_node *node;
+	struct msg_queue_node *prev;
+
+	if (__atomic_load_n(&queue->sendq_exceeded, __ATOMIC_RELAXED)) {
+		return -1;
+	}
+	if (__atomic_add_fetch(&queue->bytes, msg->length, __ATOMIC_RELAXED) > queue->max_bytes ||
+	    (node = malloc(sizeof(*node))) == NULL) {
+		__atomic_sub_fetch(&queue->bytes, msg->length, __ATOMIC_RELAXED);
+		__atomic_store_n(&queue->sendq_exceeded, 1, __ATOMIC_RELAXED);
 		return -1;
 	}
-	queue->messages[queue->top] = str;
-	queue->top = (queue->top + 1) % WRITE_QUEUE_SIZE;
-	queue->elements++;
-	pthread_mutex_unlock(&queue->mutex);
+	shared_msg_ref(msg);
+	node->msg = msg;
+	node->next = NULL;
+	prev = __atomic_exchange_n(&queue->tail, node, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
 	return 0;
 }
 
 /** Dequeues a message previously enqueued. Dequeue operations follow a FIFO policy.
    @param queue The target queue to extract the message.
-   @return Pointer to a null terminated characters sequence previously inserted in this queue; `NULL` if there are no
-      elements. The pointer returned must be freed by the caller after it is no longer needed.
-   @warning A memory leak will occur if the caller does not free the pointer returned when it no longer needs it.
+   @return Pointer to a message previously inserted in this queue; `NULL` if there are no elements. The queue's
+      reference is transferred to the caller, who must release it with `shared_msg_release()` after it is no longer
+      needed.
+   @warning A memory leak will occur if the caller does not release the message returned when it no longer needs it.
+   @warning Only the worker serving the client that owns `queue` may call this.
  */
-char *client_dequeue(struct msg_queue *queue)
+struct shared_msg *client_dequeue(struct msg_queue *queue)
 {
-	char *ptr;
-	pthread_mutex_lock(&queue->mutex);
-	if (queue->elements == 0) {
-		pthread_mutex_unlock(&queue->mutex);
-		return NULL;
+	struct shared_msg *ptr;
+	if ((ptr = pop_msg(queue)) != NULL) {
+		queue->head_offset = 0;
 	}
-	ptr = queue->messages[queue->bottom];
-	queue->bottom = (queue->bottom + 1) % WRITE_QUEUE_SIZE;
-	queue->elements--;
-	pthread_mutex_unlock(&queue->mutex);
 	return ptr;
 }
 
 /** Determines if a queue is empty.
    @param queue The queue to examine.
    @return `0` if the queue is not empty; `1` if the queue is empty.
+   @warning Only the worker serving the client that owns `queue` may call this.
  */
-inline int client_is_queue_empty(struct msg_queue *queue)
+int client_is_queue_empty(struct msg_queue *queue)
 {
-	int ret;
-	pthread_mutex_lock(&queue->mutex);
-	ret = (queue->elements == 0);
-	pthread_mutex_unlock(&queue->mutex);
-	return ret;
+	return __atomic_load_n(&queue->head->next, __ATOMIC_ACQUIRE) == NULL;
+}
+
+/** Determines if a queue refused a message because the client's SendQ was exceeded.
+   @param queue The queue to examine.
+   @return `1` if the SendQ was exceeded at some point; `0` otherwise.
+ */
+int client_queue_sendq_exceeded(struct msg_queue *queue)
+{
+	return __atomic_load_n(&queue->sendq_exceeded, __ATOMIC_RELAXED);
+}
+
+/** Reads how many bytes are waiting in a queue to be written to the client's socket.
+   @param queue The queue to examine.
+   @return How many bytes are queued. This is only a snapshot; other threads may be enqueueing messages concurrently.
+ */
+size_t client_queue_bytes(struct msg_queue *queue)
+{
+	return __atomic_load_n(&queue->bytes, __ATOMIC_RELAXED);
+}
+
+/** Writes a batch of messages to a plaintext socket with a single `writev()` call.
+   @param client Target client.
+   @param batch The messages to write, in order.
+   @param count How many messages are in `batch`. Must not exceed `FLUSH_MAX_MSGS`.
+   @param offset How many characters of the first message were already written by a previous flush.
+   @return The number of characters written; `0` if the socket is not writable at the moment; `-1` on error.
+ */
+static ssize_t flush_plain(struct irc_client *client, struct shared_msg **batch, int count, size_t offset)
+{
+	struct iovec iov[FLUSH_MAX_MSGS];
+	ssize_t written;
+	int i;
+	for (i = 0; i < count; i++) {
+		iov[i].iov_base = batch[i]->text + offset;
+		iov[i].iov_len = batch[i]->length - offset;
+		offset = 0;
+	}
+	if ((written = writev(client->socket_fd, iov, count)) == -1) {
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+	}
+	return written;
+}
+
+/** Coalesces a batch of messages into a single buffer and writes it with one `SSL_write()` call, so that every message
+   ends up in the same TLS record instead of paying for a record (and a `write()`) per message.
+   At most `FLUSH_TLS_BUFFER_SIZE` characters are coalesced; the remaining messages are left for the next iteration. A
+   message that alone does not fit in the buffer is written directly, without copying.
+   When `SSL_write()` cannot complete because the socket is not writable, OpenSSL requires the same data to be written
+   again later. This holds, since the next flush will coalesce the same messages, starting at the same offset. The SSL
+   context is set up with `SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER`, so the buffer's address is allowed to change.
+   @param client Target client.
+   @param batch The messages to write, in order.
+   @param count How many messages are in `batch`.
+   @param offset How many characters of the first message were already written by a previous flush.
+   @return The number of characters written; `0` if the socket is not writable at the moment; `-1` on error.
+ */
+static ssize_t flush_ssl(struct irc_client *client, struct shared_msg **batch, int count, size_t offset)
+{
+	char buf[FLUSH_TLS_BUFFER_SIZE];
+	size_t used;
+	size_t len;
+	int written;
+	int i;
+
+	if (batch[0]->length - offset > sizeof(buf)) {
+		written = SSL_write(client->ssl, batch[0]->text + offset, (int)(batch[0]->length - offset));
+	} else {
+		for (i = 0, used = 0; i < count; i++) {
+			len = batch[i]->length - offset;
+			if (used + len > sizeof(buf)) {
+				break;
+			}
+			memcpy(buf + used, batch[i]->text + offset, len);
+			used += len;
+			offset = 0;
+		}
+		written = SSL_write(client->ssl, buf, (int)used);
+	}
+	if (written <= 0) {
+		return io_would_block(client, written) ? 0 : -1;
+	}
+	return written;
+}
+
+/** Removes from a queue every message that was completely written, and records how much of the next message was
+   written, if any.
+   @param queue The queue.
+   @param written How many characters were written, counting from the current head offset. These characters must
+      belong to messages that are already linked in the queue.
+ */
+static void consume_written(struct msg_queue *queue, size_t written)
+{
+	struct msg_queue_node *next;
+	written += queue->head_offset;
+	while ((next = __atomic_load_n(&queue->head->next, __ATOMIC_ACQUIRE)) != NULL && written >= next->msg->length) {
+		written -= next->msg->length;
+		shared_msg_release(pop_msg(queue));
+	}
+	queue->head_offset = written;
 }
 
 /** Function used when a client wants to flush his messages write queue.
-	This will destructively iterate through a queue for a given client, writing every pending message
-	to this client's socket.
+	This will destructively iterate through a queue for a given client, writing pending messages to this client's
+	socket until the queue is empty or the socket is not writable anymore.
+	Messages are not written one by one. For plaintext clients, pending messages are gathered into a single `writev()`
+	call; for SSL clients, they are coalesced into one buffer and written with a single `SSL_write()`. Partial writes are
+	handled by remembering how much of the head message was already written (`head_offset`); the next write resumes
+	from there.
+	No lock is taken: the batch is gathered by walking the list from `head`, and only the client's own worker removes
+	nodes from it, so the nodes stay valid while the socket write is performed. Other threads can keep enqueueing
+	messages to this client meanwhile.
+	At most as many bytes as were queued when the flush started are written; anything enqueued meanwhile is left for
+	the next flush. This way, a client being flooded cannot keep his worker busy forever.
 	@param client Target client.
 	@param queue The queue to flush.
+	@return `0` if the flush went fine, even if the socket was not writable and messages are still pending (use
+	`client_is_queue_empty()` to find out); `-1` if a socket error occurred. In the latter case, the caller shall
+	terminate the client's session.
+	@warning This must only be called by the worker serving `client`.
  */
-void flush_queue(struct irc_client *client, struct msg_queue *queue)
+int flush_queue(struct irc_client *client, struct msg_queue *queue)
 {
-	/* We ignore possible errors that may arise during a write. We use write_to(), not write_to_noerr(),
-	   because write_to_noerr() calls pthread_exit() if things go wrong, and we can't call pthread_exit() here,
-	   since we're holding a lock to a queue. Things would fall apart if we did so.
-	 */
-	int i;
-	int j;
-	pthread_mutex_lock(&queue->mutex);
-	for (i = queue->bottom, j = 0; j < queue->elements; j++, i = (i + 1) % WRITE_QUEUE_SIZE) {
-		(void)write_to(client, queue->messages[i], strlen(queue->messages[i]));
-		free(queue->messages[i]);
+	struct shared_msg *batch[FLUSH_MAX_MSGS];
+	struct msg_queue_node *node;
+	int count;
+	size_t pending;
+	ssize_t written;
+
+	pending = __atomic_load_n(&queue->bytes, __ATOMIC_RELAXED) - queue->head_offset;
+	while (pending > 0) {
+		node = __atomic_load_n(&queue->head->next, __ATOMIC_ACQUIRE);
+		for (count = 0; node != NULL && count < FLUSH_MAX_MSGS; count++) {
+			batch[count] = node->msg;
+			node = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+		}
+		if (count == 0) {
+			break;
+		}
+		if (client->uses_ssl) {
+			written = flush_ssl(client, batch, count, queue->head_offset);
+		} else {
+			written = flush_plain(client, batch, count, queue->head_offset);
+		}
+		if (written <= 0) {
+			return (int)written;
+		}
+		consume_written(queue, (size_t)written);
+		pending = (size_t)written >= pending ? 0 : pending - (size_t)written;
 	}
-	queue->bottom = queue->top = queue->elements = 0;
-	pthread_mutex_unlock(&queue->mutex);
+	return 0;
 }
-
@@ -11,15 +11,37 @@
 	@date November 2013
 */
 
+/** Sends an error reply: the server's name, the numeric, the target (see `msg_add_numeric()`), an optional parameter,
+   and the error's description.
+   @param client The client to notify.
+   @param numeric The error numeric.
+   @param param The parameter that the error is about, or `NULL` if there is none.
+   @param text The error's description.
+   @param len The description's length.
+ */
+static void send_err_line(struct irc_client *client, const char *numeric, const char *param, const char *text,
+			  size_t len)
+{
+	struct msg_builder msg;
+	msg_builder_init(&msg, client);
+	msg_add_numeric(&msg, numeric);
+	if (param != NULL) {
+		msg_add_param(&msg, param);
+	}
+	msg_add_trailing(&msg, text, len);
+	msg_end_line(&msg);
+	msg_send(&msg);
+}
+
+/** Calls `send_err_line()` with a description that is a string literal. */
+#define send_err_reply(client, numeric, param, text) send_err_line((client), (numeric), (param), (text), sizeof(text) - 1)
+
 /** Sends ERR_NOTREGISTERED to a client who tried to use any command other than NICK, PASS or USER before registering.
    @param client The erratic client to notify
  */
 void send_err_notregistered(struct irc_client *client)
 {
-	char *format =
-		":%s " ERR_NOTREGISTERED " * :You have not registered\r\n";
-	yaircd_send(client, format,
-		    get_server_name());
+	send_err_reply(client, ERR_NOTREGISTERED, NULL, "You have not registered");
 }
 
 /** Sends ERR_UNKNOWNCOMMAND to a client who seems to be messing around with commands.
@@ -34,10 +56,7 @@ void send_err_notregistered(struct irc_client *client)
  */
 void send_err_unknowncommand(struct irc_client *client, char *cmd)
 {
-	char *format =
-		":%s " ERR_UNKNOWNCOMMAND " %s %s :Unknown command\r\n";
-	yaircd_send(client, format,
-		    get_server_name(), client->is_registered ? client->nick : "*", *cmd != '\0' ? cmd : "NULL_CMD");
+	send_err_reply(client, ERR_UNKNOWNCOMMAND, *cmd != '\0' ? cmd : "NULL_CMD", "Unknown command");
 }
 
 /** Sends ERR_NONICKNAMEGIVEN to a client who issued a NICK command but didn't provide a nick
@@ -45,10 +64,7 @@ void send_err_unknowncommand(struct irc_client *client, char *cmd)
  */
 void send_err_nonicknamegiven(struct irc_client *client)
 {
-	char *format =
-		":%s " ERR_NONICKNAMEGIVEN " %s :No nickname given\r\n";
-	yaircd_send(client, format,
-		    get_server_name(), client->is_registered ? client->nick : "*");
+	send_err_reply(client, ERR_NONICKNAMEGIVEN, NULL, "No nickname given");
 }
 
 /** Sends ERR_NEEDMOREPARAMS to a client who issued a command but didn't provide enough parameters for his request to be
@@ -60,10 +76,7 @@ void send_err_nonicknamegiven(struct irc_client *client)
  */
 void send_err_needmoreparams(struct irc_client *client, char *cmd)
 {
-	char *format =
-		":%s " ERR_NEEDMOREPARAMS " %s %s :Not enough parameters\r\n";
-	yaircd_send(client, format,
-		    get_server_name(), client->is_registered ? client->nick : "*", cmd);
+	send_err_reply(client, ERR_NEEDMOREPARAMS, cmd, "Not enough parameters");
 }
 
 /** Sends ERR_ERRONEUSNICKNAME to a client who issued a NICK command and chose a nickname that contains invalid
@@ -73,10 +86,7 @@ void send_err_needmoreparams(struct irc_client *client, char *cmd)
  */
 void send_err_erroneusnickname(struct irc_client *client, char *nick)
 {
-	char *format =
-		":%s " ERR_ERRONEUSNICKNAME " %s %s :Erroneous nickname\r\n";
-	yaircd_send(client, format,
-		    get_server_name(), client->is_registered ? client->nick : "*", nick);
+	send_err_reply(client, ERR_ERRONEUSNICKNAME, nick, "Erroneous nickname");
 }
 
 /** Sends ERR_NICKNAMEINUSE to a client who issued a NICK command and chose a nickname that is already in use.
@@ -85,10 +95,7 @@ void send_err_erroneusnickname(struct irc_client *client, char *nick)
  */
 void send_err_nicknameinuse(struct irc_client *client, char *nick)
 {
-	char *format =
-		":%s " ERR_NICKNAMEINUSE " %s %s :Nickname is already in use\r\n";
-	yaircd_send(client, format,
-		    get_server_name(), client->is_registered ? client->nick : "*", nick);
+	send_err_reply(client, ERR_NICKNAMEINUSE, nick, "Nickname is already in use");
 }
 
 /** Sends ERR_ALREADYREGISTRED to a client who issued a USER command even though he was already registred.
@@ -96,11 +103,7 @@ void send_err_nicknameinuse(struct irc_client *client, char *nick)
  */
 void send_err_alreadyregistred(struct irc_client *client)
 {
-	char *format =
-		":%s " ERR_ALREADYREGISTRED " %s :You may not reregister.\r\n";
-
-	yaircd_send(client, format,
-		    get_server_name(), client->nick);
+	send_err_reply(client, ERR_ALREADYREGISTRED, NULL, "You may not reregister.");
 }
 
 /** Sends ERR_NORECIPIENT to a client trying to send a message without a recipient.
@@ -109,10 +112,14 @@ void send_err_alreadyregistred(struct irc_client *client)
  */
 void send_err_norecipient(struct irc_client *client, char *cmd)
 {
-	const char *format =
-		":%s " ERR_NORECIPIENT " %s :No recipient given (%s)\r\n";
-	yaircd_send(client, format,
-		    get_server_name(), client->nick, cmd);
+	struct msg_builder msg;
+	msg_builder_init(&msg, client);
+	msg_add_numeric(&msg, ERR_NORECIPIENT);
+	msg_add_trailing_const(&msg, "No recipient given (");
+	msg_add_str(&msg, cmd);
+	msg_add_const(&msg, ")");
+	msg_end_line(&msg);
+	msg_send(&msg);
 }
 
 /** Sends ERR_NOTEXTTOSEND to a client trying to send an empty message to another client.
@@ -120,10 +127,7 @@ void send_err_norecipient(struct irc_client *client, char *cmd)
  */
 void send_err_notexttosend(struct irc_client *client)
 {
-	const char *format =
-		":%s " ERR_NOTEXTTOSEND " %s :No text to send\r\n";
-	yaircd_send(client, format,
-		    get_server_name(), client->nick);
+	send_err_reply(client, ERR_NOTEXTTOSEND, NULL, "No text to send");
 }
 
 /** Sends ERR_NOSUCHNICK to a client who supplied a nonexisting target.
@@ -132,10 +136,7 @@ void send_err_notexttosend(struct irc_client *client)
  */
 void send_err_nosuchnick(struct irc_client *client, char *nick)
 {
-	const char *format =
-		":%s " ERR_NOSUCHNICK " %s %s :No such nick/channel\r\n";
-	yaircd_send(client, format,
-		    get_server_name(), client->nick, nick);
+	send_err_reply(client, ERR_NOSUCHNICK, nick, "No such nick/channel");
 }
 
 /** Sends ERR_NOSUCHCHANNEL to a client who supplied an invalid channel name.
@@ -144,10 +145,7 @@ void send_err_nosuchnick(struct irc_client *client, char *nick)
  */
 void send_err_nosuchchannel(struct irc_client *client, char *chan)
 {
-	const char *format =
-		":%s " ERR_NOSUCHCHANNEL " %s %s :No such channel\r\n";
-	yaircd_send(client, format,
-		    get_server_name(), client->nick, chan);
+	send_err_reply(client, ERR_NOSUCHCHANNEL, chan, "No such channel");
 }
 
 /** Sends ERR_NOTONCHANNEL to a client who tried to part a channel he's not in.
@@ -156,10 +154,7 @@ void send_err_nosuchchannel(struct irc_client *client, char *chan)
  */
 void send_err_notonchannel(struct irc_client *client, char *chan)
 {
-	const char *format =
-		":%s " ERR_NOTONCHANNEL " %s %s :You're not on that channel\r\n";
-	yaircd_send(client, format,
-		    get_server_name(), client->nick, chan);
+	send_err_reply(client, ERR_NOTONCHANNEL, chan, "You're not on that channel");
 }
 
 /** Sends ERR_TOOMANYCHANNELS to a client who tried to join a channel, but already hit the max channels limit, as configured in yaircd.conf.
@@ -167,28 +162,19 @@ void send_err_notonchannel(struct irc_client *client, char *chan)
    @param chan The channel name
  */
 void send_err_toomanychannels(struct irc_client *client, char *chan) {
-	const char *format =
-		":%s " ERR_TOOMANYCHANNELS " %s %s :You have joined too many channels\r\n";
-	yaircd_send(client, format,
-		get_server_name(), client->nick, chan);
+	send_err_reply(client, ERR_TOOMANYCHANNELS, chan, "You have joined too many channels");
 }
 
 /** Sends ERR_NOORIGIN to a PONG reply from a client who didn't indicate the PING origin.
    @param client The erratic client to notify
  */
 void send_err_noorigin(struct irc_client *client) {
-	const char *format =
-		":%s " ERR_NOORIGIN " %s :No origin specified\r\n";
-	yaircd_send(client, format,
-		get_server_name(), client->nick);
+	send_err_reply(client, ERR_NOORIGIN, NULL, "No origin specified");
 }
 
 /** Sends ERR_NOMOTD to a client when there is no MOTD to display (no MOTD file exists).
    @param client The client to notify
  */
 void send_err_nomotd(struct irc_client *client) {
-	const char *format =
-		":%s " ERR_NOMOTD " %s :MOTD File is missing\r\n";
-	yaircd_send(client, format,
-		get_server_name(), client->nick);
+	send_err_reply(client, ERR_NOMOTD, NULL, "MOTD File is missing");
 }
@@ -2,6 +2,7 @@
 #include "msgio.h"
 #include "send_err.h"
 #include "send_rpl.h"
+#include "worker.h"
 
 /** @file
 	@brief Functions that send a reply to a command issued by an IRC user
@@ -12,43 +13,76 @@
 	@date November 2013
 */
 
-/** Sends MOTD to a client.
-   @param client The client to send MOTD to.
+/** Queues the MOTD replies to a client, preceded by the replies held in a builder, with a single write. The MOTD
+   replies were rendered when the MOTD was read; only the client's nickname is filled in. If there is no MOTD,
+   `ERR_NOMOTD` is sent instead.
+   @param msg A builder holding the replies that go before the MOTD, possibly none. Every line in it must have been
+      terminated. It is emptied.
  */
-void send_motd(struct irc_client *client)
+static void send_motd_after(struct msg_builder *msg)
 {
-	const char *format_begin = ":%s " RPL_MOTDSTART " %s :- %s Message of the day - \r\n";
-	const char *format_end = ":%s " RPL_ENDOFMOTD " %s :End of /MOTD command\r\n";
-	MOTD_ENTRY motd;
-	MOTD_ENTRY motd_iterator;
-	if ((motd = get_motd()) == NULL) {
+	struct irc_client *client = msg->client;
+	const struct motd_replies *motd;
+	struct shared_msg *burst;
+	size_t nick_len;
+	if ((motd = get_motd_replies()) == NULL) {
+		msg_send(msg);
 		send_err_nomotd(client);
 		return;
 	}
-	yaircd_send(client, format_begin, get_server_name(), client->nick, get_server_name());
-	motd_entry_for_each(motd, motd_iterator) {
-		yaircd_send(client, ":%s " RPL_MOTD " %s :- %s\r\n", get_server_name(), client->nick, motd_entry_line(motd_iterator));
+	nick_len = strlen(client->nick);
+	if ((burst = shared_msg_alloc(msg->len + motd_replies_length(motd, nick_len))) == NULL) {
+		terminate_session(client, NO_MEM_QUIT_MSG);
+		return;
 	}
-	yaircd_send(client, format_end, get_server_name(), client->nick);
+	memcpy(burst->text, msg->buf, msg->len);
+	motd_replies_render(motd, client->nick, nick_len, burst->text + msg->len);
+	msg_builder_init(msg, client);
+	write_shared_noerr(client, burst);
+	shared_msg_release(burst);
+}
+
+/** Sends MOTD to a client.
+   @param client The client to send MOTD to.
+ */
+void send_motd(struct irc_client *client)
+{
+	struct msg_builder msg;
+	msg_builder_init(&msg, client);
+	send_motd_after(&msg);
 }
 
-/** Sends the welcome message to a newly registred user
+/** Sends the welcome message to a newly registred user, followed by the MOTD. The whole burst is queued with a single
+   write.
    @param client The client to greet.
    @todo Make this correct to present settings properly
  */
 void send_welcome(struct irc_client *client)
 {
-	const char *format =
-		":%s " RPL_WELCOME " %s :Welcome to the Internet Relay Network %s!%s@%s\r\n"
-		":%s " RPL_YOURHOST " %s :Your host is %s, running version %s\r\n"
-		":%s " RPL_CREATED " %s :This server was created %s\r\n"
-		":%s " RPL_MYINFO " %s :%s %s %s %s\r\n";
+	struct msg_builder msg;
 
-	yaircd_send(client, format,
-		    get_server_name(), client->nick, client->nick, client->username, client->hostname,
-		    get_server_name(), client->nick, get_server_name(), YAIRCD_VERSION,
-		    get_server_name(), client->nick, __DATE__ " " __TIME__,
-		    get_server_name(), client->nick, get_server_name(), YAIRCD_VERSION, "UMODES=xTR", "CHANMODES=mvil");
+	msg_builder_init(&msg, client);
+	msg_add_numeric(&msg, RPL_WELCOME);
+	msg_add_trailing_const(&msg, "Welcome to the Internet Relay Network ");
+	msg_add_str(&msg, client->nick);
+	msg_add_const(&msg, "!");
+	msg_add_str(&msg, client->username);
+	msg_add_const(&msg, "@");
+	msg_add_str(&msg, client->hostname);
+	msg_end_line(&msg);
+	msg_add_numeric(&msg, RPL_YOURHOST);
+	msg_add_trailing_const(&msg, "Your host is ");
+	msg_add_str(&msg, get_server_name());
+	msg_add_const(&msg, ", running version " YAIRCD_VERSION);
+	msg_end_line(&msg);
+	msg_add_numeric(&msg, RPL_CREATED);
+	msg_add_trailing_const(&msg, "This server was created " __DATE__ " " __TIME__);
+	msg_end_line(&msg);
+	msg_add_numeric(&msg, RPL_MYINFO);
+	msg_add_trailing(&msg, get_server_name(), strlen(get_server_name()));
+	msg_add_const(&msg, " " YAIRCD_VERSION " UMODES=xTR CHANMODES=mvil");
+	msg_end_line(&msg);
+	send_motd_after(&msg);
 }
 
 /** Sends a generic PRIVMSG command notification to a given target. The destination can either be a channel or a user.
@@ -58,13 +92,14 @@ void send_welcome(struct irc_client *client)
    @param dest The destination of the message. If it is a private conversation, it will just be `to`'s nickname;
       otherwise, it is the channel name.
    @param msg The message to deliver.
+   @param wakeups Where to collect `to`'s worker, so that the caller wakes it up after releasing the lock that keeps `to`
+      alive. See `worker_notify()`.
  */
-void notify_privmsg(struct irc_client *from, struct irc_client *to, char *dest, char *msg)
+void notify_privmsg(struct irc_client *from, struct irc_client *to, char *dest, char *msg,
+		    struct worker_wakeups *wakeups)
 {
 	char message[MAX_MSG_SIZE + 1];
-	const char *format =
-		":%s!%s@%s PRIVMSG %s :%s\r\n";
-	cmd_print_reply(message, sizeof(message), format, from->nick, from->username, from->realname, dest, msg);
+	cmd_print_from(message, sizeof(message), from, "PRIVMSG", dest, msg);
 	client_enqueue(&to->write_queue, message);
-	ev_async_send(to->ev_loop, &to->async_watcher);
+	worker_notify(to, wakeups);
 }
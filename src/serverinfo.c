@@ -24,13 +24,40 @@
 /** How many memory to allocate initially to store MOTD line entries */
 #define INITIAL_MOTD_LINES 64
 
+/** SendQ, in bytes, used for sockets that do not name a valid connection class */
+#define DEFAULT_SENDQ 1048576
+
+/** RecvQ, in bytes, used for sockets that do not name a valid connection class */
+#define DEFAULT_RECVQ 8192
+
+/** SSL handshake timeout, in seconds, used if the timeouts block does not define one */
+#define DEFAULT_HANDSHAKE_TIMEOUT 10.0
+
+/** How many resolver threads are started if the resolver block does not say */
+#define DEFAULT_RESOLVER_THREADS 2
+
+/** How long, in seconds, a client waits for his reverse lookup if the resolver block does not say */
+#define DEFAULT_DNS_TIMEOUT 5.0
+
+/** How long, in seconds, reverse lookups are cached if the resolver block does not say */
+#define DEFAULT_DNS_CACHE_TTL 3600
+
+/** Describes a connection class. */
+struct conn_class {
+	const char *name; /**<Class name, as referenced by the sockets in the listen block. */
+	int sendq; /**<Maximum number of bytes allowed to be waiting in the output buffer of a client in this class. */
+	int recvq; /**<Size, in bytes, of the input buffer of a client in this class. */
+};
+
 /** Stores important information about a socket. */
 struct socket_info {
 	const char *ip; /**<IPv4 address where this socket will be listening. 0.0.0.0 means every IP. */
 	int port; /**<Port number. Typically, greater than 1024, since we're not running as root (I hope!) */
 	unsigned ssl : 1; /**<Bit-field indicating if it's an SSL socket. */
-	int max_hangup_clients; /**<Max. hangup clients allowed to be on hold while the parent thread dispatches a new
-	                           thread to deal with a freshly arrived connection */
+	int max_hangup_clients; /**<Max. hangup clients allowed to be on hold while the parent thread hands a freshly
+	                           arrived connection to a worker */
+	int sendq; /**<SendQ of the connection class this socket belongs to. */
+	int recvq; /**<RecvQ of the connection class this socket belongs to. */
 };
 
 /** Holds personal information about the server's administrator. */
@@ -55,9 +82,16 @@ struct server_info {
 	const char *name; /**<Server's name */
 	const char *description; /**<Description - shows up in a /WHOIS command */
 	const char *net_name; /**<Network name */
-	int socket_max_hangup_clients; /**<Max. hangup clients allowed to be on hold while the parent thread dispatches
-	                                  a new thread to deal with a freshly arrived connection */
+	int socket_max_hangup_clients; /**<Max. hangup clients allowed to be on hold while the parent thread hands a
+	                                  freshly arrived connection to a worker */
 	int chanlimit; /**<How many channels a client is allowed to sit in simultaneously */
+	int worker_threads; /**<How many worker threads serve client connections. `0` means one per online CPU core. */
+	int resolver_threads; /**<How many reverse DNS lookups may be in flight at the same time. */
+	ev_tstamp dns_timeout; /**<How long a client waits for his reverse lookup before going on with his IP address. */
+	int dns_cache_ttl; /**<How long, in seconds, reverse lookups are cached. */
+	const char *hosts_file; /**<Path to a hosts table consulted before the DNS; `NULL` if there is none. */
+	struct conn_class *classes; /**<Dynamically allocated array of connection classes. */
+	int classes_count; /**<How many elements are stored in `classes`. */
 	struct admin_info admin; /**<Server administrator info. See the documentation for `struct admin_info`. */
 	struct socket_info socket_standard; /**<Information about the standard (plaintext) socket. See the documentation
 	                                       for `struct socket_info`. */
@@ -68,8 +102,10 @@ struct server_info {
 	const char *private_key_path; /**<File path for the server's private key. */
 	ev_tstamp ping_freq; /**<If no activity is detected in a connection after `ping_freq` seconds, a PING is sent. */
 	ev_tstamp timeout; /**<If no PONG reply arrives within `timeout` seconds, the session is terminated. */
+	ev_tstamp handshake_timeout; /**<If an SSL client does not complete the handshake within `handshake_timeout` seconds, the session is terminated. */
 	char **motd; /**<Dynamically allocated array holding MOTD entries for this server. This array is terminated with a NULL pointer. Each entry is a pointer to a null terminated
 					 characters sequence with a MOTD entry without any newline character. */
+	struct motd_replies *motd_replies; /**<The MOTD replies, rendered from `motd`. `NULL` if there is no MOTD. */
 };
 
 /** Global server info structure holding every meta information about the IRCd. */
@@ -159,6 +195,155 @@ MOTD_ENTRY read_motd_file(config_t *cfg) {
 	return motd;
 }
 
+/** Appends a characters sequence to a buffer.
+	@param dst Where to append.
+	@param src What to append. It need not be null terminated.
+	@param len How many characters to append.
+	@return A pointer to the position right after the appended characters.
+*/
+static char *append(char *dst, const char *src, size_t len)
+{
+	memcpy(dst, src, len);
+	return dst + len;
+}
+
+/** Renders the MOTD replies once, so that they can be sent to each client with a couple of `memcpy()` calls per line.
+	Every line begins with the server's name and the numeric, and ends with CR LF. The rendered text is split right before the place where each line's target goes.
+	@param motd The MOTD, as returned by `read_motd_file()`.
+	@return The rendered replies, or `NULL` if there's no memory.
+*/
+static struct motd_replies *render_motd(MOTD_ENTRY motd)
+{
+	static const char start[] = " Message of the day - \r\n";
+	static const char end[] = " :End of /MOTD command\r\n";
+	struct motd_replies *replies;
+	MOTD_ENTRY motd_iterator;
+	size_t name_len;
+	size_t head_len;
+	size_t size;
+	char *pos;
+	int lines;
+	int i;
+
+	/* Each line begins with ":<server> <numeric> ", and each RPL_MOTD ends with " :- <line>\r\n" */
+	name_len = strlen(info->name);
+	head_len = name_len + 6;
+	lines = 0;
+	size = head_len + 4 + name_len + sizeof(start) - 1 + head_len + sizeof(end) - 1;
+	motd_entry_for_each(motd, motd_iterator) {
+		size += head_len + 4 + strlen(motd_entry_line(motd_iterator)) + 2;
+		lines++;
+	}
+	if ((replies = malloc(sizeof(*replies))) == NULL) {
+		return NULL;
+	}
+	replies->pieces = lines + 3;
+	if ((replies->text = malloc(size)) == NULL ||
+	    (replies->ends = malloc(replies->pieces * sizeof(*replies->ends))) == NULL) {
+		free(replies->text);
+		free(replies);
+		return NULL;
+	}
+	pos = replies->text;
+	i = 0;
+	pos = append(pos, ":", 1);
+	pos = append(pos, info->name, name_len);
+	pos = append(pos, " " RPL_MOTDSTART " ", 5);
+	replies->ends[i++] = pos - replies->text;
+	pos = append(pos, " :- ", 4);
+	pos = append(pos, info->name, name_len);
+	pos = append(pos, start, sizeof(start) - 1);
+	motd_entry_for_each(motd, motd_iterator) {
+		pos = append(pos, ":", 1);
+		pos = append(pos, info->name, name_len);
+		pos = append(pos, " " RPL_MOTD " ", 5);
+		replies->ends[i++] = pos - replies->text;
+		pos = append(pos, " :- ", 4);
+		pos = append(pos, motd_entry_line(motd_iterator), strlen(motd_entry_line(motd_iterator)));
+		pos = append(pos, "\r\n", 2);
+	}
+	pos = append(pos, ":", 1);
+	pos = append(pos, info->name, name_len);
+	pos = append(pos, " " RPL_ENDOFMOTD " ", 5);
+	replies->ends[i++] = pos - replies->text;
+	pos = append(pos, end, sizeof(end) - 1);
+	replies->ends[i] = pos - replies->text;
+	return replies;
+}
+
+/** Reads every connection class defined in the classes block into `info->classes`.
+	Classes without a name are ignored. A class without a `sendq` setting gets `DEFAULT_SENDQ`, and a class without a
+	`recvq` setting gets `DEFAULT_RECVQ`. So does a class with a setting that is not positive, with a warning: a SendQ of
+	`0` would evict every client on its first reply.
+	@param cfg libconfig's configuration structure in use
+	@return `0` on success; `1` if there's no memory to store the classes.
+*/
+static int read_conn_classes(config_t *cfg)
+{
+	config_setting_t *list;
+	config_setting_t *entry;
+	int count;
+	int i;
+
+	info->classes = NULL;
+	info->classes_count = 0;
+	if ((list = config_lookup(cfg, "classes")) == NULL || (count = config_setting_length(list)) == 0) {
+		return 0;
+	}
+	if ((info->classes = malloc(count * sizeof(*info->classes))) == NULL) {
+		fprintf(stderr, "::serverinfo.c:read_conn_classes(): Could not allocate memory.\n");
+		return 1;
+	}
+	for (i = 0; i < count; i++) {
+		entry = config_setting_get_elem(list, (unsigned int) i);
+		if (config_setting_lookup_string(entry, "name", &(info->classes[info->classes_count].name)) == CONFIG_FALSE) {
+			fprintf(stderr, "::serverinfo.c:read_conn_classes(): Ignoring connection class #%d without a name.\n", i);
+			continue;
+		}
+		if (config_setting_lookup_int(entry, "sendq", &(info->classes[info->classes_count].sendq)) == CONFIG_FALSE) {
+			info->classes[info->classes_count].sendq = DEFAULT_SENDQ;
+		} else if (info->classes[info->classes_count].sendq <= 0) {
+			fprintf(stderr, "::serverinfo.c:read_conn_classes(): Invalid sendq in class %s; using %d.\n",
+				info->classes[info->classes_count].name, DEFAULT_SENDQ);
+			info->classes[info->classes_count].sendq = DEFAULT_SENDQ;
+		}
+		if (config_setting_lookup_int(entry, "recvq", &(info->classes[info->classes_count].recvq)) == CONFIG_FALSE) {
+			info->classes[info->classes_count].recvq = DEFAULT_RECVQ;
+		} else if (info->classes[info->classes_count].recvq <= 0) {
+			fprintf(stderr, "::serverinfo.c:read_conn_classes(): Invalid recvq in class %s; using %d.\n",
+				info->classes[info->classes_count].name, DEFAULT_RECVQ);
+			info->classes[info->classes_count].recvq = DEFAULT_RECVQ;
+		}
+		info->classes_count++;
+	}
+	return 0;
+}
+
+/** Sets a socket's SendQ and RecvQ from the connection class it refers to.
+	@param setting The socket's configuration block.
+	@param socket The socket. Its `sendq` and `recvq` are those of the class named in the socket's `class` setting. If
+	the socket does not name a class, or if no such class exists, `DEFAULT_SENDQ` and `DEFAULT_RECVQ` are used.
+*/
+static void socket_class(config_setting_t *setting, struct socket_info *socket)
+{
+	const char *class_name;
+	int i;
+	socket->sendq = DEFAULT_SENDQ;
+	socket->recvq = DEFAULT_RECVQ;
+	if (config_setting_lookup_string(setting, "class", &class_name) == CONFIG_FALSE) {
+		return;
+	}
+	for (i = 0; i < info->classes_count; i++) {
+		if (strcmp(info->classes[i].name, class_name) == 0) {
+			socket->sendq = info->classes[i].sendq;
+			socket->recvq = info->classes[i].recvq;
+			return;
+		}
+	}
+	fprintf(stderr, "::serverinfo.c:socket_class(): Unknown connection class %s, using default SendQ and RecvQ.\n",
+		class_name);
+}
+
 /**
    Using libconfig, this function creates and populates a `struct server_info` which is going to hold information about
       the chosen configuration for this server. If one changes CONFIG_FILE content, this is the only function, that one
@@ -172,6 +357,8 @@ int loadServerInfo(void)
 {
 	double ping_freq;
 	double timeout;
+	double handshake_timeout;
+	double dns_timeout;
 	config_setting_t *setting;
 	config_init(&cfg);
 
@@ -221,12 +408,22 @@ int loadServerInfo(void)
 	config_setting_lookup_float(setting, "timeout", &timeout);
 	info->ping_freq = ping_freq;
 	info->timeout = timeout;
+	if (config_setting_lookup_float(setting, "handshake", &handshake_timeout) == CONFIG_FALSE) {
+		handshake_timeout = DEFAULT_HANDSHAKE_TIMEOUT;
+	}
+	info->handshake_timeout = handshake_timeout;
 	
+	/* Connection classes. These must be read before the sockets that refer to them */
+	if (read_conn_classes(&cfg) != 0) {
+		return 1;
+	}
+
 	/* Standard socket info */
 	setting = config_lookup(&cfg, "listen.sockets.standard");
 	config_setting_lookup_int(setting, "port", &(info->socket_standard.port));
 	config_setting_lookup_int(setting, "max_hangup_clients", &(info->socket_standard.max_hangup_clients));
 	config_setting_lookup_string(setting, "ip", &(info->socket_standard.ip));
+	socket_class(setting, &info->socket_standard);
 	info->socket_standard.ssl = 0;
 
 	/* Secure socket info */
@@ -234,14 +431,41 @@ int loadServerInfo(void)
 	config_setting_lookup_int(setting, "port", &(info->socket_secure.port));
 	config_setting_lookup_int(setting, "max_hangup_clients", &(info->socket_secure.max_hangup_clients));
 	config_setting_lookup_string(setting, "ip", &(info->socket_secure.ip));
+	socket_class(setting, &info->socket_secure);
 	info->socket_secure.ssl = 1;
 	
 	/* Channel block */
 	setting = config_lookup(&cfg, "channels");
 	config_setting_lookup_int(setting, "chanlimit", &(info->chanlimit));
 	
+	/* Workers block. This block is optional; a missing setting leaves the default value untouched */
+	info->worker_threads = 0;
+	setting = config_lookup(&cfg, "workers");
+	if (setting != NULL) {
+		config_setting_lookup_int(setting, "threads", &(info->worker_threads));
+	}
+	
+	/* Resolver block. Optional as well */
+	info->resolver_threads = DEFAULT_RESOLVER_THREADS;
+	info->dns_timeout = DEFAULT_DNS_TIMEOUT;
+	info->dns_cache_ttl = DEFAULT_DNS_CACHE_TTL;
+	info->hosts_file = NULL;
+	setting = config_lookup(&cfg, "resolver");
+	if (setting != NULL) {
+		config_setting_lookup_int(setting, "threads", &(info->resolver_threads));
+		if (config_setting_lookup_float(setting, "timeout", &dns_timeout) == CONFIG_TRUE) {
+			info->dns_timeout = dns_timeout;
+		}
+		config_setting_lookup_int(setting, "cache_ttl", &(info->dns_cache_ttl));
+		config_setting_lookup_string(setting, "hosts", &(info->hosts_file));
+	}
+	
 	/* Read and store MOTD file */
 	info->motd = read_motd_file(&cfg);
+	info->motd_replies = NULL;
+	if (info->motd != NULL && (info->motd_replies = render_motd(info->motd)) == NULL) {
+		fprintf(stderr, "::serverinfo.c:loadServerInfo(): Not enough memory to render the MOTD.\n");
+	}
 	
 	return 0;
 }
@@ -310,6 +534,38 @@ int get_ssl_socket_hangup(void)
 	return info->socket_secure.max_hangup_clients;
 }
 
+/** Reads the SendQ for clients connecting through the standard socket.
+   @return Max. bytes allowed in the output buffer of a client connected through this socket.
+ */
+int get_std_socket_sendq(void)
+{
+	return info->socket_standard.sendq;
+}
+
+/** Reads the SendQ for clients connecting through the secure socket.
+   @return Max. bytes allowed in the output buffer of a client connected through this socket.
+ */
+int get_ssl_socket_sendq(void)
+{
+	return info->socket_secure.sendq;
+}
+
+/** Reads the RecvQ for clients connecting through the standard socket.
+   @return Size, in bytes, of the input buffer of a client connected through this socket.
+ */
+int get_std_socket_recvq(void)
+{
+	return info->socket_standard.recvq;
+}
+
+/** Reads the RecvQ for clients connecting through the secure socket.
+   @return Size, in bytes, of the input buffer of a client connected through this socket.
+ */
+int get_ssl_socket_recvq(void)
+{
+	return info->socket_secure.recvq;
+}
+
 /** Reads the server's certificate file path.
    @return Pointer to null terminated characters sequence with the server's certificate file path.
  */
@@ -360,6 +616,42 @@ int get_chanlimit(void) {
 	return info->chanlimit;
 }
 
+/** Reads how many worker threads shall be started to serve client connections.
+	@return The configured number of worker threads. `0` (or a negative value) means that the number of workers
+	shall match the number of online CPU cores.
+*/
+int get_worker_threads(void) {
+	return info->worker_threads;
+}
+
+/** Reads how many resolver threads shall be started.
+	@return How many reverse DNS lookups may be in flight at the same time.
+*/
+int get_resolver_threads(void) {
+	return info->resolver_threads;
+}
+
+/** Reads how long a client waits for his reverse DNS lookup.
+	@return DNS timeout, in seconds. When it expires, the client goes on with his IP address.
+*/
+ev_tstamp get_dns_timeout(void) {
+	return info->dns_timeout;
+}
+
+/** Reads how long reverse DNS lookups are cached.
+	@return Cache TTL, in seconds.
+*/
+int get_dns_cache_ttl(void) {
+	return info->dns_cache_ttl;
+}
+
+/** Reads the path to the hosts table consulted before the DNS.
+	@return Path to the hosts file; `NULL` if none was configured.
+*/
+const char *get_hosts_file(void) {
+	return info->hosts_file;
+}
+
 /** Reads the ping frequency for this server.
 	@return Ping frequency
 */
@@ -375,6 +667,14 @@ ev_tstamp get_timeout(void) {
 	return info->timeout;
 }
 
+/** Reads the SSL handshake timeout for this server.
+	SSL clients that do not complete the handshake within this amount of time are disconnected.
+	@return Handshake timeout value
+*/
+ev_tstamp get_handshake_timeout(void) {
+	return info->handshake_timeout;
+}
+
 /** Reads the previously stored MOTD information.
 	@return a `MOTD_ENTRY` instance that shall be iterated with the use of `motd_entry_for_each()`.
 			  To get the corresponding line stored in a `MOTD_ENTRY`, use `motd_entry_line()`.
@@ -383,3 +683,37 @@ ev_tstamp get_timeout(void) {
 MOTD_ENTRY get_motd(void) {
 	return info->motd;
 }
+
+/** Reads the MOTD replies, rendered when the MOTD was read.
+	@return The MOTD replies, or `NULL` if there is no MOTD.
+*/
+const struct motd_replies *get_motd_replies(void) {
+	return info->motd_replies;
+}
+
+/** Tells how long the MOTD replies are for a given client.
+	@param motd The MOTD replies.
+	@param nick_len Length of the client's nickname.
+	@return How many characters `motd_replies_render()` writes.
+*/
+size_t motd_replies_length(const struct motd_replies *motd, size_t nick_len) {
+	return motd->ends[motd->pieces - 1] + (motd->pieces - 1) * nick_len;
+}
+
+/** Writes the MOTD replies for a given client: each piece, followed by the client's nickname, except for the last piece.
+	@param motd The MOTD replies.
+	@param nick The client's nickname. It need not be null terminated.
+	@param nick_len Length of the client's nickname.
+	@param buf Where to write. Must have room for `motd_replies_length()` characters; no null terminator is written.
+*/
+void motd_replies_render(const struct motd_replies *motd, const char *nick, size_t nick_len, char *buf) {
+	size_t begin;
+	int i;
+	begin = 0;
+	for (i = 0; i < motd->pieces - 1; i++) {
+		buf = append(buf, motd->text + begin, motd->ends[i] - begin);
+		buf = append(buf, nick, nick_len);
+		begin = motd->ends[i];
+	}
+	(void)append(buf, motd->text + begin, motd->ends[i] - begin);
+}
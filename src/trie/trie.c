@@ -9,17 +9,31 @@
       channels list, and any other list of strings)
    It allows client code (by client we mean "the code that uses this") to define which characters are allowed inside a
       word.
-   Client code is required to provide functions that convert a letter into a position (ID) and a position back into a
-      letter. IDs must be unique, consecutive, and start at 0; there can be no gapsin the sequence, because IDs are used
-      to index an array. So, for example, to allow an alphabet which consists of the characters `[a-z]` and `[0-9]`,
-      client code must find a mapping which converts any of these characters into an integer `i` such that `i >= 0 && i
-      <= 35` (26 letters for the alphabet and 10 digits).
+   Client code is required to describe an alphabet that converts a letter into a position (ID) and a position back
+      into a letter. IDs must be unique, consecutive, and start at 0; there can be no gapsin the sequence, and there can
+      be at most 256 of them, because IDs are used as the keys of each node's children. So, for example, to allow an
+      alphabet which consists of the characters `[a-z]` and `[0-9]`, client code must find a mapping which converts any
+      of these characters into an integer `i` such that `i >= 0 && i <= 35` (26 letters for the alphabet and 10
+      digits).
    One possible mapping would be to map any letter `c` in `[a-z]` to `c - &lsquo;a&rsquo;` and any number `i` in `[0-9]`
       to `&lsquo;z&rsquo; + i - &lsquo;0&rsquo;`.
    Please refer to http://en.wikipedia.org/wiki/Trie if you are not sure how a trie works. It always guarantees `O(n)`
       insertion, deletion and search time, where `n` is the size of the word. When compared to hash tables,it is a good
       alternative, since hash tables provide `O(1)` access, but normally take about `O(n)` time to compute the hash
       function, and there can be collisions.
+   The trie is an adaptive radix tree (see `struct trie_node`). Inner nodes come in 4 sizes:
+   <ul>
+   <li>`TRIE_NODE4` and `TRIE_NODE16` keep their children's keys in a sorted array, with the children in a parallel
+      array;</li>
+   <li>`TRIE_NODE48` maps every possible key to a slot in an array of 48 children through a 256 bytes index, where `0`
+      means there is no child;</li>
+   <li>`TRIE_NODE256` is indexed directly by the key.</li>
+   </ul>
+   A node grows into the next size when it is full and a child is added, and shrinks into the previous size when
+      enough children were removed that they fit comfortably in a smaller node. Nodes that end up with no children are
+      turned into leaves, which store nothing but the node header.
+   Inner nodes holding no word and a single child are merged into the child whenever the compressed path fits in the
+      child; when a path is too long, a chain of nodes is used instead.
    @author Filipe Goncalves
    @date November 2013
    @see client_list.c
@@ -28,79 +42,434 @@
    Upper caller needs to make the necessary use of mutexes or other synchronization primitives.
  */
 
-/** Initializes a new trie node with no children and no edges.
-   @param edges Number of edges (alphabet size)
+/** A node with up to 4 children. `keys` is sorted, and `child[i]` is the child for `keys[i]`. */
+struct trie_node4 {
+	struct trie_node header; /**<Node header */
+	unsigned char keys[4]; /**<Children keys */
+	struct trie_node *child[4]; /**<Children */
+};
+
+/** A node with up to 16 children. `keys` is sorted, and `child[i]` is the child for `keys[i]`. */
+struct trie_node16 {
+	struct trie_node header; /**<Node header */
+	unsigned char keys[16]; /**<Children keys */
+	struct trie_node *child[16]; /**<Children */
+};
+
+/** A node with up to 48 children. The child for key `k` is `child[index[k]-1]`, unless `index[k]` is `0`. */
+struct trie_node48 {
+	struct trie_node header; /**<Node header */
+	unsigned char index[256]; /**<Slot of each key's child, plus one */
+	struct trie_node *child[48]; /**<Children. Slots that are not in use are `NULL`. */
+};
+
+/** A node with room for every key. The child for key `k` is `child[k]`. */
+struct trie_node256 {
+	struct trie_node header; /**<Node header */
+	struct trie_node *child[256]; /**<Children, indexed by key */
+};
+
+/** Size of each kind of node, indexed by type */
+static const size_t node_size[] = {
+	sizeof(struct trie_node), sizeof(struct trie_node4), sizeof(struct trie_node16), sizeof(struct trie_node48),
+	sizeof(struct trie_node256)
+};
+
+/** How many children each kind of node can hold, indexed by type */
+static const int node_capacity[] = { 0, 4, 16, 48, 256 };
+
+/** When a node holds this many children or less, it is shrunk into the previous size, indexed by type. There is some
+   slack between the capacity of the smaller node and this number, so that a node does not flip between sizes when a
+   child is repeatedly added and removed.
+ */
+static const int node_shrink_at[] = { -1, 0, 3, 12, 37 };
+
+/** How many nodes the first chunk of a slab holds. See `struct trie_slab`. */
+#define TRIE_SLAB_MIN_NODES 4
+
+/** Max. size of a chunk, in bytes. A chunk always holds at least one node, even if that exceeds this size. */
+#define TRIE_SLAB_MAX_CHUNK 65536
+
+/** The header of a chunk. Nodes are stored right after it. */
+struct trie_chunk {
+	struct trie_chunk *next; /**<Next chunk owned by the same trie */
+	void *align; /**<Not used; pads the header so that nodes are suitably aligned */
+};
+
+/** Takes a node from a trie's slab. Freed nodes are reused first; otherwise, the node is carved from the current chunk
+   of the slab. A new chunk, twice as big as the previous one, is allocated if the current chunk is used up.
+   @param trie The trie.
+   @param type Which kind of node to allocate.
+   @return Uninitialized memory for the new node, or `NULL` if a new chunk was needed and could not be allocated.
+ */
+static void *slab_alloc(struct trie_t *trie, unsigned char type)
+{
+	struct trie_slab *slab;
+	struct trie_chunk *chunk;
+	void *node;
+
+	slab = &trie->slabs[type];
+	if ((node = slab->free_list) != NULL) {
+		slab->free_list = *(void**)node;
+		slab->free--;
+	} else {
+		if (slab->next == slab->end) {
+			if ((chunk = malloc(sizeof(*chunk) + slab->chunk_nodes * node_size[type])) == NULL) {
+				return NULL;
+			}
+			chunk->next = trie->chunks;
+			trie->chunks = chunk;
+			slab->bytes += sizeof(*chunk) + slab->chunk_nodes * node_size[type];
+			slab->next = (char*)(chunk + 1);
+			slab->end = slab->next + slab->chunk_nodes * node_size[type];
+			if ((slab->chunk_nodes + slab->chunk_nodes) * node_size[type] <= TRIE_SLAB_MAX_CHUNK) {
+				slab->chunk_nodes += slab->chunk_nodes;
+			}
+		}
+		node = slab->next;
+		slab->next += node_size[type];
+	}
+	slab->live++;
+	return node;
+}
+
+/** Converts a character into its position.
+   @param trie The trie.
+   @param c The character.
+   @return `c`'s position in the trie's alphabet, or `TRIE_INVALID_POS` if `c` is not part of the alphabet. The null
+      character is never part of an alphabet.
+ */
+static inline int char_pos(const struct trie_t *trie, char c)
+{
+	return trie->alphabet->pos[(unsigned char)c];
+}
+
+/** Allocates a new node with no word, no compressed path and no children.
+   @param trie The trie that will hold the node.
+   @param type Which kind of node to allocate.
    @return The new node, or `NULL` if there are no resources to create a node.
  */
-static struct trie_node *init_node(int edges)
+static struct trie_node *alloc_node(struct trie_t *trie, unsigned char type)
 {
-	int i;
-	struct trie_node *new_node;
-	if ((new_node = malloc(sizeof(struct trie_node))) == NULL) {
+	struct trie_node *node;
+	if ((node = slab_alloc(trie, type)) == NULL) {
 		return NULL;
 	}
-	new_node->is_word = 0;
-	new_node->children = 0;
-	new_node->data = NULL;
-	if ((new_node->edges = malloc(sizeof(*new_node->edges) * edges)) == NULL) {
-		free(new_node);
+	node->type = type;
+	node->is_word = 0;
+	node->prefix_len = 0;
+	node->children = 0;
+	node->data = NULL;
+	if (type == TRIE_NODE48) {
+		memset(((struct trie_node48*)node)->index, 0, sizeof(((struct trie_node48*)node)->index));
+		memset(((struct trie_node48*)node)->child, 0, sizeof(((struct trie_node48*)node)->child));
+	} else if (type == TRIE_NODE256) {
+		memset(((struct trie_node256*)node)->child, 0, sizeof(((struct trie_node256*)node)->child));
+	}
+	return node;
+}
+
+/** Frees a single node, returning it to its slab. Its children, if any, are not touched.
+   @param trie The trie that holds the node.
+   @param node The node to free.
+ */
+static inline void free_node(struct trie_t *trie, struct trie_node *node)
+{
+	struct trie_slab *slab;
+	slab = &trie->slabs[node->type];
+	*(void**)node = slab->free_list;
+	slab->free_list = node;
+	slab->live--;
+	slab->free++;
+}
+
+/** Looks for a key in a sorted keys array.
+   @param keys The keys.
+   @param count How many keys are in `keys`.
+   @param key The key to look for.
+   @return Index of `key` in `keys`, or `-1` if it is not there.
+ */
+static inline int find_key(const unsigned char *keys, int count, unsigned char key)
+{
+	int i;
+	for (i = 0; i < count && keys[i] <= key; i++) {
+		if (keys[i] == key) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/** Finds a node's child.
+   @param node The node.
+   @param key The child's key, that is, the position of the character leading to it.
+   @return Pointer to the place where the child is stored in `node`, or `NULL` if there is no such child. Storing a new
+      pointer through the returned value replaces the child.
+ */
+static struct trie_node **find_child(struct trie_node *node, unsigned char key)
+{
+	int i;
+	switch (node->type) {
+	case TRIE_NODE4:
+		if ((i = find_key(((struct trie_node4*)node)->keys, node->children, key)) != -1) {
+			return &((struct trie_node4*)node)->child[i];
+		}
+		break;
+	case TRIE_NODE16:
+		if ((i = find_key(((struct trie_node16*)node)->keys, node->children, key)) != -1) {
+			return &((struct trie_node16*)node)->child[i];
+		}
+		break;
+	case TRIE_NODE48:
+		if ((i = ((struct trie_node48*)node)->index[key]) != 0) {
+			return &((struct trie_node48*)node)->child[i - 1];
+		}
+		break;
+	case TRIE_NODE256:
+		if (((struct trie_node256*)node)->child[key] != NULL) {
+			return &((struct trie_node256*)node)->child[key];
+		}
+		break;
+	}
+	return NULL;
+}
+
+/** Iterates through a node's children in ascending key order.
+   @param node The node.
+   @param cursor Iteration state. Must be `0` in the first call, and must not be touched by the caller between calls.
+   @param key Where to store the key of the child returned.
+   @return The next child, or `NULL` if there are no more children.
+ */
+static struct trie_node *next_child(struct trie_node *node, int *cursor, unsigned char *key)
+{
+	struct trie_node48 *n48;
+	struct trie_node256 *n256;
+	int i;
+	switch (node->type) {
+	case TRIE_NODE4:
+		if (*cursor < node->children) {
+			i = (*cursor)++;
+			*key = ((struct trie_node4*)node)->keys[i];
+			return ((struct trie_node4*)node)->child[i];
+		}
+		break;
+	case TRIE_NODE16:
+		if (*cursor < node->children) {
+			i = (*cursor)++;
+			*key = ((struct trie_node16*)node)->keys[i];
+			return ((struct trie_node16*)node)->child[i];
+		}
+		break;
+	case TRIE_NODE48:
+		n48 = (struct trie_node48*)node;
+		for (i = *cursor; i < 256; i++) {
+			if (n48->index[i] != 0) {
+				*cursor = i + 1;
+				*key = (unsigned char)i;
+				return n48->child[n48->index[i] - 1];
+			}
+		}
+		*cursor = 256;
+		break;
+	case TRIE_NODE256:
+		n256 = (struct trie_node256*)node;
+		for (i = *cursor; i < 256; i++) {
+			if (n256->child[i] != NULL) {
+				*cursor = i + 1;
+				*key = (unsigned char)i;
+				return n256->child[i];
+			}
+		}
+		*cursor = 256;
+		break;
+	}
+	return NULL;
+}
+
+/** Copies a node into a new node of another size. Every child is moved to the new node. The old node is left
+   untouched.
+   @param trie The trie that holds the node.
+   @param node The node to copy.
+   @param type The new node's type. It must have room for every child of `node`.
+   @return The new node, or `NULL` if there are no resources to create it.
+ */
+static struct trie_node *resize_node(struct trie_t *trie, struct trie_node *node, unsigned char type)
+{
+	struct trie_node *new_node;
+	struct trie_node *child;
+	unsigned char key;
+	int cursor;
+	int i;
+
+	if ((new_node = alloc_node(trie, type)) == NULL) {
 		return NULL;
 	}
-	for (i = 0; i < edges; i++) {
-		new_node->edges[i] = NULL;
+	new_node->is_word = node->is_word;
+	new_node->prefix_len = node->prefix_len;
+	memcpy(new_node->prefix, node->prefix, node->prefix_len);
+	new_node->children = node->children;
+	new_node->data = node->data;
+	for (cursor = 0, i = 0; (child = next_child(node, &cursor, &key)) != NULL; i++) {
+		switch (type) {
+		case TRIE_NODE4:
+			((struct trie_node4*)new_node)->keys[i] = key;
+			((struct trie_node4*)new_node)->child[i] = child;
+			break;
+		case TRIE_NODE16:
+			((struct trie_node16*)new_node)->keys[i] = key;
+			((struct trie_node16*)new_node)->child[i] = child;
+			break;
+		case TRIE_NODE48:
+			((struct trie_node48*)new_node)->index[key] = (unsigned char)(i + 1);
+			((struct trie_node48*)new_node)->child[i] = child;
+			break;
+		case TRIE_NODE256:
+			((struct trie_node256*)new_node)->child[key] = child;
+			break;
+		}
 	}
 	return new_node;
 }
 
-/** Creates a new trie.
-   @param free_function Pointer to function that is called inside `destroy_trie()` to free a node's `data`
-   @param is_valid Pointer to function that returns `1` if a char is part of this trie's alphabet; `0` otherwise
-   @param pos_to_char Pointer to function that converts an index position from `edges` back to its character
-      representation.
-   @param char_to_pos Pointer to function that converts a character `s` into a valid, unique position that is used to
-      index `edges`.
-   @param edges How many edges each node is allowed to have, that is, the size of this trie's alphabet.
-   @return A new trie instance with no words, or `NULL` if there isn't enough memory to create a trie.
+/** Adds a child to a node. If the node is full, it is replaced by a bigger node.
+   @param trie The trie that holds the node.
+   @param ref Where the node is stored. If the node is replaced, the new node is stored here.
+   @param key The new child's key. `(*ref)` must not have a child with this key.
+   @param child The new child.
+   @return `0` on success; `-1` if the node had to grow, but there are no resources to do so. In this case, nothing was
+      changed.
  */
-struct trie_t *init_trie(void (*free_function)(void *, void *), int (*is_valid)(char),
-			 char (*pos_to_char)(int), int (*char_to_pos)(char), int edges)
+static int add_child(struct trie_t *trie, struct trie_node **ref, unsigned char key, struct trie_node *child)
 {
-	struct trie_t *trie;
-	if ((trie = malloc(sizeof(struct trie_t))) == NULL) {
-		return NULL;
+	struct trie_node *node;
+	struct trie_node *bigger;
+	unsigned char *keys;
+	struct trie_node **children;
+	struct trie_node48 *n48;
+	int i;
+
+	node = *ref;
+	if (node->children == node_capacity[node->type]) {
+		if ((bigger = resize_node(trie, node, node->type + 1)) == NULL) {
+			return -1;
+		}
+		free_node(trie, node);
+		*ref = node = bigger;
 	}
-	if ((trie->root = init_node(edges)) == NULL) {
-		free(trie);
-		return NULL;
+	switch (node->type) {
+	case TRIE_NODE4:
+	case TRIE_NODE16:
+		if (node->type == TRIE_NODE4) {
+			keys = ((struct trie_node4*)node)->keys;
+			children = ((struct trie_node4*)node)->child;
+		} else {
+			keys = ((struct trie_node16*)node)->keys;
+			children = ((struct trie_node16*)node)->child;
+		}
+		for (i = node->children; i > 0 && keys[i - 1] > key; i--) {
+			keys[i] = keys[i - 1];
+			children[i] = children[i - 1];
+		}
+		keys[i] = key;
+		children[i] = child;
+		break;
+	case TRIE_NODE48:
+		n48 = (struct trie_node48*)node;
+		for (i = 0; n48->child[i] != NULL; i++)
+			; /* There is a free slot, since the node is not full */
+		n48->child[i] = child;
+		n48->index[key] = (unsigned char)(i + 1);
+		break;
+	case TRIE_NODE256:
+		((struct trie_node256*)node)->child[key] = child;
+		break;
 	}
-	trie->free_f = free_function;
-	trie->is_valid = is_valid;
-	trie->pos_to_char = pos_to_char;
-	trie->char_to_pos = char_to_pos;
-	trie->edges_no = edges;
-	return trie;
+	node->children++;
+	return 0;
 }
 
-/** Frees a node's child. After returning, ensures that `node->edges[pos] == NULL` and that every resource previously
-   allocated was freed.
-   @param node Node that contains the child to free
-   @param pos Which child to free
-   @warning Assumes that `node->edges[pos]` is not `NULL`.
-   @warning This function is not recursive. If the node in `node->edges[pos]` references other nodes, these references
-      will be lost and there is a memory leak.
+/** Removes a child from a node. The child itself is not freed. If the node gets sparse enough, it is replaced by a
+   smaller node, unless there are no resources to create it, in which case the node is kept as it is.
+   @param trie The trie that holds the node.
+   @param ref Where the node is stored. If the node is replaced, the new node is stored here.
+   @param key The key of the child to remove. The child must exist.
  */
-static inline void free_child(struct trie_node *node, unsigned char pos)
+static void remove_child(struct trie_t *trie, struct trie_node **ref, unsigned char key)
 {
-	free(node->edges[pos]->edges);
-	free(node->edges[pos]);
-	node->edges[pos] = NULL;
+	struct trie_node *node;
+	struct trie_node *smaller;
+	unsigned char *keys;
+	struct trie_node **children;
+	struct trie_node48 *n48;
+	int i;
+
+	node = *ref;
+	switch (node->type) {
+	case TRIE_NODE4:
+	case TRIE_NODE16:
+		if (node->type == TRIE_NODE4) {
+			keys = ((struct trie_node4*)node)->keys;
+			children = ((struct trie_node4*)node)->child;
+		} else {
+			keys = ((struct trie_node16*)node)->keys;
+			children = ((struct trie_node16*)node)->child;
+		}
+		for (i = find_key(keys, node->children, key); i < node->children - 1; i++) {
+			keys[i] = keys[i + 1];
+			children[i] = children[i + 1];
+		}
+		break;
+	case TRIE_NODE48:
+		n48 = (struct trie_node48*)node;
+		n48->child[n48->index[key] - 1] = NULL;
+		n48->index[key] = 0;
+		break;
+	case TRIE_NODE256:
+		((struct trie_node256*)node)->child[key] = NULL;
+		break;
+	}
 	node->children--;
+	if (node->children <= node_shrink_at[node->type] && (smaller = resize_node(trie, node, node->type - 1)) != NULL) {
+		free_node(trie, node);
+		*ref = smaller;
+	}
+}
+
+/** Merges a node with its only child, if the node holds no word and the resulting compressed path fits in the child.
+   @param trie The trie that holds the node.
+   @param ref Where the node is stored. If the node is merged, its child is stored here instead.
+ */
+static void try_merge(struct trie_t *trie, struct trie_node **ref)
+{
+	struct trie_node *node;
+	struct trie_node *child;
+	unsigned char prefix[TRIE_MAX_PREFIX];
+	unsigned char key;
+	int cursor;
+	int len;
+
+	node = *ref;
+	if (node->is_word || node->children != 1) {
+		return;
+	}
+	cursor = 0;
+	child = next_child(node, &cursor, &key);
+	if ((len = node->prefix_len + 1 + child->prefix_len) > TRIE_MAX_PREFIX) {
+		return;
+	}
+	memcpy(prefix, node->prefix, node->prefix_len);
+	prefix[node->prefix_len] = key;
+	memcpy(prefix + node->prefix_len + 1, child->prefix, child->prefix_len);
+	memcpy(child->prefix, prefix, len);
+	child->prefix_len = (unsigned char)len;
+	free_node(trie, node);
+	*ref = child;
 }
 
 /** Recursively frees every node reachable from `node`.
    @param node The top node (in the beginning, most likely the root node).
    @param trie A trie, as returned by `init_trie()`.
-   @param free_data `TRIE_FREE_DATA` if the free function stored in `trie` shall be used to free each node's data,
+   @param free_data `TRIE_FREE_DATA` if the free function stored in `trie` shall be used to free each word's data,
       `TRIE_NO_FREE_DATA` otherwise
    @param args A pointer to a generic data type that will be passed as the second argument to this trie's node data
       freeing function, as defined in `init_trie()`, if `TRIE_FREE_DATA` is set.  This can be `NULL`. The first
@@ -108,22 +477,137 @@ static inline void free_child(struct trie_node *node, unsigned char pos)
  */
 static void destroy_aux(struct trie_node *node, struct trie_t *trie, int free_data, void *args)
 {
+	struct trie_node *child;
+	unsigned char key;
+	int cursor;
+	for (cursor = 0; (child = next_child(node, &cursor, &key)) != NULL;) {
+		destroy_aux(child, trie, free_data, args);
+	}
+	if (free_data == TRIE_FREE_DATA && node->is_word) {
+		(*trie->free_f)(node->data, args);
+	}
+	free_node(trie, node);
+}
+
+/** Creates the nodes for the tail of a word, that is, the part of the word that is not in the trie yet.
+   @param trie A trie, as returned by `init_trie()`.
+   @param word The characters that are left. Must be null-terminated, and every character must be valid. May be empty.
+   @param data The data to associate to the word.
+   @return The top node of the new path: a leaf whose compressed path is `word`, or, if `word` does not fit in a single
+      node, a chain of nodes. `NULL` if there are no resources to create the path, in which case nothing was allocated.
+ */
+static struct trie_node *new_path(struct trie_t *trie, const char *word, void *data)
+{
+	struct trie_node *node;
+	struct trie_node *child;
+	int len;
 	int i;
-	for (i = 0; i < trie->edges_no; i++) {
-		if (node->edges[i] != NULL) {
-			destroy_aux(node->edges[i], trie, free_data, args);
+
+	child = NULL;
+	if ((len = strlen(word)) > TRIE_MAX_PREFIX) {
+		len = TRIE_MAX_PREFIX;
+		if ((child = new_path(trie, word + TRIE_MAX_PREFIX + 1, data)) == NULL) {
+			return NULL;
 		}
 	}
-	if (free_data == TRIE_FREE_DATA) {
-		(*trie->free_f)(node->data, args);
+	if ((node = alloc_node(trie, child == NULL ? TRIE_LEAF : TRIE_NODE4)) == NULL) {
+		if (child != NULL) {
+			destroy_aux(child, trie, TRIE_NO_FREE_DATA, NULL);
+		}
+		return NULL;
+	}
+	for (i = 0; i < len; i++) {
+		node->prefix[i] = (unsigned char)char_pos(trie, word[i]);
 	}
-	free(node->edges);
-	free(node);
+	node->prefix_len = (unsigned char)len;
+	if (child == NULL) {
+		node->is_word = 1;
+		node->data = data;
+	} else {
+		/* A fresh TRIE_NODE4 always has room */
+		(void)add_child(trie, &node, (unsigned char)char_pos(trie, word[TRIE_MAX_PREFIX]), child);
+	}
+	return node;
+}
+
+/** Splits a node's compressed path. A new node is created to hold the first part of the path, and the old node becomes
+   its child. The new word is added in the same step: it either ends in the new node, or continues in a new path.
+   @param trie A trie, as returned by `init_trie()`.
+   @param ref Where the node to split is stored. The new node is stored here.
+   @param at How many characters of the compressed path are shared with the new word. This is smaller than the node's
+      `prefix_len`.
+   @param word The rest of the new word, after the shared characters.
+   @param data The data to associate to the new word.
+   @return `0` on success; `TRIE_NO_MEM` if there are no resources to split, in which case the trie remains unchanged.
+ */
+static int split_node(struct trie_t *trie, struct trie_node **ref, int at, const char *word, void *data)
+{
+	struct trie_node *node;
+	struct trie_node *parent;
+	struct trie_node *path;
+	unsigned char key;
+
+	node = *ref;
+	path = NULL;
+	if (*word != '\0' && (path = new_path(trie, word + 1, data)) == NULL) {
+		return TRIE_NO_MEM;
+	}
+	if ((parent = alloc_node(trie, TRIE_NODE4)) == NULL) {
+		if (path != NULL) {
+			destroy_aux(path, trie, TRIE_NO_FREE_DATA, NULL);
+		}
+		return TRIE_NO_MEM;
+	}
+	memcpy(parent->prefix, node->prefix, at);
+	parent->prefix_len = (unsigned char)at;
+	key = node->prefix[at];
+	memmove(node->prefix, node->prefix + at + 1, node->prefix_len - at - 1);
+	node->prefix_len -= at + 1;
+	/* A fresh TRIE_NODE4 always has room for these two */
+	(void)add_child(trie, &parent, key, node);
+	if (path == NULL) {
+		parent->is_word = 1;
+		parent->data = data;
+	} else {
+		(void)add_child(trie, &parent, (unsigned char)char_pos(trie, *word), path);
+	}
+	*ref = parent;
+	return 0;
+}
+
+/** Creates a new trie.
+   @param free_function Pointer to function that is called inside `destroy_trie()` to free a word's `data`
+   @param alphabet The characters allowed in this trie's words, usually defined with `TRIE_ALPHABET()`. It is not
+      copied; it must remain valid for as long as the trie exists.
+   @return A new trie instance with no words, or `NULL` if there isn't enough memory to create a trie.
+ */
+struct trie_t *init_trie(void (*free_function)(void *, void *), const struct trie_alphabet *alphabet)
+{
+	struct trie_t *trie;
+	int i;
+	if ((trie = malloc(sizeof(struct trie_t))) == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < TRIE_NODE_TYPES; i++) {
+		trie->slabs[i].free_list = NULL;
+		trie->slabs[i].next = trie->slabs[i].end = NULL;
+		trie->slabs[i].chunk_nodes = TRIE_SLAB_MIN_NODES;
+		trie->slabs[i].live = trie->slabs[i].free = 0;
+		trie->slabs[i].bytes = 0;
+	}
+	trie->chunks = NULL;
+	if ((trie->root = alloc_node(trie, TRIE_LEAF)) == NULL) {
+		free(trie);
+		return NULL;
+	}
+	trie->free_f = free_function;
+	trie->alphabet = alphabet;
+	return trie;
 }
 
 /** Frees every allocated storage for a trie.
    @param trie A trie, as returned by `init_trie()`.
-   @param free_data `TRIE_FREE_DATA` if the free function stored in `trie` shall be used to free each node's data,
+   @param free_data `TRIE_FREE_DATA` if the free function stored in `trie` shall be used to free each word's data,
       `TRIE_NO_FREE_DATA` otherwise
    @param args A pointer to a generic data type that will be passed as the second argument to this trie's node data
       freeing function, as defined in `init_trie()`, if `TRIE_FREE_DATA` is set.  This can be `NULL`. The first
@@ -131,51 +615,32 @@ static void destroy_aux(struct trie_node *node, struct trie_t *trie, int free_da
  */
 void destroy_trie(struct trie_t *trie, int free_data, void *args)
 {
+	struct trie_chunk *chunk;
+	struct trie_chunk *next;
 	destroy_aux(trie->root, trie, free_data, args);
+	for (chunk = trie->chunks; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
 	free(trie);
 }
 
-/** Recursive implementation that is called by `add_word_trie()`.
-   @param root Current node.
+/** Reports how many nodes a trie is using, and how much memory its slabs hold.
    @param trie A trie, as returned by `init_trie()`.
-   @param word The word to add. Must be a null-terminated characters sequence.
-   @param data The data to associate to this word.
-   @return On success, 0 is returned. Otherwise, a non-zero constant is returned to denote an error, which can be either
-      `TRIE_INVALID_WORD` or `TRIE_NO_MEM`.
-   `TRIE_INVALID_WORD` means that there are characters in `word` that are no part of this trie's alphabet, as defined by
-      the functions indicated in `init_trie()`.
-   `TRIE_NO_MEM` means that there wasn't enough memory to add `word`. In this case, it is undefined whether `word` is
-      valid or not: it just means that we couldn't keep onchecking the word and adding the necessary structures anymore.
-   When an error occurs, the trie remains unchanged.
-   @note If the word already exists, its `data` will now point to the new data. Care must be taken not to lose reference
-      to the old data.
+   @param live Where to store how many nodes are in use.
+   @param free_nodes Where to store how many nodes were freed and are waiting to be reused.
+   @param bytes Where to store how many bytes were taken from the system allocator for nodes, including nodes that were
+      never used yet. This does not count the `struct trie_t` itself.
  */
-static int add_word_trie_aux(struct trie_node *root, char *word, struct trie_t *trie, void *data)
+void trie_node_stats(struct trie_t *trie, unsigned long *live, unsigned long *free_nodes, size_t *bytes)
 {
-	unsigned char pos;
-	int ret;
-	if (*word == '\0') {
-		root->is_word = 1;
-		root->data = data;
-		return 0;
-	} else {
-		if (!(*trie->is_valid)(*word)) {
-			return TRIE_INVALID_WORD;
-		}
-		if (root->edges[pos = (*trie->char_to_pos)(*word)] == NULL) {
-			if ((root->edges[pos] = init_node(trie->edges_no)) == NULL) {
-				return TRIE_NO_MEM;
-			}
-			root->children++;
-			if ((ret = add_word_trie_aux(root->edges[pos], word + 1, trie, data)) != 0) {
-				/* There was an error somewhere down there */
-				free_child(root, pos);
-				return ret;
-			}
-			/* assert: ret == 0 */
-			return 0;
-		}
-		return add_word_trie_aux(root->edges[pos], word + 1, trie, data);
+	int i;
+	*live = *free_nodes = 0;
+	*bytes = 0;
+	for (i = 0; i < TRIE_NODE_TYPES; i++) {
+		*live += trie->slabs[i].live;
+		*free_nodes += trie->slabs[i].free;
+		*bytes += trie->slabs[i].bytes;
 	}
 }
 
@@ -187,45 +652,95 @@ static int add_word_trie_aux(struct trie_node *root, char *word, struct trie_t *
       `TRIE_INVALID_WORD` or `TRIE_NO_MEM`.
    `TRIE_INVALID_WORD` means that there are characters in `word` that are no part of this trie's alphabet, as defined by
       the functions indicated in `init_trie()`.
-   `TRIE_NO_MEM` means that there wasn't enough memory to add `word`. In this case, it is undefined whether `word` is
-      valid or not: it just means that we couldn't keep onchecking the word and adding the necessary structures anymore.
+   `TRIE_NO_MEM` means that there wasn't enough memory to add `word`.
    When an error occurs, the trie remains unchanged.
    @note If the word already exists, its `data` will now point to the new data. Care must be taken not to lose reference
       to the old data.
  */
 int add_word_trie(struct trie_t *trie, char *word, void *data)
 {
-	return add_word_trie_aux(trie->root, word, trie, data);
+	struct trie_node **ref;
+	struct trie_node **child;
+	struct trie_node *node;
+	struct trie_node *path;
+	unsigned char key;
+	char *ptr;
+	int i;
+
+	for (ptr = word; *ptr != '\0'; ptr++) {
+		if (char_pos(trie, *ptr) == TRIE_INVALID_POS) {
+			return TRIE_INVALID_WORD;
+		}
+	}
+	for (ref = &trie->root;; ref = child, word++) {
+		node = *ref;
+		for (i = 0; i < node->prefix_len && char_pos(trie, word[i]) == node->prefix[i]; i++)
+			;
+		if (i < node->prefix_len) {
+			return split_node(trie, ref, i, word + i, data);
+		}
+		if (*(word += i) == '\0') {
+			node->is_word = 1;
+			node->data = data;
+			return 0;
+		}
+		key = (unsigned char)char_pos(trie, *word);
+		if ((child = find_child(node, key)) == NULL) {
+			if ((path = new_path(trie, word + 1, data)) == NULL) {
+				return TRIE_NO_MEM;
+			}
+			if (add_child(trie, ref, key, path) == -1) {
+				destroy_aux(path, trie, TRIE_NO_FREE_DATA, NULL);
+				return TRIE_NO_MEM;
+			}
+			return 0;
+		}
+	}
 }
 
-/** Recursive implementation called by `delete_word_trie()`.
-   @param root Current node.
+/** Recursive implementation called by `delete_word_trie()`. On the way back up, children left with no words below them
+   are removed, and children left with a single child are merged with it.
+   @param ref Where the current node is stored.
+   @param word The rest of the word to delete. Must be a null-terminated characters sequence.
    @param trie A trie, as returned by `init_trie()`.
-   @param word The word to delete. Must be a null-terminated characters sequence.
    @return If the word existed, its associated data is returned. Otherwise, `NULL` is returned.
  */
-static void *delete_word_trie_aux(struct trie_node *root, char *word, struct trie_t *trie)
+static void *delete_word_trie_aux(struct trie_node **ref, char *word, struct trie_t *trie)
 {
-	unsigned char pos;
+	struct trie_node *node;
+	struct trie_node **child;
+	unsigned char key;
 	void *ret;
+	int pos;
+	int i;
+
+	node = *ref;
+	for (i = 0; i < node->prefix_len; i++, word++) {
+		if (char_pos(trie, *word) != node->prefix[i]) {
+			return NULL;
+		}
+	}
 	if (*word == '\0') {
-		if (root->is_word) {
-			root->is_word = 0;
-			return root->data;
+		if (!node->is_word) {
+			return NULL;
 		}
+		node->is_word = 0;
+		ret = node->data;
+		node->data = NULL;
+		return ret;
+	}
+	if ((pos = char_pos(trie, *word)) == TRIE_INVALID_POS ||
+	    (child = find_child(node, key = (unsigned char)pos)) == NULL) {
 		return NULL;
+	}
+	ret = delete_word_trie_aux(child, word + 1, trie);
+	if (!(*child)->is_word && (*child)->children == 0) {
+		free_node(trie, *child);
+		remove_child(trie, ref, key);
 	} else {
-		if (!(*trie->is_valid)(*word) || root->edges[pos = (*trie->char_to_pos)(*word)] == NULL) {
-			return NULL;
-		} else {
-			/* assert: root->edges[pos] != NULL */
-			ret = delete_word_trie_aux(root->edges[pos], word + 1, trie);
-			if (root->edges[pos]->children == 0 && !root->edges[pos]->is_word) {
-				free_child(root, pos);
-			}
-			return ret;
-		}
+		try_merge(trie, child);
 	}
+	return ret;
 }
 
 /** Deletes a word from a trie.
@@ -235,27 +750,7 @@ static void *delete_word_trie_aux(struct trie_node *root, char *word, struct tri
  */
 void *delete_word_trie(struct trie_t *trie, char *word)
 {
-	return delete_word_trie_aux(trie->root, word, trie);
-}
-
-/** Recursive search implementation used by `find_word_trie()`.
-   @param root Current node.
-   @param trie A trie, as returned by `init_trie()`.
-   @param word The word to search for. Must be a null-terminated characters sequence.
-   @return The data associated with `word` if there's a match; `NULL` if there's no match, or `word` contains invalid
-      characters.
- */
-static void *find_word_trie_aux(struct trie_node *root, char *word, struct trie_t *trie)
-{
-	struct trie_node *ptr;
-	if (*word == '\0') {
-		return root->is_word ? root->data : NULL;
-	}
-	if (!(*trie->is_valid)(*word)) {
-		return NULL;
-	}
-	ptr = root->edges[(*trie->char_to_pos)(*word)];
-	return ptr ? find_word_trie_aux(ptr, word + 1, trie) : NULL;
+	return delete_word_trie_aux(&trie->root, word, trie);
 }
 
 /** Searches for a word in a trie.
@@ -266,11 +761,28 @@ static void *find_word_trie_aux(struct trie_node *root, char *word, struct trie_
  */
 void *find_word_trie(struct trie_t *trie, char *word)
 {
-	return find_word_trie_aux(trie->root, word, trie);
+	struct trie_node *node;
+	struct trie_node **child;
+	int pos;
+	int i;
+
+	for (node = trie->root;; node = *child, word++) {
+		for (i = 0; i < node->prefix_len; i++, word++) {
+			if (char_pos(trie, *word) != node->prefix[i]) {
+				return NULL;
+			}
+		}
+		if (*word == '\0') {
+			return node->is_word ? node->data : NULL;
+		}
+		if ((pos = char_pos(trie, *word)) == TRIE_INVALID_POS || (child = find_child(node, (unsigned char)pos)) == NULL) {
+			return NULL;
+		}
+	}
 }
 
 /** `trie_for_each()` auxiliary implementation. This function recursively traverses a trie using a DFS approach on a
-   node's edges.
+   node's children.
    @param trie The trie being traversed
    @param node Current node being considered
    @param f A pointer to a function that shall be called if `node` is the end of a word. This function will be passed
@@ -279,14 +791,14 @@ void *find_word_trie(struct trie_t *trie, char *word)
  */
 static void trie_for_each_aux(struct trie_t *trie, struct trie_node *node, void (*f)(void *, void *), void *fargs)
 {
-	int i;
+	struct trie_node *child;
+	unsigned char key;
+	int cursor;
 	if (node->is_word) {
 		(*f)(node->data, fargs);
 	}
-	for (i = 0; i < trie->edges_no; i++) {
-		if (node->edges[i] != NULL) {
-			trie_for_each_aux(trie, node->edges[i], f, fargs);
-		}
+	for (cursor = 0; (child = next_child(node, &cursor, &key)) != NULL;) {
+		trie_for_each_aux(trie, child, f, fargs);
 	}
 }
 
@@ -329,15 +841,17 @@ static inline int trie_stack_empty(struct trie_node_stack *st)
    trie_node_stack_elm` and places it at the top of `st`.
    @param st The stack.
    @param el A trie node that is associated with this element.
-   @param depth This element's depth in the stack.
-   @param letter Last letter used to arrive to this node.
+   @param depth How many characters were written to the path before reaching `el`.
+   @param letter Last letter used to arrive to this node, or `-1` if `el` is where the prefix ends.
+   @param skip How many characters of `el`'s compressed path belong to the prefix.
    @return A pointer to the new node pushed, or `NULL` if there wasn't enough memory to push a new node, in which case
       the stack remains unchanged.
  */
 static inline struct trie_node_stack_elm *trie_push(struct trie_node_stack *st,
 						    struct trie_node *el,
 						    int depth,
-						    char letter)
+						    int letter,
+						    int skip)
 {
 	struct trie_node_stack_elm *new_el;
 
@@ -346,6 +860,7 @@ static inline struct trie_node_stack_elm *trie_push(struct trie_node_stack *st,
 	}
 
 	new_el->letter = letter;
+	new_el->skip = skip;
 	new_el->depth = depth;
 	new_el->next = st->top;
 	st->top = new_el;
@@ -354,6 +869,32 @@ static inline struct trie_node_stack_elm *trie_push(struct trie_node_stack *st,
 	return new_el;
 }
 
+/** Pushes every child of a node into a stack of an on going search by prefix, in descending key order, so that they
+   are popped in ascending key order.
+   @param st The stack.
+   @param node The node whose children shall be pushed.
+   @param depth How many characters were written to the path up to, and including, `node`.
+   @param trie A trie, as returned by `init_trie()`
+   @param err_code Set to `TRIE_NO_MEM` if some child could not be pushed. Children that were not pushed yet when this
+      happens are left out.
+ */
+static void trie_push_children(struct trie_node_stack *st, struct trie_node *node, int depth, struct trie_t *trie,
+			       int *err_code)
+{
+	struct trie_node *children[256];
+	unsigned char keys[256];
+	int count;
+	int cursor;
+
+	for (count = 0, cursor = 0; (children[count] = next_child(node, &cursor, &keys[count])) != NULL; count++)
+		;
+	while (count-- > 0 && *err_code == 0) {
+		if (trie_push(st, children[count], depth, (unsigned char)trie->alphabet->chr[keys[count]], 0) == NULL) {
+			*err_code = TRIE_NO_MEM;
+		}
+	}
+}
+
 /** Finds the next match for an on going search by prefix.
    @param st The stack with containing state information. It is assumed that `st != NULL`.
    @param result Buffer that stores the additional path taken by this branch after processing the prefix. For example,
@@ -387,25 +928,32 @@ static struct trie_node_stack *find_by_prefix_next_trie_n(struct trie_node_stack
 							  void **data)
 {
 	struct trie_node_stack_elm *curr;
+	struct trie_node *node;
+	int len;
 	int i;
 	*err_code = 0;
 	while (!trie_stack_empty(st)) {
 		curr = trie_pop(st);
-		if (curr->depth + 1 < st->depth) {
-			for (i = trie->edges_no - 1; i >= 0 && *err_code == 0; i--) {
-				if (curr->el->edges[i] != NULL) {
-					if (trie_push(st, curr->el->edges[i], curr->depth + 1,
-						      (*trie->pos_to_char)(i)) == NULL) {
-						*err_code = TRIE_NO_MEM;
-					}
-				}
-			}
+		node = curr->el;
+		len = curr->depth;
+		if (curr->letter != -1) {
+			st->path[len++] = (char)curr->letter;
+		}
+		for (i = curr->skip; i < node->prefix_len && len < st->depth - 1; i++) {
+			st->path[len++] = trie->alphabet->chr[node->prefix[i]];
 		}
-		st->path[curr->depth - 1] = curr->letter;
-		if (curr->el->is_word) {
-			st->path[curr->depth] = '\0';
+		if (i < node->prefix_len) {
+			/* Every word from here on is too long */
+			free(curr);
+			continue;
+		}
+		if (len + 1 < st->depth) {
+			trie_push_children(st, node, len, trie, err_code);
+		}
+		if (node->is_word) {
+			st->path[len] = '\0';
 			strcpy(result, st->path);
-			*data = curr->el->data;
+			*data = node->data;
 			free(curr);
 			return st;
 		}
@@ -482,19 +1030,31 @@ struct trie_node_stack *find_by_prefix_next_trie(struct trie_t *trie,
 						 void **data)
 {
 	struct trie_node *n;
+	struct trie_node **child;
 	struct trie_node_stack *new_st;
 	const char *ptr;
+	int pos;
 	int i;
 	int size;
 
 	*err_code = 0;
 	if (st == NULL) {
-		for (size = 0, n = trie->root, ptr = prefix; *ptr != '\0'; ptr++, size++) {
-			if (!(*trie->is_valid)(*ptr) || (n = n->edges[(*trie->char_to_pos)(*ptr)]) == NULL) {
+		for (n = trie->root, ptr = prefix;; n = *child, ptr++) {
+			for (i = 0; i < n->prefix_len && *ptr != '\0'; i++, ptr++) {
+				if (char_pos(trie, *ptr) != n->prefix[i]) {
+					return NULL;
+				}
+			}
+			if (*ptr == '\0') {
+				break;
+			}
+			if ((pos = char_pos(trie, *ptr)) == TRIE_INVALID_POS ||
+			    (child = find_child(n, (unsigned char)pos)) == NULL) {
 				return NULL;
 			}
 		}
-		/* assert: n != NULL */
+		/* assert: n != NULL, and the first i characters of its compressed path are part of the prefix */
+		size = ptr - prefix;
 		if ((st = malloc(sizeof(struct trie_node_stack))) == NULL) {
 			return NULL;
 		}
@@ -509,20 +1069,10 @@ struct trie_node_stack *find_by_prefix_next_trie(struct trie_t *trie,
 		}
 		st->top = NULL;
 		st->depth = depth - size;
-		if (st->depth > 1) {
-			/* We can still write at least 1 char in result */
-			for (i = trie->edges_no - 1; i >= 0 && *err_code == 0; i--) {
-				if (n->edges[i] != NULL) {
-					if (trie_push(st, n->edges[i], 1, (*trie->pos_to_char)(i)) == NULL) {
-						*err_code = TRIE_NO_MEM;
-					}
-				}
-			}
-		}
-		if (n->is_word) {
-			strcpy(result, st->prefix);
-			*data = n->data;
-			return st;
+		if (trie_push(st, n, 0, -1, i) == NULL) {
+			*err_code = TRIE_NO_MEM;
+			free_trie_stack(st);
+			return NULL;
 		}
 	}
 	result += sprintf(result, "%s", st->prefix);
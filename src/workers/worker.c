@@ -0,0 +1,381 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <ev.h>
+#include "client.h"
+#include "worker.h"
+#include "resolver.h"
+
+/** @file
+   @brief Worker threads implementation
+
+   A worker is nothing more than a detached thread sitting in `ev_run()` on its own loop. The loop is kept alive by the
+      worker's handoff watcher, so it never runs out of active watchers, even when no clients are assigned to it.
+   Clients with new messages queued by other threads are kept in their worker's ready list. The ready list is protected
+      by a mutex, like the handoff and DNS lists, but the worker is only signaled when `ready_pending` goes from `0` to
+      `1`, and a client is only added to the list when his `wakeup_pending` flag goes from `0` to `1`. The worker clears
+      `ready_pending` before taking the list, and each client's flag before flushing him, so a message queued meanwhile
+      always triggers a new wakeup.
+   The load of each worker is the number of clients it is currently serving. It is incremented by the main thread in
+      `worker_dispatch()` as soon as a connection is assigned, and decremented by the worker with `worker_release()`
+      when a client is gone (or could not be created). Both operations are atomic, so that the main thread can read a
+      reasonably accurate load figure without grabbing any lock.
+   @author Filipe Goncalves
+   @date November 2013
+ */
+
+static struct irc_worker *workers; /**<Array of workers. This is allocated once by `workers_init()` and never freed. */
+static int workers_count; /**<How many positions of `workers` are in use */
+static int next_worker; /**<Where `worker_dispatch()` starts looking for the least loaded worker. Only the main thread
+                           touches this. */
+
+/** Callback function for a worker's handoff watcher. It is called in the worker's thread after the main thread
+   handed over one or more new connections with `worker_dispatch()`.
+   The pending list is detached while holding the lock, and each connection is then set up with `new_client()`, in the
+   same order they were accepted.
+   @param w Pointer to the worker's handoff watcher. A pointer to the worker is obtained with `(struct irc_worker *)
+      ((char *)w - offsetof(struct irc_worker, handoff_watcher))`.
+   @param revents libev's flags. Not used for async callbacks.
+ */
+static void handoff_cb(EV_P_ ev_async *w, int revents)
+{
+	struct irc_worker *worker;
+	struct irc_client_args_wrapper *pending;
+	struct irc_client_args_wrapper *ordered;
+	struct irc_client_args_wrapper *next;
+
+	worker = (struct irc_worker*)((char*)w - offsetof(struct irc_worker, handoff_watcher));
+
+	pthread_mutex_lock(&worker->handoff_mutex);
+	pending = worker->handoff;
+	worker->handoff = NULL;
+	pthread_mutex_unlock(&worker->handoff_mutex);
+
+	/* The list was built by pushing to the head; reverse it so that clients are served in arrival order */
+	for (ordered = NULL; pending != NULL; pending = next) {
+		next = pending->next;
+		pending->next = ordered;
+		ordered = pending;
+	}
+	for (; ordered != NULL; ordered = next) {
+		next = ordered->next;
+		if (new_client(worker, ordered) == -1) {
+			worker_release(worker);
+		}
+	}
+}
+
+/** Callback function for a worker's DNS watcher. It is called in the worker's thread after a resolver thread handed
+   back one or more reverse lookups with `worker_post_dns()`.
+   Answers are delivered to the clients waiting for them with `client_dns_done()`; queries that were cancelled meanwhile
+   are just freed. Either way, this is where every query is freed.
+   @param w Pointer to the worker's DNS watcher.
+   @param revents libev's flags. Not used for async callbacks.
+ */
+static void dns_cb(EV_P_ ev_async *w, int revents)
+{
+	struct irc_worker *worker;
+	struct dns_query *answers;
+	struct dns_query *next;
+
+	worker = (struct irc_worker*)((char*)w - offsetof(struct irc_worker, dns_watcher));
+
+	pthread_mutex_lock(&worker->dns_mutex);
+	answers = worker->dns_answers;
+	worker->dns_answers = NULL;
+	pthread_mutex_unlock(&worker->dns_mutex);
+
+	for (; answers != NULL; answers = next) {
+		next = answers->next;
+		if (!__atomic_load_n(&answers->cancelled, __ATOMIC_RELAXED)) {
+			client_dns_done(answers);
+		}
+		free(answers);
+	}
+}
+
+/** Flushes the queue of every client in a worker's ready list. The ready list is detached while holding the lock, and
+   every client in it is handed to `client_wakeup()`.
+   @param worker The worker. This must be called in the worker's thread.
+   @param current The client whose callback is running, if any; `NULL` otherwise. He is not handed to `client_wakeup()`,
+      which may destroy him; his queue is flushed by `finish_callback()` when his callback returns.
+ */
+void worker_flush_ready(struct irc_worker *worker, struct irc_client *current)
+{
+	struct irc_client *ready;
+	struct irc_client *next;
+
+	pthread_mutex_lock(&worker->ready_mutex);
+	ready = worker->ready;
+	worker->ready = NULL;
+	pthread_mutex_unlock(&worker->ready_mutex);
+
+	for (; ready != NULL; ready = next) {
+		next = ready->ready_next;
+		if (ready == current) {
+			__atomic_store_n(&current->wakeup_pending, 0, __ATOMIC_SEQ_CST);
+		} else {
+			client_wakeup(ready);
+		}
+	}
+}
+
+/** Callback function for a worker's ready watcher. It is called in the worker's thread after other threads queued
+   messages for one or more of the worker's clients, and added them to the ready list with `worker_notify()`.
+   See `worker_flush_ready()`.
+   @param w Pointer to the worker's ready watcher.
+   @param revents libev's flags. Not used for async callbacks.
+ */
+static void ready_cb(EV_P_ ev_async *w, int revents)
+{
+	struct irc_worker *worker;
+
+	worker = (struct irc_worker*)((char*)w - offsetof(struct irc_worker, ready_watcher));
+
+	/* Anyone adding a client after this point signals us again */
+	__atomic_store_n(&worker->ready_pending, 0, __ATOMIC_SEQ_CST);
+	worker_flush_ready(worker, NULL);
+}
+
+/** A worker's thread starting point. Runs the worker's loop forever.
+   @param arg Pointer to the `struct irc_worker` this thread is running.
+   @return This function never returns.
+ */
+static void *worker_main(void *arg)
+{
+	struct irc_worker *worker = (struct irc_worker*)arg;
+	ev_run(worker->ev_loop, 0);
+	return NULL;
+}
+
+/** Creates the workers pool and starts every worker thread.
+   @param threads How many workers to start. If this is `0` or negative, one worker is started for each online CPU
+      core, as reported by `sysconf()`.
+   @return `0` on success; `-1` if the pool could not be created, in which case an error message is printed. Workers
+      that were started before the error are left running; the caller is expected to abort the boot sequence.
+   @warning This function must be called exactly once, by the main thread, before any connection is accepted.
+ */
+int workers_init(int threads)
+{
+	pthread_attr_t attr;
+	int i;
+
+	if (threads <= 0) {
+		threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		if (threads <= 0) {
+			threads = 1;
+		}
+	}
+	if ((workers = calloc((size_t)threads, sizeof(*workers))) == NULL) {
+		fprintf(stderr, "::worker.c:workers_init(): Could not allocate memory for %d workers.\n", threads);
+		return -1;
+	}
+	if (pthread_attr_init(&attr) != 0) {
+		perror("::worker.c:workers_init(): Could not initialize thread attributes");
+		return -1;
+	}
+	/* Workers live as long as the process; nobody will ever join them */
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for (i = 0; i < threads; i++) {
+		if ((workers[i].ev_loop = ev_loop_new(EVFLAG_AUTO)) == NULL) {
+			fprintf(stderr, "::worker.c:workers_init(): Could not create events loop for worker %d.\n", i);
+			pthread_attr_destroy(&attr);
+			return -1;
+		}
+		pthread_mutex_init(&workers[i].handoff_mutex, NULL);
+		workers[i].handoff = NULL;
+		workers[i].clients = 0;
+		ev_async_init(&workers[i].handoff_watcher, handoff_cb);
+		ev_async_start(workers[i].ev_loop, &workers[i].handoff_watcher);
+		pthread_mutex_init(&workers[i].dns_mutex, NULL);
+		workers[i].dns_answers = NULL;
+		ev_async_init(&workers[i].dns_watcher, dns_cb);
+		ev_async_start(workers[i].ev_loop, &workers[i].dns_watcher);
+		pthread_mutex_init(&workers[i].ready_mutex, NULL);
+		workers[i].ready = NULL;
+		workers[i].ready_pending = 0;
+		workers[i].notified = 0;
+		workers[i].wakeups = 0;
+		ev_async_init(&workers[i].ready_watcher, ready_cb);
+		ev_async_start(workers[i].ev_loop, &workers[i].ready_watcher);
+		if (pthread_create(&workers[i].thread_id, &attr, worker_main, (void*)&workers[i]) != 0) {
+			perror("::worker.c:workers_init(): Could not create worker thread");
+			pthread_attr_destroy(&attr);
+			return -1;
+		}
+		workers_count++;
+	}
+	pthread_attr_destroy(&attr);
+	return 0;
+}
+
+/** Hands a freshly accepted connection over to the least loaded worker. Ties are broken in a round-robin fashion, so
+   that an idle server spreads its first clients across every worker.
+   The connection is queued in the worker's handoff list and the worker is woken up; the client structure is created
+   later, in the worker's thread. Ownership of `args` is transferred to the worker.
+   @param args The new connection's arguments wrapper. Must be dynamically allocated.
+   @warning This function is meant to be called by the main thread only.
+ */
+void worker_dispatch(struct irc_client_args_wrapper *args)
+{
+	struct irc_worker *worker;
+	struct irc_worker *candidate;
+	int i;
+
+	worker = &workers[next_worker];
+	for (i = 1; i < workers_count; i++) {
+		candidate = &workers[(next_worker + i) % workers_count];
+		if (__atomic_load_n(&candidate->clients, __ATOMIC_RELAXED) <
+		    __atomic_load_n(&worker->clients, __ATOMIC_RELAXED)) {
+			worker = candidate;
+		}
+	}
+	next_worker = (next_worker + 1) % workers_count;
+	__atomic_add_fetch(&worker->clients, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&worker->handoff_mutex);
+	args->next = worker->handoff;
+	worker->handoff = args;
+	pthread_mutex_unlock(&worker->handoff_mutex);
+
+	ev_async_send(worker->ev_loop, &worker->handoff_watcher);
+}
+
+/** Tells a worker that one of its clients is gone. This decrements the worker's load.
+   @param worker The worker that was serving the client.
+ */
+void worker_release(struct irc_worker *worker)
+{
+	__atomic_sub_fetch(&worker->clients, 1, __ATOMIC_RELAXED);
+}
+
+/** Hands a reverse lookup back to the worker that submitted it, and wakes the worker up. Ownership of `query` is
+   transferred to the worker.
+   @param worker The worker that submitted `query`.
+   @param query The query, answered or cancelled.
+   @warning This is meant to be called by the resolver threads only.
+ */
+void worker_post_dns(struct irc_worker *worker, struct dns_query *query)
+{
+	pthread_mutex_lock(&worker->dns_mutex);
+	query->next = worker->dns_answers;
+	worker->dns_answers = query;
+	pthread_mutex_unlock(&worker->dns_mutex);
+
+	ev_async_send(worker->ev_loop, &worker->dns_watcher);
+}
+
+/** Initializes an empty set of workers to wake up.
+   @param wakeups The set.
+ */
+void worker_wakeups_init(struct worker_wakeups *wakeups)
+{
+	wakeups->count = 0;
+}
+
+/** Signals a worker's ready watcher, unless it was already signaled and the worker did not pick up its ready list yet.
+   @param worker The worker.
+ */
+static void worker_wake(struct irc_worker *worker)
+{
+	if (__atomic_exchange_n(&worker->ready_pending, 1, __ATOMIC_SEQ_CST) == 0) {
+		__atomic_add_fetch(&worker->wakeups, 1, __ATOMIC_RELAXED);
+		ev_async_send(worker->ev_loop, &worker->ready_watcher);
+	}
+}
+
+/** Tells a client's worker that new messages were queued for the client. This must be called after the messages were
+   queued. The client is added to his worker's ready list, unless he is already there.
+   @param client The client.
+   @param wakeups If this is `NULL`, the worker is woken up right away, if needed. Otherwise, the worker is added to
+      `wakeups`, and the caller must call `worker_wakeups_flush()` later on, typically after releasing the locks that
+      made it safe to use `client`.
+   @warning The caller must make sure that `client` is not destroyed while this function runs. Threads delivering
+      messages do this by holding a lock that `client` must acquire to leave the channel or the clients list where it
+      was found.
+ */
+void worker_notify(struct irc_client *client, struct worker_wakeups *wakeups)
+{
+	struct irc_worker *worker;
+	int i;
+
+	worker = client->worker;
+	__atomic_add_fetch(&worker->notified, 1, __ATOMIC_RELAXED);
+	/* This orders the messages just queued before the flag: if the worker already cleared it, we see 0 */
+	if (__atomic_exchange_n(&client->wakeup_pending, 1, __ATOMIC_SEQ_CST) != 0) {
+		/* He's already in the ready list, and his worker was (or will be) woken up */
+		return;
+	}
+	pthread_mutex_lock(&worker->ready_mutex);
+	client->ready_next = worker->ready;
+	worker->ready = client;
+	pthread_mutex_unlock(&worker->ready_mutex);
+
+	if (wakeups == NULL) {
+		worker_wake(worker);
+		return;
+	}
+	for (i = 0; i < wakeups->count && wakeups->workers[i] != worker; i++)
+		; /* Intentionally left blank */
+	if (i < wakeups->count) {
+		return;
+	}
+	if (wakeups->count == WORKER_WAKEUPS_MAX) {
+		worker_wake(worker);
+	} else {
+		wakeups->workers[wakeups->count++] = worker;
+	}
+}
+
+/** Wakes up every worker in a set, and empties the set.
+   @param wakeups The set.
+ */
+void worker_wakeups_flush(struct worker_wakeups *wakeups)
+{
+	int i;
+	for (i = 0; i < wakeups->count; i++) {
+		worker_wake(wakeups->workers[i]);
+	}
+	wakeups->count = 0;
+}
+
+/** Removes a client from his worker's ready list. This is called right before the client is freed.
+   @param client The client. No other thread can be able to reach him anymore, so that he can't be added to the ready
+      list again.
+   @warning This is meant to be called by the worker serving `client` only.
+ */
+void worker_forget(struct irc_client *client)
+{
+	struct irc_worker *worker;
+	struct irc_client **ptr;
+
+	if (!__atomic_load_n(&client->wakeup_pending, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	worker = client->worker;
+	pthread_mutex_lock(&worker->ready_mutex);
+	for (ptr = &worker->ready; *ptr != NULL && *ptr != client; ptr = &(*ptr)->ready_next)
+		; /* Intentionally left blank */
+	if (*ptr != NULL) {
+		*ptr = client->ready_next;
+	}
+	pthread_mutex_unlock(&worker->ready_mutex);
+}
+
+/** Reports how many cross-thread deliveries were made, and how many wakeups they took, over every worker.
+   @param notified Where to store how many times `worker_notify()` was called.
+   @param wakeups Where to store how many times a worker's ready watcher was actually signaled.
+ */
+void worker_wakeup_stats(unsigned long *notified, unsigned long *wakeups)
+{
+	int i;
+	*notified = 0;
+	*wakeups = 0;
+	for (i = 0; i < workers_count; i++) {
+		*notified += __atomic_load_n(&workers[i].notified, __ATOMIC_RELAXED);
+		*wakeups += __atomic_load_n(&workers[i].wakeups, __ATOMIC_RELAXED);
+	}
+}
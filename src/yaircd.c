@@ -18,6 +18,10 @@
 #include "channel.h"
 #include "serverinfo.h"
 #include "interpretmsg.h"
+#include "worker.h"
+#include "resolver.h"
+#include "cloak.h"
+#include "read_msgs.h"
 
 /**
    @file
@@ -25,15 +29,15 @@
 
    Where it all begins. The functions in this file are responsible for booting the IRCd.
    A daemon process is created. This process will be awaken by `libev`'s callback mechanism when a newconnection request
-      arrives. When that happens, a new thread is created to deal with our fortunate new client,and the main process
+      arrives. When that happens, our fortunate new client is handed to one of the worker threads, and the main process
       goes back to rest until another client pops in and the whole cycle repeats.
-   The basic architecture is a client-server model where each client is represented by a dedicated thread that monitors
-      the client's socket.
-   The parent thread listens on the main socket for new incoming connections. When one arrives, it creates a separate
-      thread to deal with that new clientduring his session, and goes back to listening for new clients. We use detached
-      threads, because no calls to `pthread_join()` are used. This makes it slightly easierand more efficient for the
-      operating system to deal with, since no state information must be stored about dead threads. This is often the
-      case for server daemons.
+   The basic architecture is a client-server model where clients are served by a fixed pool of worker threads (see
+      `worker.h`). The pool is created at boot time, with as many workers as configured (by default, one per CPU core),
+      and each worker monitors the sockets of every client assigned to it.
+   The parent thread listens on the main socket for new incoming connections. When one arrives, it hands the connection
+      to the least loaded worker, and goes back to listening for new clients. Workers are detached threads, because no
+      calls to `pthread_join()` are used. Creating a thread per client does not scale: with thousands of users, context
+      switches and per-thread stacks end up dominating CPU and memory usage long before the protocol work does.
    There are a couple of details worth mentioning about the whole IRCd. First of all, it relies heavily on libev. libev
       is a high performanceevent loop library. Only when there is actually something interesting to process (a new
       command arrived, a message must be sent, etc.), will the corresponding threadbe awaken. When there's nothing to
@@ -45,15 +49,16 @@
    Events are defined using watchers. There are various types of watchers. One of them is the IO watcher, which allows
       you to get notified when a file stream is readable. You don't have toblock on a read operation, because you will
       only be notified that there is something to read when there really is something to read. Thus, `read()` never
-      blocks.yaIRCd creates an event loop for each new client connection. In other words, each thread has its own events
-      loop, and each thread registers an IO watcher for the client's socket. As a consequence,each client's thread is
-      sleeping most of the time, and it is awaken when new messages are available to read on the socket.
+      blocks.yaIRCd creates an event loop for each worker. In other words, each worker has its own events loop, and every
+      client registers an IO watcher for his socket in the loop of the worker serving him. As a consequence, each
+      worker is sleeping most of the time, and it is awaken when new messages are available to read on one of its
+      clients' sockets.
    A similar process happens when we need to write to a client's socket.
    Some questions that bugged the development team when adopting the library will probably be your questions as well.
       These include:
    <ul>
    <li>
-   What happens if an event is being processed and another event arises? For example, a thread is doing some work
+   What happens if an event is being processed and another event arises? For example, a worker is doing some work
       because an IO watcher fired, and meanwhile, a timeout event fires (libev allows you to define timers to expire and
       call a function after a given period of time). It turns out that there is no way another event can arise while a
       callback is being executed. Events are fetched from the kernelonly after callbacks have been processed. Events are
@@ -105,8 +110,6 @@ static struct sockaddr_in serv_addr; /**<This node's address, namely, the IP and
                                         standard connections. */
 static struct sockaddr_in ssl_addr; /**<This node's address, namely, the IP and port where we will be listening for new
                                        secure connections. */
-static pthread_attr_t thread_attr; /**<Threads creation attributes. We use detached threads, since we're not interested
-                                      in calling `pthread_join()`. */
 
 static const SSL_METHOD *ssl_method; /**<Openssl's structure holding information about the specific SSL protocol used.
                                         This code uses SSLv23 method. */
@@ -139,6 +142,10 @@ int initSSL(void)
 		return 1;
 	}
 
+	/* Client sockets are non-blocking, and write queues are flushed in chunks: let SSL_write() report partial writes,
+	   and let a write that would block be retried from a different buffer holding the same data */
+	SSL_CTX_set_mode(ssl_context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
 	/*	How to generate a self-signed certificate?
 	 *  Using openssl, right?
 	 *      Just run this:
@@ -182,6 +189,7 @@ void shutSSL(void)
 }
 
 /** Initializes the server's data structures. As of this writing, these include the clients list, channels list, and commands list. The clients list is managed by client_list.c, the channels list by channel.c, and the commands list by interpretmsg.c.
+The cloaking module's precomputed hash states and cache are set up here as well (see cloak.c), and so is the messages reader's newlines scanner (see read_msgs.c).
 @return `0` on success; `-1` if an error occurred, typically indicating a resource allocation problem.
 */
 int init_data_structures(void) {
@@ -199,13 +207,16 @@ int init_data_structures(void) {
 		fprintf(stderr, "::yaircd.c:init_data_structures(): Unable to initialize server commands list.\n");
 		return -1;
 	}
+
+	cloak_init();
+	read_msgs_init();
 	return 0;
 }
 
 /** The core. This function sets it all up. 
 The first step is to load the server information. This information is read from the configuration file and stored in a way that is accessible through the functions defined in serverinfo.h
 Then, SIGPIPE is disabled, to prevent any misbehaved client's connection from bringing our server down. It creates the main socket, assigning it to `mainsock_fd`, as well as the secure socket (`sslsock_fd`), and fills `serv_addr` with the necessary fields. Both sockets are created with the option `SO_REUSEADDR`
-The threads attributes variable, `thread_attr` is initialized with `PTHREAD_CREATE_DETACHED`, since we won't be joining any thread. The main socket is not polled for new clients; instead, `libev` is used with a watcher that calls `connection_cb` when a new connection request arrives. Default events loop is used.
+The workers pool is started with `get_worker_threads()` workers. The main socket is not polled for new clients; instead, `libev` is used with a watcher that calls `connection_cb` when a new connection request arrives. Default events loop is used.
 The server's data structures, such as clients list, channels list, commands list, etc, are all initialized before the socket starts accepting new connections.
 @return `1` on error; `0` otherwise
 @todo Think about IRCd logging features
@@ -309,14 +320,16 @@ int ircd_boot(void)
 		return 1;
 	}
 
-	/* Initialize thread creation attributes */
-	if (pthread_attr_init(&thread_attr) != 0) {
-		/* On Linux, this will never happen */
-		perror("::yaircd.c:main(): Could not initialize thread attributes");
+	/* Start the workers that will serve our clients */
+	if (workers_init(get_worker_threads()) == -1) {
+		fprintf(stderr, "::yaircd.c:ircd_boot(): Unable to start worker threads.\n");
 		return 1;
 	}
-	/* We want detached threads */
-	pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+	if (resolver_init(get_resolver_threads(), get_dns_cache_ttl(), get_hosts_file()) == -1) {
+		fprintf(stderr, "::yaircd.c:ircd_boot(): Unable to start the DNS resolver.\n");
+		return 1;
+	}
+
 	/* At this point, we're ready to accept new clients. Set the callback function for new connections */
 	loop = EV_DEFAULT;
 	ev_io_init(&socket_watcher, connection_cb, mainsock_fd, EV_READ);
@@ -339,17 +352,16 @@ int main(void)
 	return ircd_boot();
 }
 
-void free_thread_arguments(struct irc_client_args_wrapper *args);
+void free_client_arguments(struct irc_client_args_wrapper *args);
 
 /** This function accepts a new generic incoming connection. It wraps the client's information in a dynamically
-   allocated `irc_client_args_wrapper` structure to be passed to `pthread_create()`. Every new client gets a dedicated
-   thread whose starting point is `new_client()`.
+   allocated `irc_client_args_wrapper` structure that is handed to a worker with `worker_dispatch()`. The worker then
+   sets up the client with `new_client()`.
    This function returns prematurely if:
    <ul>
    <li>an `EV_ERROR` occurred, or `EV_READ` was not set for some reason;</li>
    <li>`accept()` returned an error code and no socket could be created;</li>
-   <li>the client address is malformed, namely, its family is not `AF_INET`;</li>
-   <li>the operating system reports that no thread could be created.</li>
+   <li>the client address is malformed, namely, its family is not `AF_INET`.</li>
    </ul>
    @param revents Bit flags reported by `libev`. Can be `EV_ERROR` or `EV_READ`.
    @param flags Flags to change default behavior. Possible flags include:
@@ -361,8 +373,7 @@ void free_thread_arguments(struct irc_client_args_wrapper *args);
 static void accept_connection(int revents, int flags)
 {
 	int newsock_fd;
-	struct irc_client_args_wrapper *thread_arguments; /* Wrapper for passing arguments to thread function */
-	pthread_t thread_id;
+	struct irc_client_args_wrapper *client_arguments; /* Wrapper for passing arguments to the worker */
 
 	/* NOTES: possible event bits are EV_READ and EV_ERROR */
 	if (revents & EV_ERROR) {
@@ -377,73 +388,65 @@ static void accept_connection(int revents, int flags)
 		return;
 	}
 
-	if ((thread_arguments = malloc(sizeof(struct irc_client_args_wrapper))) == NULL) {
+	if ((client_arguments = malloc(sizeof(struct irc_client_args_wrapper))) == NULL) {
 		fprintf(stderr,
-			"::yaircd.c:accept_connection(): Could not allocate wrapper for new thread arguments.\n");
+			"::yaircd.c:accept_connection(): Could not allocate wrapper for new client arguments.\n");
 		return;
 	}
 
-	thread_arguments->address_length = sizeof(thread_arguments->address.ipv4_address);
-	thread_arguments->is_ipv6 = 0;
+	client_arguments->address_length = sizeof(client_arguments->address.ipv4_address);
+	client_arguments->is_ipv6 = 0;
 	newsock_fd = accept((flags & SSL_SOCK) ? sslsock_fd : mainsock_fd,
-			    (struct sockaddr*)&thread_arguments->address.ipv4_address,
-			    &thread_arguments->address_length);
+			    (struct sockaddr*)&client_arguments->address.ipv4_address,
+			    &client_arguments->address_length);
 
 	if (newsock_fd == -1) {
 		perror("::yaircd.c:accept_connection(): Error while accepting new client connection");
-		free(thread_arguments);
+		free(client_arguments);
 		return;
 	}
 
-	if (thread_arguments->address.ipv4_address.sin_family != AF_INET) {
+	if (client_arguments->address.ipv4_address.sin_family != AF_INET) {
 		/* This should never happen */
 		fprintf(stderr, "::yaircd.c:accept_connection(): Invalid sockaddr_in family.\n");
 		close(newsock_fd); /* We hang up on this client, sorry! */
-		free(thread_arguments);
+		free(client_arguments);
 		return;
 	}
 
-	thread_arguments->socket = newsock_fd;
+	client_arguments->socket = newsock_fd;
+	client_arguments->sendq = (size_t)((flags & SSL_SOCK) ? get_ssl_socket_sendq() : get_std_socket_sendq());
+	client_arguments->recvq = (flags & SSL_SOCK) ? get_ssl_socket_recvq() : get_std_socket_recvq();
 
 	if (flags & SSL_SOCK) {
 		/* Create SSL structure */
-		thread_arguments->ssl = SSL_new(ssl_context);
-		/* Assign the socket to the SSL structure */
-		SSL_set_fd(thread_arguments->ssl, newsock_fd);
-		/* SSL Handshake */
-		if (SSL_accept(thread_arguments->ssl) == -1) {
-			SSL_shutdown(thread_arguments->ssl);
-			SSL_free(thread_arguments->ssl);
-			fprintf(stderr, "::yaircd.c:accept_connection(): SSL Handshake failed.\n");
+		if ((client_arguments->ssl = SSL_new(ssl_context)) == NULL) {
+			fprintf(stderr, "::yaircd.c:accept_connection(): Could not create SSL structure.\n");
 			close(newsock_fd);
-			free_thread_arguments(thread_arguments);
+			free_client_arguments(client_arguments);
 			return;
 		}
+		/* Assign the socket to the SSL structure */
+		SSL_set_fd(client_arguments->ssl, newsock_fd);
+		/* The handshake is not performed here: a slow client would hold up every new connection. The worker
+		   drives it without blocking, see new_client() */
+		SSL_set_accept_state(client_arguments->ssl);
 	}else {
-		thread_arguments->ssl = NULL;
+		client_arguments->ssl = NULL;
 	}
 
-	/* thread_arguments will be freed inside the new thread at the right time */
-	if (pthread_create(&thread_id, &thread_attr, new_client, (void*)thread_arguments) < 0) {
-		perror("::yaircd.c:accept_connection(): could not create new thread");
-		if (flags & SSL_SOCK) {
-			SSL_shutdown(thread_arguments->ssl);
-			SSL_free(thread_arguments->ssl);
-		}
-		close(newsock_fd);
-		free_thread_arguments(thread_arguments);
-	}
+	/* client_arguments will be freed by the worker at the right time */
+	worker_dispatch(client_arguments);
 }
 
 /** Callback function that is called when new clients arrive. It accepts the new connection and wraps the client's
-   information in a dynamically allocated `irc_client_args_wrapper` structure to be passed to `pthread_create()`. Every
-   new client gets a dedicated thread whose starting point is `new_client()`.
+   information in a dynamically allocated `irc_client_args_wrapper` structure that is handed to a worker with
+   `worker_dispatch()`. The worker then sets up the client with `new_client()`.
    This function returns prematurely if:
    <ul>
    <li>an `EV_ERROR` occurred, or `EV_READ` was not set for some reason;</li>
    <li>`accept()` returned an error code and no socket could be created;</li>
-   <li>the client address is malformed, namely, its family is not `AF_INET`;</li>
-   <li>the operating system reports that no thread could be created.</li>
+   <li>the client address is malformed, namely, its family is not `AF_INET`.</li>
    </ul>
    @param w The watcher that caused this callback to execute. Always comes from the main default loop.
    @param revents Bit flags reported by `libev`. Can be `EV_ERROR` or `EV_READ`.
@@ -454,14 +457,13 @@ static void connection_cb(EV_P_ ev_io *w, int revents)
 }
 
 /** Callback function that is called when new SSL clients arrive. It accepts the new connection and wraps the client's
-   information in a dynamically allocated `irc_client_args_wrapper` structure to be passed to `pthread_create()`. Every
-   new client gets a dedicated thread whose starting point is `new_client()`.
+   information in a dynamically allocated `irc_client_args_wrapper` structure that is handed to a worker with
+   `worker_dispatch()`. The worker then sets up the client with `new_client()`.
    This function returns prematurely if:
    <ul>
    <li>an `EV_ERROR` occurred, or `EV_READ` was not set for some reason;</li>
    <li>`accept()` returned an error code and no socket could be created;</li>
-   <li>the client address is malformed, namely, its family is not `AF_INET`;</li>
-   <li>the operating system reports that no thread could be created.</li>
+   <li>the client address is malformed, namely, its family is not `AF_INET`.</li>
    </ul>
    @param w The watcher that caused this callback to execute. Always comes from the main default loop.
    @param revents Bit flags reported by `libev`. Can be `EV_ERROR` or `EV_READ`.
@@ -471,10 +473,10 @@ static void ssl_connection_cb(EV_P_ ev_io *w, int revents)
 	accept_connection(revents, SSL_SOCK);
 }
 
-/** This is called by a client thread everytime its arguments structure is not needed anymore.
-   @param args A pointer to the arguments structure that was passed to the thread's initialization function.
+/** This is called by a worker everytime a client's arguments structure is not needed anymore.
+   @param args A pointer to the arguments structure that was passed to `new_client()`.
  */
-void free_thread_arguments(struct irc_client_args_wrapper *args)
+void free_client_arguments(struct irc_client_args_wrapper *args)
 {
 	free(args);
 }